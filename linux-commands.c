@@ -11,35 +11,414 @@
  *  - 完全再現ではなく仕組み理解を優先
  * ========================================================= */
 
+#define _GNU_SOURCE             /* pthread_setaffinity_np, fopencookie */
+
 #include <stdio.h>
+#include <ctype.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <malloc.h>
+#endif
 
 /* ===== 定数定義 ===== */
 #define NAME_LEN     32
 #define LINE_LEN     128
-#define MAX_FILES    16
-#define MAX_SUBDIRS  16
-#define MAX_CONTENT  512
+#define PATH_LEN     256
+
+/* ===== 確保と読み書きの計数 =====
+ * 後の「コマンドごとの統計」のため、確保の回数と読み書きした内容のバイト数を
+ * スレッドごとに数える。-DNO_STATS でビルドすると数えない。 */
+#ifndef NO_STATS
+static _Thread_local uint64_t stat_allocs;
+static _Thread_local uint64_t stat_bytes;
+
+static void *counted_malloc(size_t n) {
+    stat_allocs++;
+    return malloc(n);
+}
+
+static void *counted_calloc(size_t k, size_t n) {
+    stat_allocs++;
+    return calloc(k, n);
+}
+
+static void *counted_realloc(void *p, size_t n) {
+    stat_allocs++;
+    return realloc(p, n);
+}
+
+static char *counted_strdup(const char *s) {
+    stat_allocs++;
+    return strdup(s);
+}
+
+#define malloc(n)       counted_malloc(n)
+#define calloc(k, n)    counted_calloc(k, n)
+#define realloc(p, n)   counted_realloc(p, n)
+#define strdup(s)       counted_strdup(s)
+#define STAT_BYTES(n)   (stat_bytes += (n))
+#else
+#define STAT_BYTES(n)   ((void)0)
+#endif
+
+/* ===== イメージ形式 =====
+ * save で書き出し、起動時に mmap して読み込む。
+ * オフセットはすべてイメージ先頭からの相対値で、8 バイト境界に揃える。
+ * ImgDir の直後に ImgFile[file_count]、uint64_t[subdir_count] が続く。 */
+#define IMG_MAGIC    "PSIMG008"
+
+struct ImgHeader {
+    char     magic[8];
+    uint64_t root;
+    uint64_t inodes;            /* ハードリンクの inode の数 */
+};
+
+struct ImgFile {
+    char     name[NAME_LEN];
+    uint32_t mode, uid, gid;
+    uint32_t flags;             /* IMG_SYMLINK */
+    uint64_t size;
+    uint64_t content;
+    uint64_t hash;              /* 内容のハッシュ */
+    uint64_t ino;               /* ハードリンクなら 1 からの inode 番号、でなければ 0 */
+    uint64_t atime, mtime, ctime;
+};
 
-/* ===== ファイル構造体 ===== */
+#define IMG_SYMLINK 1
+
+struct ImgDir {
+    char     name[NAME_LEN];
+    uint32_t file_count;
+    uint32_t subdir_count;
+    uint64_t bytes, files, dirs;    /* 部分木の集計値 */
+    uint64_t hash;                  /* 部分木のハッシュ */
+    uint64_t links;                 /* 部分木にあるハードリンクの数。0 でなければ起動時に展開する */
+    uint32_t mode, uid, gid;
+    uint32_t pad;
+};
+
+/* ===== ファイル構造体 =====
+ * 一覧に載せたあとは書き換えない。名前を変えるときは複製を作って差し替える */
 struct File {
     char name[NAME_LEN];
-    int  size;
-    char perm[8];
-    char content[MAX_CONTENT];
+    size_t size;
+    uint32_t mode;              /* 権限の 9 ビット (0644 など) */
+    uint32_t uid, gid;
+    char *content;              /* malloc 領域、またはイメージ上を直接指す */
+    uint64_t ver;               /* 内容を作ったときの版（スナップショットを参照） */
+    uint64_t hash;              /* 内容のハッシュ (hash64) */
+    size_t zsize;               /* 0 でなければ content は圧縮済みでこの大きさ（冷えた内容の圧縮を参照） */
+    struct Inode *ino;          /* ハードリンクなら共有の inode（ハードリンクを参照） */
+    uint64_t seq;               /* ハードリンクの内容を書いた通番 */
+    int symlink;                /* シンボリックリンクなら 1。内容がリンク先のパス */
+    uint64_t mtime, ctime;      /* 内容を変えた時刻と、内容か属性を変えた時刻 (clock_ns) */
+    /* ここから下は共有中の File にも書く欄（原子的に読み書きし、複製は file_copy で作る） */
+    uint64_t atime;             /* 読んだ時刻。atime_mode に従って書く */
+    uint32_t used;              /* 最後に読まれた時刻 (clock_sec、冷えた内容の圧縮用) */
+    int zskip;                  /* 縮めようとして縮まなかった */
+};
+
+/* 部分木の集計値。自分自身は dirs に含めない */
+struct Usage {
+    uint64_t bytes;
+    uint64_t files;
+    uint64_t dirs;
+    uint64_t hash;              /* 部分木のハッシュ（部分木のハッシュの節を参照） */
+    uint64_t ver;               /* 部分木を最後に変えた版 */
+};
+
+/* 子の一覧。読み手はロックなしで読むので、公開後の要素は
+ * count より後ろへの追記と、ポインタ 1 つの原子的な差し替えしか行わない。
+ * 削除と拡張は新しい配列を作って丸ごと差し替え、古い配列はエポックで解放する */
+struct Slots {
+    int cap;
+    int count;
+    void *item[];
 };
 
 /* ===== ディレクトリ構造体 ===== */
 struct Dir {
     char name[NAME_LEN];
     struct Dir *parent;
-    struct File files[MAX_FILES];
-    int file_count;
-    struct Dir *subdirs[MAX_SUBDIRS];
-    int subdir_count;
+    struct Slots *files;        /* struct File * の一覧 */
+    struct Slots *subdirs;      /* struct Dir * の一覧 */
+    struct Usage usage;         /* 変更のたびに親へ向かって更新する */
+    const struct ImgDir *img;   /* 未展開ならイメージ上のレコード */
+    pthread_mutex_t lock;       /* 書き手どうしの排他。読み手は取らない */
+    struct Txn *txn;            /* このディレクトリを変更中のトランザクション。lock で守る */
+    uint64_t ver;               /* 今の一覧がどの版から有効か */
+    struct Dir *prev;           /* 凍結した前の版（スナップショットを参照） */
+    uint32_t mode, uid, gid;    /* lock の下で書き、読み手は原子的に読む（権限を参照） */
+};
+
+/* ディレクトリの権限を変えるか、Dir を解放するたびに進む（権限の判定の覚え書き用） */
+static uint64_t attr_gen;
+
+/* 読み込み中のイメージ（展開済みでないディレクトリが参照し続ける） */
+static struct {
+    const unsigned char *base;
+    size_t len;
+    struct Inode **inodes;      /* 起動時の展開中だけ持つ、inode 番号からの表 */
+    uint64_t ninodes;
+} image;
+
+/* ===== ハードリンク =====
+ * 同じ内容を指す名前（リンク）どうしは inode を共有する。File は今まで通り名前ごとに
+ * 1 つずつあり、内容は共有の表の参照を分け合ってコピーしない。
+ * 1 つの名前へ書いたら、コマンドの終わりに他の名前の File を同じ内容の複製へ
+ * 差し替える。どれが新しいかは seq で決める。inode は名前の一覧（ディレクトリと名前）を持ち、
+ * 指している File（一覧から外して残しているものを含む）がなくなったら解放する。 */
+struct Link {
+    struct Dir *d;
+    char name[NAME_LEN];
+};
+
+struct Inode {
+    pthread_mutex_t lock;       /* links を守る。ディレクトリのロックより後に取る */
+    long refs;                  /* 指している File の数 */
+    uint64_t seq;
+    struct Link *links;         /* 今木に載っている名前 */
+    size_t nlinks, cap;
+};
+
+/* ===== スナップショット =====
+ * 処理は「スナップショット」の節にある。版は snapshot のたびに 1 つ進む */
+struct Snapshot {
+    char name[NAME_LEN];
+    uint64_t ver;               /* この版の内容を見る */
+};
+
+static uint64_t tree_ver;
+
+/* 実行中のコマンドが読む版。NULL なら現在の木 */
+static _Thread_local const struct Snapshot *view;
+
+/* ===== セッション =====
+ * 接続ごとの状態。REPL では 1 つだけ使う */
+#define UMASK_DEFAULT 022
+
+/* 利用者。uid 0 は権限の判定を受けない */
+struct Cred {
+    uint32_t uid, gid;
+    uint32_t umask;
+};
+
+struct Session {
+    struct Dir *root;
+    struct Dir *cwd;
+    int done;                   /* exit が来た */
+    struct History *hist;       /* 入力した行。最初の行で確保する */
+    struct Txn *txn;            /* begin から commit / rollback まで */
+    const struct Snapshot *snap;    /* cd @name で入ったスナップショット */
+    struct Cred cred;           /* su / umask で変える */
+};
+
+/* 実行中のコマンドの利用者。作るノードの持ち主と mode、権限の判定に使う。
+ * セッションから毎回設定する（ジャーナルの再生ではレコードから） */
+static _Thread_local struct Cred cred;
+
+/* 直近 HISTORY_LEN 行の入力 */
+#define HISTORY_LEN 64
+
+struct History {
+    int next;                   /* 次に書く番号（通算） */
+    char line[HISTORY_LEN][LINE_LEN];
+};
+
+/* コマンドの出力先。スレッド（接続）ごとに持つ */
+static _Thread_local FILE *out;
+
+/* コマンドの入力。パイプラインの後段でだけ開いている */
+static _Thread_local FILE *in;
+
+/* ===== トランザクションの状態 =====
+ * 処理は「トランザクション」の節にある。 */
+struct Undo {
+    int op;                     /* UNDO_* */
+    struct Dir *d, *d2;
+    char name[NAME_LEN], name2[NAME_LEN];
+    void *keep;                 /* 戻すための元の File、または作った Dir */
 };
 
+struct Txn {
+    pthread_mutex_t lock;       /* パイプラインの段やシャードからも積まれる */
+    struct Undo *undo;
+    size_t nundo, undo_cap;
+    struct Dir **claimed;
+    size_t nclaimed, claimed_cap;
+    char *log;                  /* 未書き込みのジャーナルレコード */
+    size_t log_len, log_cap;
+    long nrec;
+    int failed;                 /* 途中で失敗した変更がある */
+};
+
+/* 実行中のコマンドが属するトランザクション。セッションから毎回設定する */
+static _Thread_local struct Txn *txn;
+
+/* 開いているトランザクションの数。0 でないとチェックポイントを延ばす */
+static int txn_open;
+
+/* ===== エポックによる遅延解放 =====
+ * 読み手は epoch_enter / epoch_exit で囲んだ区間でロックを取らずに木を辿る。
+ * 書き手が一覧から外した配列やファイルはすぐには解放せず、外したときの
+ * エポックを付けてスレッドごとのリストへ退避する。全スレッドの読み取り区間が
+ * そのエポックより 2 つ先へ進んでいれば、もう誰も参照していないので解放できる。 */
+#define EPOCH_BATCH 64          /* これだけ溜まったら回収を試みる */
+
+struct EpochSlot {
+    struct EpochSlot *next;
+    uint64_t active;            /* 区間外なら 0、区間内なら入ったときのエポック */
+    int in_use;
+};
+
+struct Retired {
+    struct Retired *next;
+    uint64_t epoch;
+    void *p;
+    void (*fn)(void *);
+};
+
+static struct {
+    uint64_t now;
+    struct EpochSlot *slots;    /* 追加のみ。終了したスレッドの枠は使い回す */
+    pthread_mutex_t lock;       /* 枠の登録と orphans */
+    struct Retired *orphans;    /* 終了したスレッドが残した退避分 */
+} epoch = {
+    .now = 1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static _Thread_local struct EpochSlot *epoch_slot;
+static _Thread_local int epoch_depth;
+static _Thread_local struct Retired *retired;
+static _Thread_local int retired_count;
+
+static struct EpochSlot *epoch_register(void) {
+    pthread_mutex_lock(&epoch.lock);
+    struct EpochSlot *e = epoch.slots;
+    while (e && e->in_use) e = e->next;
+    if (!e && (e = calloc(1, sizeof(*e))) != NULL) {
+        e->next = epoch.slots;
+        __atomic_store_n(&epoch.slots, e, __ATOMIC_RELEASE);
+    }
+    if (e) e->in_use = 1;
+    pthread_mutex_unlock(&epoch.lock);
+    return e;
+}
+
+/* 入れ子にできる。外側の区間だけが枠へ書く */
+static void epoch_enter(void) {
+    if (epoch_depth++ > 0) return;
+    if (!epoch_slot && !(epoch_slot = epoch_register())) abort();
+
+    __atomic_store_n(&epoch_slot->active, __atomic_load_n(&epoch.now, __ATOMIC_SEQ_CST),
+                     __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static void epoch_exit(void) {
+    if (--epoch_depth > 0) return;
+    __atomic_store_n(&epoch_slot->active, 0, __ATOMIC_RELEASE);
+}
+
+/* 区間内のスレッドがすべて現在のエポックに追いついていれば 1 つ進める */
+static uint64_t epoch_advance(void) {
+    uint64_t now = __atomic_load_n(&epoch.now, __ATOMIC_SEQ_CST);
+
+    for (struct EpochSlot *e = __atomic_load_n(&epoch.slots, __ATOMIC_ACQUIRE); e; e = e->next) {
+        uint64_t a = __atomic_load_n(&e->active, __ATOMIC_SEQ_CST);
+        if (a != 0 && a != now) return now;
+    }
+    __atomic_compare_exchange_n(&epoch.now, &now, now + 1, 0,
+                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&epoch.now, __ATOMIC_SEQ_CST);
+}
+
+/* 解放してよいものを list から外して解放し、残りの件数を返す */
+static int epoch_free(struct Retired **list, uint64_t now) {
+    int left = 0;
+    while (*list) {
+        struct Retired *r = *list;
+        if (r->epoch + 2 <= now) {
+            *list = r->next;
+            r->fn(r->p);
+            free(r);
+        } else {
+            list = &r->next;
+            left++;
+        }
+    }
+    return left;
+}
+
+static void epoch_reclaim(void) {
+    uint64_t now = epoch_advance();
+    retired_count = epoch_free(&retired, now);
+
+    pthread_mutex_lock(&epoch.lock);
+    epoch_free(&epoch.orphans, now);
+    pthread_mutex_unlock(&epoch.lock);
+}
+
+static void epoch_retire(void *p, void (*fn)(void *)) {
+    struct Retired *r = malloc(sizeof(*r));
+    if (!r) return;             /* 解放を諦める（漏れるだけで壊れはしない） */
+
+    r->epoch = __atomic_load_n(&epoch.now, __ATOMIC_SEQ_CST);
+    r->p = p;
+    r->fn = fn;
+    r->next = retired;
+    retired = r;
+    if (++retired_count >= EPOCH_BATCH) epoch_reclaim();
+}
+
+/* スレッド終了時に呼ぶ。未解放分は orphans へ引き継ぎ、枠を返す */
+static void epoch_thread_exit(void) {
+    if (retired) {
+        struct Retired *tail = retired;
+        while (tail->next) tail = tail->next;
+        pthread_mutex_lock(&epoch.lock);
+        tail->next = epoch.orphans;
+        epoch.orphans = retired;
+        pthread_mutex_unlock(&epoch.lock);
+        retired = NULL;
+        retired_count = 0;
+    }
+    if (epoch_slot) {
+        pthread_mutex_lock(&epoch.lock);
+        epoch_slot->in_use = 0;
+        pthread_mutex_unlock(&epoch.lock);
+        epoch_slot = NULL;
+    }
+}
+
+/* 読み手がいなくなった終了時に、退避分をすべて解放する */
+static void epoch_drain(void) {
+    epoch_thread_exit();
+    pthread_mutex_lock(&epoch.lock);
+    epoch_free(&epoch.orphans, UINT64_MAX);
+    pthread_mutex_unlock(&epoch.lock);
+}
+
 /* ===== ユーティリティ ===== */
 
 static void trim_newline(char *s) {
@@ -49,245 +428,7645 @@ static void trim_newline(char *s) {
     }
 }
 
-static int find_file_index(const struct Dir *d, const char *name) {
-    for (int i = 0; i < d->file_count; i++) {
-        if (strcmp(d->files[i].name, name) == 0) {
-            return i;
-        }
-    }
-    return -1;
+/* 停止シグナルは待ち受けるスレッドだけが受け取るよう、作るスレッドでは塞いでおく */
+static int thread_create(pthread_t *tid, void *(*fn)(void *), void *arg) {
+    sigset_t set, old;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    int rc = pthread_create(tid, NULL, fn, arg);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return rc;
 }
 
-static int find_subdir_index(const struct Dir *d, const char *name) {
-    for (int i = 0; i < d->subdir_count; i++) {
-        if (strcmp(d->subdirs[i]->name, name) == 0) {
-            return i;
-        }
+/* 行の最初の語が cmd か */
+static int line_is(const char *line, const char *cmd) {
+    line += strspn(line, " ");
+    size_t k = strcspn(line, " ");
+    return k == strlen(cmd) && strncmp(line, cmd, k) == 0;
+}
+
+/* 64 ビットの FNV-1a */
+static uint64_t hash64(const void *p, size_t n) {
+    const unsigned char *s = p;
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < n; i++) {
+        h = (h ^ s[i]) * 1099511628211ull;
     }
-    return -1;
+    return h;
 }
 
-static struct Dir *create_dir(const char *name, struct Dir *parent) {
-    struct Dir *d = malloc(sizeof(struct Dir));
-    if (!d) return NULL;
+/* ビットをよく混ぜる（splitmix64 の仕上げ） */
+static uint64_t mix64(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
 
-    strncpy(d->name, name, NAME_LEN - 1);
-    d->name[NAME_LEN - 1] = '\0';
-    d->parent = parent;
-    d->file_count = 0;
-    d->subdir_count = 0;
+/* ファイルの時刻は壁時計のナノ秒。変更や読み込みのたびには時計を読まず、
+ * スレッドごとに覚えた値を使う。コマンドの始めなど、まとまりごとに clock_tick で進める */
+#ifdef CLOCK_REALTIME_COARSE
+#define CLOCK_FILE CLOCK_REALTIME_COARSE
+#else
+#define CLOCK_FILE CLOCK_REALTIME
+#endif
 
-    return d;
+static _Thread_local uint64_t clock_now;
+
+static void clock_tick(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_FILE, &ts);
+    clock_now = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
 }
 
-/* ===== コマンド実装 ===== */
+/* 覚えた時刻。まだ進めていないスレッドではここで読む */
+static uint64_t clock_ns(void) {
+    if (clock_now == 0) clock_tick();
+    return clock_now;
+}
 
-static void pwd_cmd(struct Dir *cwd) {
-    if (cwd->parent == NULL) {
-        puts("/");
-        return;
-    }
+/* 覚えた時刻の秒 */
+static uint32_t clock_sec(void) {
+    return (uint32_t)(clock_ns() / 1000000000ull);
+}
 
-    const char *parts[64];
-    int depth = 0;
+/* 配列を need 要素以上に広げる（倍々で確保する） */
+static int grow(void *pp, size_t *cap, size_t need, size_t elem) {
+    if (need <= *cap) return 0;
+    size_t n = *cap ? *cap : 64;
+    while (n < need) n *= 2;
+    void *p = realloc(*(void **)pp, n * elem);
+    if (!p) return -1;
+    *(void **)pp = p;
+    *cap = n;
+    return 0;
+}
 
-    while (cwd) {
-        parts[depth++] = cwd->name;
-        cwd = cwd->parent;
-    }
+/* ===== トレース =====
+ * trace on の間、コマンドと、その中のパス解決・一覧の検索・確保・出力の区間を
+ * スレッドごとのリングへ記録し、Chrome / Perfetto で読める JSON (Trace Event Format) に書き出す。
+ * リングを進めるのは持ち主のスレッドだけで、書き出す側は写した後に上書きされて
+ * いないかを確かめる（ロックなし）。終了したスレッドのリングは次のスレッドが使い回すので、
+ * tid はリングの番号になる。記録していない間の費用は、区間ごとにフラグを 1 回読むだけ */
+#define TRACE_RING 16384        /* スレッドあたりの区間数。溢れたら古いものから上書きする */
 
-    for (int i = depth - 1; i >= 0; i--) {
-        if (i == 0 && strcmp(parts[i], "/") == 0) {
-            printf("/");
-        } else {
-            printf("%s", parts[i]);
-            if (i > 0) printf("/");
+struct TraceEv {
+    const char *name;           /* 静的な文字列 */
+    uint64_t ts, dur;           /* ns */
+};
+
+struct TraceRing {
+    struct TraceRing *next;
+    int id;
+    int in_use;
+    uint64_t head;              /* 通算の記録数 */
+    struct TraceEv ev[TRACE_RING];
+};
+
+static struct {
+    int on;
+    uint64_t t0;                /* 最初に on にした時刻。ts の原点 */
+    struct TraceRing *rings;    /* 追加のみ */
+    int nrings;
+    const char *path;           /* -T で指定した、終了時の書き出し先 */
+} trace;
+
+static _Thread_local struct TraceRing *trace_ring;
+
+struct TraceSpan {
+    const char *name;
+    uint64_t t0;                /* 0 なら記録しない */
+};
+
+static uint64_t trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* 空いているリングを取る。なければ作って先頭へ繋ぐ */
+static struct TraceRing *trace_ring_get(void) {
+    for (struct TraceRing *r = __atomic_load_n(&trace.rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        int idle = 0;
+        if (__atomic_compare_exchange_n(&r->in_use, &idle, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return r;
         }
     }
-    putchar('\n');
+
+    struct TraceRing *r = calloc(1, sizeof(*r));
+    if (!r) return NULL;
+    r->in_use = 1;
+    r->id = __atomic_add_fetch(&trace.nrings, 1, __ATOMIC_RELAXED);
+    r->next = __atomic_load_n(&trace.rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&trace.rings, &r->next, r, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    return r;
 }
 
-static void ls_cmd(struct Dir *cwd, const char *opt) {
-    int longfmt = (opt && strcmp(opt, "-l") == 0);
+/* スレッド終了時に呼ぶ。リングを次のスレッドへ譲る */
+static void trace_thread_exit(void) {
+    if (!trace_ring) return;
+    __atomic_store_n(&trace_ring->in_use, 0, __ATOMIC_RELEASE);
+    trace_ring = NULL;
+}
 
-    for (int i = 0; i < cwd->subdir_count; i++) {
-        if (longfmt) {
-            printf("drwx ---- %s/\n", cwd->subdirs[i]->name);
-        } else {
-            printf("%s/\n", cwd->subdirs[i]->name);
-        }
+/* t0 から今までを name の区間として記録する。書き出す側が読むので、欄は原子的に書く */
+static void trace_end(const char *name, uint64_t t0) {
+    uint64_t now = trace_now();
+    if (!trace_ring && !(trace_ring = trace_ring_get())) return;
+
+    struct TraceRing *r = trace_ring;
+    uint64_t h = r->head;
+    struct TraceEv *e = &r->ev[h % TRACE_RING];
+    __atomic_store_n(&e->name, name, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->ts, t0, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->dur, now - t0, __ATOMIC_RELAXED);
+    __atomic_store_n(&r->head, h + 1, __ATOMIC_RELEASE);
+}
+
+static struct TraceSpan trace_begin(const char *name) {
+    struct TraceSpan sp = { name, 0 };
+    if (__atomic_load_n(&trace.on, __ATOMIC_RELAXED)) sp.t0 = trace_now();
+    return sp;
+}
+
+static void trace_close(struct TraceSpan *sp) {
+    if (sp->t0) trace_end(sp->name, sp->t0);
+}
+
+/* 関数の先頭に置くと、どこで戻っても戻るまでを 1 区間として記録する */
+#define TRACE_SPAN(name) \
+    __attribute__((cleanup(trace_close))) struct TraceSpan trace_span_ = trace_begin(name)
+
+/* 記録した区間を path へ書き出し、書いた数を返す（失敗なら -1）。記録中でもよい */
+static long trace_dump(const char *path) {
+    FILE *fp = fopen(path, "w");
+    struct TraceEv *buf = fp ? malloc(sizeof(*buf) * TRACE_RING) : NULL;
+    if (!buf) {
+        if (fp) fclose(fp);
+        return -1;
     }
 
-    for (int i = 0; i < cwd->file_count; i++) {
-        struct File *f = &cwd->files[i];
-        if (longfmt) {
-            printf("-%s %4d %s\n", f->perm, f->size, f->name);
-        } else {
-            printf("%s\n", f->name);
+    uint64_t base = __atomic_load_n(&trace.t0, __ATOMIC_ACQUIRE);
+    long n = 0;
+    fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n", fp);
+    fputs("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"pseudo-linux\"}}", fp);
+    for (struct TraceRing *r = __atomic_load_n(&trace.rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        uint64_t h = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        uint64_t lo = h > TRACE_RING ? h - TRACE_RING : 0;
+        for (uint64_t i = lo; i < h; i++) {
+            struct TraceEv *e = &r->ev[i % TRACE_RING];
+            buf[i % TRACE_RING].name = __atomic_load_n(&e->name, __ATOMIC_RELAXED);
+            buf[i % TRACE_RING].ts = __atomic_load_n(&e->ts, __ATOMIC_RELAXED);
+            buf[i % TRACE_RING].dur = __atomic_load_n(&e->dur, __ATOMIC_RELAXED);
+        }
+
+        /* 写している間に持ち主が書いた枠（書きかけの次の 1 つを含む）は捨てる */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        uint64_t h2 = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+        if (h2 >= TRACE_RING && h2 - TRACE_RING + 1 > lo) lo = h2 - TRACE_RING + 1;
+
+        for (uint64_t i = lo; i < h; i++) {
+            const struct TraceEv *e = &buf[i % TRACE_RING];
+            fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"sim\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                    "\"ts\":%.3f,\"dur\":%.3f}", e->name, r->id,
+                    (double)(int64_t)(e->ts - base) / 1e3, (double)e->dur / 1e3);
+            n++;
         }
     }
+    fputs("\n]}\n", fp);
+    free(buf);
+    return fclose(fp) == 0 ? n : -1;
 }
 
-static void touch_cmd(struct Dir *cwd, const char *name) {
-    if (!name) {
-        puts("usage: touch <name>");
-        return;
+/* 終了時に、-T の指定があれば書き出してからリングをすべて解放する */
+static void trace_exit(void) {
+    if (trace.path) {
+        long n = trace_dump(trace.path);
+        if (n < 0) perror(trace.path);
+        else fprintf(stderr, "trace: wrote %ld spans to '%s'\n", n, trace.path);
     }
-
-    if (find_file_index(cwd, name) != -1 ||
-        find_subdir_index(cwd, name) != -1) {
-        puts("name already exists");
-        return;
+    for (struct TraceRing *r = trace.rings, *next; r; r = next) {
+        next = r->next;
+        free(r);
     }
+    trace.rings = NULL;
+}
 
-    if (cwd->file_count >= MAX_FILES) {
-        puts("file limit reached");
-        return;
-    }
+/* ===== メモリの計量 =====
+ * 木が使うメモリを種類ごとに、確保と解放のたびに足し引きして数える（memstat で表示）。
+ * ノードの名前は構造体に埋め込んだ NAME_LEN の欄なので、使った分を names、
+ * 残りを slack に数える。slack には malloc の切り上げ分（Linux では malloc_usable_size）も入る。
+ * イメージ上のノードと内容は、展開するまでヒープを使わない */
+enum { MEM_DIRS, MEM_FILES, MEM_NAMES, MEM_CONTENT, MEM_INDEX, MEM_SLACK, MEM_KINDS };
 
-    struct File *f = &cwd->files[cwd->file_count++];
-    strncpy(f->name, name, NAME_LEN - 1);
-    f->name[NAME_LEN - 1] = '\0';
-    strcpy(f->perm, "rw-");
-    f->size = 0;
-    f->content[0] = '\0';
+static struct {
+    int64_t bytes[MEM_KINDS];
+    int64_t dirs, files;        /* ノードの数（凍結版と残した File を含む） */
+} mem;
 
-    printf("file '%s' created\n", name);
+static void mem_add(int64_t *p, int64_t n) {
+    __atomic_add_fetch(p, n, __ATOMIC_RELAXED);
 }
 
-static void rm_cmd(struct Dir *cwd, const char *name) {
-    if (!name) {
-        puts("usage: rm <name>");
-        return;
-    }
+/* n バイトを求めて確保した p の、切り上げで余った分 */
+static size_t mem_round(void *p, size_t n) {
+#ifdef __linux__
+    return p ? malloc_usable_size(p) - n : 0;
+#else
+    (void)p;
+    (void)n;
+    return 0;
+#endif
+}
 
-    int idx = find_file_index(cwd, name);
-    if (idx < 0) {
-        puts("no such file");
-        return;
-    }
+/* n バイトを求めて確保した p を kind に数える。sign は 1（確保）か -1（解放） */
+static void mem_track(int kind, void *p, size_t n, int sign) {
+    mem_add(&mem.bytes[kind], sign * (int64_t)n);
+    mem_add(&mem.bytes[MEM_SLACK], sign * (int64_t)mem_round(p, n));
+}
 
-    for (int i = idx; i < cwd->file_count - 1; i++) {
-        cwd->files[i] = cwd->files[i + 1];
-    }
-    cwd->file_count--;
+/* ノードの本体を数える。名前は数えた後に変えない（名前を変えるときは複製を作る） */
+static void mem_node(int kind, void *p, size_t size, const char *name, int sign) {
+    int64_t used = (int64_t)strlen(name) + 1;
+    mem_add(&mem.bytes[kind], sign * (int64_t)(size - NAME_LEN));
+    mem_add(&mem.bytes[MEM_NAMES], sign * used);
+    mem_add(&mem.bytes[MEM_SLACK], sign * (NAME_LEN - used + (int64_t)mem_round(p, size)));
+    mem_add(kind == MEM_DIRS ? &mem.dirs : &mem.files, sign);
+}
 
-    printf("file '%s' removed\n", name);
+/* 読み手用。公開中の配列を 1 度だけ読み、その時点の件数までを見る */
+static struct Slots *slots_get(struct Slots *const *p, int *n) {
+    struct Slots *s = __atomic_load_n(p, __ATOMIC_ACQUIRE);
+    *n = s ? __atomic_load_n(&s->count, __ATOMIC_ACQUIRE) : 0;
+    return s;
 }
 
-static void mv_cmd(struct Dir *cwd, const char *src, const char *dst) {
-    if (!src || !dst) {
-        puts("usage: mv <old> <new>");
-        return;
-    }
+static void *slots_at(const struct Slots *s, int i) {
+    return __atomic_load_n(&s->item[i], __ATOMIC_ACQUIRE);
+}
 
-    int idx = find_file_index(cwd, src);
-    if (idx < 0) {
-        puts("source not found");
-        return;
-    }
+/* 以下の書き込み系は、持ち主のディレクトリのロックを持って呼ぶ */
 
-    if (find_file_index(cwd, dst) != -1 ||
-        find_subdir_index(cwd, dst) != -1) {
-        puts("destination already exists");
-        return;
+static struct Slots *slots_alloc(int cap) {
+    TRACE_SPAN("alloc");
+    size_t n = sizeof(struct Slots) + sizeof(void *) * (size_t)cap;
+    struct Slots *s = malloc(n);
+    if (!s) return NULL;
+    s->cap = cap;
+    s->count = 0;
+    mem_track(MEM_INDEX, s, n, 1);
+    return s;
+}
+
+/* epoch_retire に渡せる形 */
+static void slots_free(void *p) {
+    struct Slots *s = p;
+    if (!s) return;
+    mem_track(MEM_INDEX, s, sizeof(struct Slots) + sizeof(void *) * (size_t)s->cap, -1);
+    free(s);
+}
+
+/* 満杯なら広げておく。成功した後の slots_append は確保に失敗しない */
+static int slots_reserve(struct Slots **p) {
+    struct Slots *s = *p;
+    if (s && s->count < s->cap) return 0;
+
+    struct Slots *n = slots_alloc(s ? s->cap * 2 : 4);
+    if (!n) return -1;
+    if (s) {
+        for (int i = 0; i < s->count; i++) n->item[i] = s->item[i];
+        n->count = s->count;
     }
+    __atomic_store_n(p, n, __ATOMIC_RELEASE);
+    if (s) epoch_retire(s, slots_free);
+    return 0;
+}
 
-    strncpy(cwd->files[idx].name, dst, NAME_LEN - 1);
-    cwd->files[idx].name[NAME_LEN - 1] = '\0';
+/* 要素は count を進める前に書く */
+static int slots_append(struct Slots **p, void *item) {
+    if (slots_reserve(p) < 0) return -1;
 
-    printf("renamed '%s' -> '%s'\n", src, dst);
+    struct Slots *s = *p;
+    __atomic_store_n(&s->item[s->count], item, __ATOMIC_RELEASE);
+    __atomic_store_n(&s->count, s->count + 1, __ATOMIC_RELEASE);
+    return 0;
 }
 
-static void mkdir_cmd(struct Dir *cwd, const char *name) {
-    if (!name) {
-        puts("usage: mkdir <name>");
-        return;
-    }
+/* 読み手が途中の要素を見落とさないよう、詰め直した配列を別に作る */
+static int slots_remove(struct Slots **p, int idx) {
+    struct Slots *s = *p;
+    struct Slots *n = slots_alloc(s->cap);
+    if (!n) return -1;
 
-    if (cwd->subdir_count >= MAX_SUBDIRS) {
-        puts("subdir limit reached");
-        return;
+    for (int i = 0; i < s->count; i++) {
+        if (i != idx) n->item[n->count++] = s->item[i];
     }
+    __atomic_store_n(p, n, __ATOMIC_RELEASE);
+    epoch_retire(s, slots_free);
+    return 0;
+}
 
-    if (find_file_index(cwd, name) != -1 ||
-        find_subdir_index(cwd, name) != -1) {
-        puts("name already exists");
-        return;
+static void slots_set(struct Slots *s, int i, void *item) {
+    __atomic_store_n(&s->item[i], item, __ATOMIC_RELEASE);
+}
+
+/* 実行中のコマンドが読む版での子の一覧（スナップショットの節を参照）。
+ * 版が新しすぎれば凍結版を辿る。読んだ後に版が進んでいたら、
+ * 一覧は変更後のものかもしれないので凍結版から読み直す */
+static struct Slots *dir_list(const struct Dir *d, int subdirs, int *n) {
+    for (;;) {
+        while (view && d && __atomic_load_n(&d->ver, __ATOMIC_ACQUIRE) > view->ver) {
+            d = __atomic_load_n(&d->prev, __ATOMIC_ACQUIRE);
+        }
+        if (!d) {
+            *n = 0;
+            return NULL;
+        }
+        struct Slots *s = slots_get(subdirs ? &d->subdirs : &d->files, n);
+        if (!view || __atomic_load_n(&d->ver, __ATOMIC_ACQUIRE) <= view->ver) return s;
     }
+}
 
-    struct Dir *d = create_dir(name, cwd);
-    if (!d) {
-        puts("memory error");
-        return;
+static int find_file_index(const struct Dir *d, const char *name) {
+    TRACE_SPAN("lookup");
+    int n;
+    struct Slots *s = dir_list(d, 0, &n);
+    for (int i = 0; i < n; i++) {
+        const struct File *f = slots_at(s, i);
+        if (strcmp(f->name, name) == 0) {
+            return i;
+        }
     }
+    return -1;
+}
 
-    cwd->subdirs[cwd->subdir_count++] = d;
-    printf("directory '%s' created\n", name);
+static struct Dir *find_subdir(const struct Dir *d, const char *name) {
+    TRACE_SPAN("lookup");
+    int n;
+    struct Slots *s = dir_list(d, 1, &n);
+    for (int i = 0; i < n; i++) {
+        struct Dir *sub = slots_at(s, i);
+        if (strcmp(sub->name, name) == 0) {
+            return sub;
+        }
+    }
+    return NULL;
 }
 
-static struct Dir *cd_cmd(struct Dir *cwd, const char *arg, struct Dir *root) {
-    if (!arg) {
-        puts("usage: cd <dir>");
-        return cwd;
+static struct File *find_file(const struct Dir *d, const char *name) {
+    TRACE_SPAN("lookup");
+    int n;
+    struct Slots *s = dir_list(d, 0, &n);
+    for (int i = 0; i < n; i++) {
+        struct File *f = slots_at(s, i);
+        if (strcmp(f->name, name) == 0) {
+            return f;
+        }
     }
+    return NULL;
+}
 
-    if (strcmp(arg, "/") == 0) return root;
-    if (strcmp(arg, ".") == 0) return cwd;
-    if (strcmp(arg, "..") == 0) return cwd->parent ? cwd->parent : cwd;
+static int name_taken(const struct Dir *d, const char *name) {
+    return find_file_index(d, name) != -1 || find_subdir(d, name) != NULL;
+}
 
-    int idx = find_subdir_index(cwd, arg);
-    if (idx >= 0) {
-        return cwd->subdirs[idx];
-    }
+static struct Dir *create_dir(const char *name, struct Dir *parent) {
+    TRACE_SPAN("alloc");
+    struct Dir *d = malloc(sizeof(struct Dir));
+    if (!d) return NULL;
+
+    strncpy(d->name, name, NAME_LEN - 1);
+    d->name[NAME_LEN - 1] = '\0';
+    d->parent = parent;
+    d->files = NULL;
+    d->subdirs = NULL;
+    memset(&d->usage, 0, sizeof(d->usage));
+    d->img = NULL;
+    d->txn = NULL;
+    d->ver = __atomic_load_n(&tree_ver, __ATOMIC_ACQUIRE);
+    d->prev = NULL;
+    d->mode = 0777 & ~cred.umask;
+    d->uid = cred.uid;
+    d->gid = cred.gid;
+    pthread_mutex_init(&d->lock, NULL);
+    mem_node(MEM_DIRS, d, sizeof(*d), d->name, 1);
 
-    puts("no such directory");
-    return cwd;
+    return d;
 }
 
-static void free_dir(struct Dir *d) {
+/* ディレクトリの本体だけを解放する */
+static void dir_node_free(struct Dir *d) {
     if (!d) return;
-
-    for (int i = 0; i < d->subdir_count; i++) {
-        free_dir(d->subdirs[i]);
-    }
+    mem_node(MEM_DIRS, d, sizeof(*d), d->name, -1);
+    __atomic_add_fetch(&attr_gen, 1, __ATOMIC_RELEASE);
     free(d);
 }
 
-/* ===== メイン ===== */
+/* ===== 部分木のハッシュ =====
+ * ディレクトリのハッシュは子の寄与の和で、ファイルは file_key、
+ * 子ディレクトリは dir_mult(名前) * (子のハッシュ) + dir_salt(名前) を寄与とする。
+ * 和と積だけなので、子のハッシュが δ 変われば親は dir_mult(子の名前) * δ 変わる。
+ * 集計値と同じく、祖先へ原子的な加算を伝えるだけで保てる（ロックも再計算も要らない）。
+ * 内容が同じ部分木は場所によらず同じハッシュになり、diff はそこを読み飛ばす。 */
 
-int main(void) {
-    struct Dir *root = create_dir("/", NULL);
-    struct Dir *cwd = root;
-    char line[LINE_LEN];
+static uint64_t dir_mult(const char *name) {
+    return mix64(hash64(name, strlen(name))) | 1;
+}
 
-    while (1) {
-        printf("pseudo-linux:%s> ", cwd == root ? "/" : cwd->name);
+static uint64_t dir_salt(const char *name) {
+    return mix64(hash64(name, strlen(name)) ^ 0x9e3779b97f4a7c15ull);
+}
 
-        if (!fgets(line, sizeof(line), stdin)) break;
-        trim_newline(line);
+static uint64_t file_key(const struct File *f) {
+    uint64_t attr = ((uint64_t)f->uid << 32 | f->gid) + ((uint64_t)f->mode << 1 | (uint64_t)f->symlink);
+    return mix64(hash64(f->name, strlen(f->name)) ^ mix64(f->hash + f->size) ^ mix64(attr));
+}
 
-        if (line[0] == '\0') continue;
+/* 親から見た子ディレクトリの寄与（ハッシュは h） */
+static uint64_t dir_key(const char *name, uint64_t h) {
+    return dir_mult(name) * h + dir_salt(name);
+}
 
-        char *cmd = strtok(line, " ");
-        char *arg = strtok(NULL, " ");
+/* 変更分を親の連鎖へ足し込む。負の差分は符号なしの回り込みで引き算になる。
+ * 祖先のロックは取らず、原子的な加算だけで済ませる。
+ * hash は d のハッシュの変化分で、上へ行くたびに d の名前の dir_mult を掛ける */
+static void usage_add(struct Dir *d, int64_t bytes, int64_t files, int64_t dirs, uint64_t hash) {
+    uint64_t now = __atomic_load_n(&tree_ver, __ATOMIC_ACQUIRE);
+    for (; d; d = d->parent) {
+        __atomic_fetch_add(&d->usage.bytes, (uint64_t)bytes, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&d->usage.files, (uint64_t)files, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&d->usage.dirs, (uint64_t)dirs, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&d->usage.hash, hash, __ATOMIC_RELAXED);
+        hash *= dir_mult(d->name);
 
-        if (strcmp(cmd, "exit") == 0) break;
-        else if (strcmp(cmd, "pwd") == 0 || strcmp(cmd, "pwt") == 0) pwd_cmd(cwd);
-        else if (strcmp(cmd, "ls") == 0) ls_cmd(cwd, arg);
-        else if (strcmp(cmd, "touch") == 0) touch_cmd(cwd, arg);
-        else if (strcmp(cmd, "rm") == 0) rm_cmd(cwd, arg);
-        else if (strcmp(cmd, "mv") == 0) {
-            char *dst = strtok(NULL, " ");
-            mv_cmd(cwd, arg, dst);
+        uint64_t v = __atomic_load_n(&d->usage.ver, __ATOMIC_RELAXED);
+        while (v < now && !__atomic_compare_exchange_n(&d->usage.ver, &v, now, 1,
+                                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
         }
-        else if (strcmp(cmd, "mkdir") == 0) mkdir_cmd(cwd, arg);
-        else if (strcmp(cmd, "cd") == 0) cwd = cd_cmd(cwd, arg, root);
-        else {
-            puts("command not found");
+    }
+}
+
+static void usage_get(const struct Dir *d, struct Usage *u) {
+    u->bytes = __atomic_load_n(&d->usage.bytes, __ATOMIC_RELAXED);
+    u->files = __atomic_load_n(&d->usage.files, __ATOMIC_RELAXED);
+    u->dirs = __atomic_load_n(&d->usage.dirs, __ATOMIC_RELAXED);
+    u->hash = __atomic_load_n(&d->usage.hash, __ATOMIC_RELAXED);
+    u->ver = __atomic_load_n(&d->usage.ver, __ATOMIC_ACQUIRE);
+}
+
+/* 部分木の集計値を後順で数え直す（import 直後の一括計算用） */
+static void usage_rebuild(struct Dir *d) {
+    int nf, nd;
+    struct Slots *fs = slots_get(&d->files, &nf);
+    struct Slots *ds = slots_get(&d->subdirs, &nd);
+
+    memset(&d->usage, 0, sizeof(d->usage));
+    for (int i = 0; i < nf; i++) {
+        const struct File *f = slots_at(fs, i);
+        d->usage.bytes += f->size;
+        d->usage.hash += file_key(f);
+    }
+    d->usage.files = (uint64_t)nf;
+    d->usage.dirs = (uint64_t)nd;
+    d->usage.ver = __atomic_load_n(&tree_ver, __ATOMIC_ACQUIRE);
+
+    for (int i = 0; i < nd; i++) {
+        struct Dir *sub = slots_at(ds, i);
+        usage_rebuild(sub);
+        d->usage.bytes += sub->usage.bytes;
+        d->usage.files += sub->usage.files;
+        d->usage.dirs += sub->usage.dirs;
+        d->usage.hash += dir_key(sub->name, sub->usage.hash);
+    }
+}
+
+/* ----- inode と名前の一覧 ----- */
+
+/* 参照 1 つを持った状態で返す */
+static struct Inode *ino_new(void) {
+    struct Inode *ino = calloc(1, sizeof(*ino));
+    if (!ino) return NULL;
+    pthread_mutex_init(&ino->lock, NULL);
+    ino->refs = 1;
+    mem_track(MEM_INDEX, ino, sizeof(*ino), 1);
+    return ino;
+}
+
+static void ino_hold(struct Inode *ino) {
+    __atomic_add_fetch(&ino->refs, 1, __ATOMIC_RELAXED);
+}
+
+/* 最後の参照を手放したら解放する */
+static void ino_drop(struct Inode *ino) {
+    if (__atomic_sub_fetch(&ino->refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+    mem_track(MEM_INDEX, ino->links, ino->cap * sizeof(*ino->links), -1);
+    free(ino->links);
+    pthread_mutex_destroy(&ino->lock);
+    mem_track(MEM_INDEX, ino, sizeof(*ino), -1);
+    free(ino);
+}
+
+/* d の name を一覧に足す。以下の 2 つは d のロック中に呼ぶ */
+static int link_add(struct Inode *ino, struct Dir *d, const char *name) {
+    pthread_mutex_lock(&ino->lock);
+    if (ino->nlinks == ino->cap) {
+        size_t cap = ino->cap ? ino->cap * 2 : 2;
+        struct Link *l = malloc(cap * sizeof(*l));
+        if (!l) {
+            pthread_mutex_unlock(&ino->lock);
+            return -1;
         }
+        if (ino->nlinks > 0) memcpy(l, ino->links, ino->nlinks * sizeof(*l));
+        mem_track(MEM_INDEX, ino->links, ino->cap * sizeof(*l), -1);
+        free(ino->links);
+        mem_track(MEM_INDEX, l, cap * sizeof(*l), 1);
+        ino->links = l;
+        ino->cap = cap;
+    }
+
+    struct Link *l = &ino->links[ino->nlinks];
+    l->d = d;
+    memset(l->name, 0, NAME_LEN);
+    strncpy(l->name, name, NAME_LEN - 1);
+    __atomic_store_n(&ino->nlinks, ino->nlinks + 1, __ATOMIC_RELAXED);     /* ls は読むだけ */
+    pthread_mutex_unlock(&ino->lock);
+    return 0;
+}
+
+static void link_del(struct Inode *ino, struct Dir *d, const char *name) {
+    pthread_mutex_lock(&ino->lock);
+    for (size_t i = 0; i < ino->nlinks; i++) {
+        if (ino->links[i].d == d && strcmp(ino->links[i].name, name) == 0) {
+            ino->links[i] = ino->links[ino->nlinks - 1];
+            __atomic_store_n(&ino->nlinks, ino->nlinks - 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ino->lock);
+}
+
+static long file_nlink(const struct File *f) {
+    return f->ino ? (long)__atomic_load_n(&f->ino->nlinks, __ATOMIC_RELAXED) : 1;
+}
+
+/* 書いた名前。コマンドの終わりに link_flush が他の名前へ写す */
+struct LinkSync {
+    struct Inode *ino;          /* 参照を 1 つ持つ */
+    struct Dir *d;
+    char name[NAME_LEN];
+};
+
+static _Thread_local struct LinkSync *link_pending;
+static _Thread_local size_t link_npending, link_pending_cap;
+
+static void link_mark(struct Inode *ino, struct Dir *d, const char *name) {
+    if (grow(&link_pending, &link_pending_cap, link_npending + 1, sizeof(*link_pending)) < 0) return;
+    struct LinkSync *p = &link_pending[link_npending++];
+    ino_hold(ino);
+    p->ino = ino;
+    p->d = d;
+    memset(p->name, 0, NAME_LEN);
+    memcpy(p->name, name, strnlen(name, NAME_LEN - 1));
+}
+
+/* 名前だけ入れた File の本体を確保する（他の欄は 0）。複製を作るときも、
+ * 複製が最終的に持つ名前で確保する */
+static struct File *file_alloc(const char *name) {
+    TRACE_SPAN("alloc");
+    struct File *f = calloc(1, sizeof(*f));
+    if (!f) return NULL;
+    strncpy(f->name, name, NAME_LEN - 1);
+    mem_node(MEM_FILES, f, sizeof(*f), f->name, 1);
+    return f;
+}
+
+/* File の本体だけを解放する（内容は複製へ引き継いだもの。epoch_retire に渡せる形） */
+static void file_node_free(void *p) {
+    struct File *f = p;
+    if (!f) return;
+    if (f->ino) ino_drop(f->ino);
+    mem_node(MEM_FILES, f, sizeof(*f), f->name, -1);
+    free(f);
+}
+
+/* 名前だけ入れた新しいファイルを作る。残りは一覧へ載せる前に埋める */
+static struct File *file_new(const char *name) {
+    struct File *f = file_alloc(name);
+    if (!f) return NULL;
+    f->ver = __atomic_load_n(&tree_ver, __ATOMIC_ACQUIRE);
+    f->hash = hash64("", 0);
+    f->atime = f->mtime = f->ctime = clock_ns();
+    f->used = clock_sec();
+    f->mode = 0666 & ~cred.umask;
+    f->uid = cred.uid;
+    f->gid = cred.gid;
+    return f;
+}
+
+static int dir_add_file(struct Dir *d, struct File *f) {
+    return slots_append(&d->files, f);
+}
+
+static int dir_add_subdir(struct Dir *d, struct Dir *sub) {
+    return slots_append(&d->subdirs, sub);
+}
+
+/* ===== 内容の共有 =====
+ * ヒープ上の内容は (ハッシュ, 大きさ) で引ける表に登録し、同じ内容は 1 つの領域を
+ * 参照数つきで共有する。File は内容を書き換えないので、共有しても読み手に影響しない。
+ * 表はハッシュの下位ビットで分けたロックごとに持ち、書き手どうしの衝突を減らす。
+ * イメージ上の内容は登録しない（イメージ側で共有する。イメージの書き出しを参照）。 */
+#define STORE_STRIPES 64
+
+struct Blob {
+    struct Blob *next;
+    uint64_t hash;
+    size_t size;
+    char *data;
+    long refs;
+};
+
+static struct {
+    struct {
+        pthread_mutex_t lock;
+        struct Blob **bucket;
+        size_t cap;             /* 0 か 2 のべき */
+        size_t n;
+    } stripe[STORE_STRIPES];
+    int off;                    /* 1 なら同じ内容でも共有しない（比較用） */
+    uint64_t blobs, refs;
+    uint64_t stored, logical;   /* 実際に持っているバイト数と、ファイルから見たバイト数 */
+} store;
+
+static void store_init(void) {
+    for (int i = 0; i < STORE_STRIPES; i++) pthread_mutex_init(&store.stripe[i].lock, NULL);
+}
+
+/* 埋まってきたらバケットを倍にして付け替える。stripe のロック中に呼ぶ */
+static void store_grow(int s) {
+    size_t cap = store.stripe[s].cap ? store.stripe[s].cap * 2 : 64;
+    struct Blob **b = calloc(cap, sizeof(*b));
+    if (!b) return;             /* 伸ばせなくても鎖が長くなるだけ */
+    mem_track(MEM_INDEX, b, cap * sizeof(*b), 1);
+
+    for (size_t i = 0; i < store.stripe[s].cap; i++) {
+        for (struct Blob *e = store.stripe[s].bucket[i], *next; e; e = next) {
+            next = e->next;
+            size_t j = (e->hash / STORE_STRIPES) & (cap - 1);
+            e->next = b[j];
+            b[j] = e;
+        }
+    }
+    mem_track(MEM_INDEX, store.stripe[s].bucket, store.stripe[s].cap * sizeof(*b), -1);
+    free(store.stripe[s].bucket);
+    store.stripe[s].bucket = b;
+    store.stripe[s].cap = cap;
+}
+
+/* data（malloc 領域、所有権ごと受け取る）を登録し、File に持たせる領域を返す。
+ * 同じ内容が既にあれば data を解放してそちらを返す */
+static char *store_intern(char *data, size_t size, uint64_t hash) {
+    TRACE_SPAN("intern");
+    if (!data) return NULL;
+    int s = (int)(hash % STORE_STRIPES);
+    pthread_mutex_lock(&store.stripe[s].lock);
+
+    if (store.stripe[s].n >= store.stripe[s].cap) store_grow(s);
+    struct Blob **head = store.stripe[s].cap ?
+        &store.stripe[s].bucket[(hash / STORE_STRIPES) & (store.stripe[s].cap - 1)] : NULL;
+
+    for (struct Blob *e = head ? *head : NULL; e && !store.off; e = e->next) {
+        if (e->hash == hash && e->size == size && (size == 0 || memcmp(e->data, data, size) == 0)) {
+            e->refs++;
+            pthread_mutex_unlock(&store.stripe[s].lock);
+            __atomic_add_fetch(&store.refs, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&store.logical, size, __ATOMIC_RELAXED);
+            free(data);
+            return e->data;
+        }
+    }
+
+    /* 登録できなければ共有しないだけ（解放時に表になければそのまま解放する） */
+    struct Blob *e = head ? malloc(sizeof(*e)) : NULL;
+    if (e) {
+        *e = (struct Blob){ *head, hash, size, data, 1 };
+        *head = e;
+        mem_track(MEM_INDEX, e, sizeof(*e), 1);
+        mem_track(MEM_CONTENT, data, size, 1);
+        store.stripe[s].n++;
+        __atomic_add_fetch(&store.blobs, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&store.refs, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&store.stored, size, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&store.logical, size, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&store.stripe[s].lock);
+    return data;
+}
+
+/* File が手放した内容の参照を 1 つ減らし、最後なら解放する */
+static void store_put(char *data, size_t size, uint64_t hash) {
+    int s = (int)(hash % STORE_STRIPES);
+    pthread_mutex_lock(&store.stripe[s].lock);
+
+    struct Blob **p = store.stripe[s].cap ?
+        &store.stripe[s].bucket[(hash / STORE_STRIPES) & (store.stripe[s].cap - 1)] : NULL;
+    while (p && *p && (*p)->data != data) p = &(*p)->next;
+
+    struct Blob *e = p ? *p : NULL;
+    int last = !e;
+    if (e) {
+        __atomic_sub_fetch(&store.refs, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&store.logical, size, __ATOMIC_RELAXED);
+        if (--e->refs == 0) {
+            *p = e->next;
+            store.stripe[s].n--;
+            __atomic_sub_fetch(&store.blobs, 1, __ATOMIC_RELAXED);
+            __atomic_sub_fetch(&store.stored, size, __ATOMIC_RELAXED);
+            mem_track(MEM_INDEX, e, sizeof(*e), -1);
+            mem_track(MEM_CONTENT, data, size, -1);
+            free(e);
+            last = 1;
+        }
+    }
+    pthread_mutex_unlock(&store.stripe[s].lock);
+    if (last) free(data);
+}
+
+/* 登録済みの内容 data の参照を 1 つ増やす。表になければ -1 */
+static int store_ref(const char *data, size_t size, uint64_t hash) {
+    int s = (int)(hash % STORE_STRIPES);
+    pthread_mutex_lock(&store.stripe[s].lock);
+
+    struct Blob *e = store.stripe[s].cap ?
+        store.stripe[s].bucket[(hash / STORE_STRIPES) & (store.stripe[s].cap - 1)] : NULL;
+    while (e && e->data != data) e = e->next;
+    if (e) e->refs++;
+    pthread_mutex_unlock(&store.stripe[s].lock);
+    if (!e) return -1;
+
+    __atomic_add_fetch(&store.refs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&store.logical, size, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static void store_free(void) {
+    for (int i = 0; i < STORE_STRIPES; i++) {
+        mem_track(MEM_INDEX, store.stripe[i].bucket, store.stripe[i].cap * sizeof(struct Blob *), -1);
+        free(store.stripe[i].bucket);
+        pthread_mutex_destroy(&store.stripe[i].lock);
+    }
+}
+
+/* ===== 冷えた内容の圧縮 =====
+ * しばらく読まれていないファイルの内容を、ブロックごとに LZ 系の簡単な符号で縮める。
+ * File は書き換えないので、縮めた内容を持つ複製へ差し替える。内容とハッシュは
+ * 変わらないので、ジャーナルにも部分木のハッシュにも影響しない。
+ * 読むときは file_each がブロックごとに展開して渡すので、呼び出し側は圧縮を意識しない。
+ * 縮めた領域は [各ブロックの終わりの位置 (uint32_t) × ブロック数][ブロック...] で、
+ * 縮まなかったブロックは元のまま置く（長さが元と同じなら無圧縮）。
+ * 縮めた内容は共有の表に載せず、その File（と mv で作った複製）が持つ。 */
+#define ZBLOCK       (64 * 1024)    /* 展開の単位。一致までの距離も 16 ビットに収まる */
+#define ZMIN         1024           /* これより小さいファイルは縮めない */
+#define ZHASH_BITS   12
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t tid;
+    int running, stop;
+    unsigned age;               /* この秒数読まれていなければ縮める */
+    uint64_t files, plain, packed;  /* 今縮めてあるファイルの数、元の大きさ、縮めた大きさ */
+    uint64_t sweeps;
+    uint64_t unpacks, unpack_bytes, unpack_ns;
+} cold = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .age = 60,
+};
+
+/* atime の書き方。relatime は内容か属性を変えた後の最初の読み込みと、
+ * ATIME_DAY に 1 回だけ書くので、読むだけのファイルへはほとんど書かない */
+#define ATIME_DAY (86400 * 1000000000ull)
+
+enum {
+    ATIME_RELATIME = 0,
+    ATIME_STRICT,               /* 読むたびに書く（覚えた時刻が進んだときだけ） */
+    ATIME_NOATIME,              /* 書かない */
+};
+
+static int atime_mode;
+
+/* 読まれた時刻を残す。共有中の File なので、この欄だけを原子的に書く */
+static void file_used(const struct File *f) {
+    struct File *w = (struct File *)f;
+    uint32_t sec = clock_sec();
+    if (__atomic_load_n(&f->used, __ATOMIC_RELAXED) != sec) {
+        __atomic_store_n(&w->used, sec, __ATOMIC_RELAXED);
+    }
+
+    int mode = __atomic_load_n(&atime_mode, __ATOMIC_RELAXED);
+    uint64_t now = clock_ns(), at = __atomic_load_n(&f->atime, __ATOMIC_RELAXED);
+    if (mode == ATIME_NOATIME || at == now) return;
+    if (mode == ATIME_RELATIME && at > f->mtime && at > f->ctime && now - at < ATIME_DAY) return;
+    __atomic_store_n(&w->atime, now, __ATOMIC_RELAXED);
+}
+
+/* 書き換えない欄はそのまま写し、共有中にも書く欄は原子的に読む。inode の参照も取る */
+static void file_copy(struct File *dst, const struct File *src) {
+    memcpy(dst, src, offsetof(struct File, atime));
+    if (dst->ino) ino_hold(dst->ino);
+    dst->atime = __atomic_load_n(&src->atime, __ATOMIC_RELAXED);
+    dst->used = __atomic_load_n(&src->used, __ATOMIC_RELAXED);
+    dst->zskip = __atomic_load_n(&src->zskip, __ATOMIC_RELAXED);
+}
+
+/* 長さの続き（255 を足していき、255 未満で終わる） */
+static size_t lz_putlen(unsigned char *dst, size_t op, size_t v) {
+    for (; v >= 255; v -= 255) dst[op++] = 255;
+    dst[op++] = (unsigned char)v;
+    return op;
+}
+
+static int lz_getlen(const unsigned char *src, size_t n, size_t *ip, size_t *v) {
+    unsigned char c;
+    do {
+        if (*ip >= n) return -1;
+        c = src[(*ip)++];
+        *v += c;
+    } while (c == 255);
+    return 0;
+}
+
+/* 1 組を書く: [上位 4 ビット リテラル長 | 下位 4 ビット 一致長 - 4][リテラル][距離 2 バイト]。
+ * mlen が 0 なら最後の組で、距離を書かない。収まらなければ SIZE_MAX */
+static size_t lz_emit(unsigned char *dst, size_t op, size_t cap, const unsigned char *lit,
+                      size_t nlit, size_t dist, size_t mlen) {
+    size_t need = 1 + nlit + nlit / 255 + 1 + (mlen ? 2 + mlen / 255 + 1 : 0);
+    if (op + need > cap) return SIZE_MAX;
+
+    size_t ml = mlen ? mlen - 4 : 0;
+    dst[op++] = (unsigned char)((nlit < 15 ? nlit : 15) << 4 | (ml < 15 ? ml : 15));
+    if (nlit >= 15) op = lz_putlen(dst, op, nlit - 15);
+    memcpy(dst + op, lit, nlit);
+    op += nlit;
+    if (!mlen) return op;
+
+    dst[op++] = (unsigned char)(dist & 0xff);
+    dst[op++] = (unsigned char)(dist >> 8);
+    if (ml >= 15) op = lz_putlen(dst, op, ml - 15);
+    return op;
+}
+
+/* src[0..n) を縮めて dst へ書き、長さを返す。cap に収まらなければ 0 */
+static size_t lz_pack(const unsigned char *src, size_t n, unsigned char *dst, size_t cap) {
+    uint32_t table[1 << ZHASH_BITS];        /* 4 バイト列のハッシュ → 位置 + 1 */
+    memset(table, 0, sizeof(table));
+    size_t ip = 0, anchor = 0, op = 0;
+
+    while (ip + 4 <= n) {
+        uint32_t seq;
+        memcpy(&seq, src + ip, 4);
+        uint32_t h = (seq * 2654435761u) >> (32 - ZHASH_BITS);
+        size_t ref = table[h];
+        table[h] = (uint32_t)ip + 1;
+        if (ref == 0 || ip - (ref - 1) > 0xffff || memcmp(src + ref - 1, src + ip, 4) != 0) {
+            ip++;
+            continue;
+        }
+
+        size_t m = ref - 1, len = 4;
+        while (ip + len < n && src[m + len] == src[ip + len]) len++;
+        op = lz_emit(dst, op, cap, src + anchor, ip - anchor, ip - m, len);
+        if (op == SIZE_MAX) return 0;
+        ip += len;
+        anchor = ip;
+    }
+    op = lz_emit(dst, op, cap, src + anchor, n - anchor, 0, 0);
+    return op == SIZE_MAX ? 0 : op;
+}
+
+/* 展開した長さを返す。壊れていれば SIZE_MAX */
+static size_t lz_unpack(const unsigned char *src, size_t n, unsigned char *dst, size_t cap) {
+    size_t ip = 0, op = 0;
+
+    while (ip < n) {
+        unsigned t = src[ip++];
+        size_t nlit = t >> 4;
+        if (nlit == 15 && lz_getlen(src, n, &ip, &nlit) < 0) return SIZE_MAX;
+        if (nlit > n - ip || nlit > cap - op) return SIZE_MAX;
+        memcpy(dst + op, src + ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip == n) break;
+
+        if (n - ip < 2) return SIZE_MAX;
+        size_t dist = src[ip] | (size_t)src[ip + 1] << 8;
+        ip += 2;
+        size_t mlen = t & 15;
+        if (mlen == 15 && lz_getlen(src, n, &ip, &mlen) < 0) return SIZE_MAX;
+        mlen += 4;
+        if (dist == 0 || dist > op || mlen > cap - op) return SIZE_MAX;
+        for (size_t i = 0; i < mlen; i++, op++) dst[op] = dst[op - dist];
+    }
+    return op;
+}
+
+/* 内容をブロックごとに縮めた領域を返す。1/8 以上縮まなければ NULL */
+static char *cold_pack(const struct File *f, size_t *zsize) {
+    const unsigned char *src = (const unsigned char *)f->content;
+    size_t nb = (f->size + ZBLOCK - 1) / ZBLOCK;
+    size_t hdr = nb * sizeof(uint32_t);
+    size_t cap = f->size - f->size / 8;
+    if (f->size > UINT32_MAX || hdr >= cap) return NULL;
+
+    unsigned char *z = malloc(cap);
+    if (!z) return NULL;
+
+    size_t pos = hdr;
+    for (size_t b = 0; b < nb; b++) {
+        size_t off = b * ZBLOCK;
+        size_t len = f->size - off < ZBLOCK ? f->size - off : ZBLOCK;
+        size_t room = cap - pos;
+
+        /* 元より短くならなければ元のまま置く */
+        size_t c = lz_pack(src + off, len, z + pos, room < len - 1 ? room : len - 1);
+        if (c == 0) {
+            if (len > room) {
+                free(z);
+                return NULL;
+            }
+            memcpy(z + pos, src + off, len);
+            c = len;
+        }
+        pos += c;
+        uint32_t end = (uint32_t)(pos - hdr);
+        memcpy(z + b * sizeof(uint32_t), &end, sizeof(end));
+    }
+
+    char *p = realloc(z, pos);
+    *zsize = pos;
+    return p ? p : (char *)z;
+}
+
+/* 内容をブロックごとに fn へ渡す。縮めていなければ内容をそのまま 1 回で渡す。
+ * fn が負を返すか、展開に失敗すれば -1 */
+static int file_each(const struct File *f, int (*fn)(const char *p, size_t n, void *arg), void *arg) {
+    STAT_BYTES(f->size);
+    if (!f->zsize) return f->size > 0 ? fn(f->content, f->size, arg) : 0;
+
+    const unsigned char *z = (const unsigned char *)f->content;
+    size_t nb = (f->size + ZBLOCK - 1) / ZBLOCK;
+    size_t hdr = nb * sizeof(uint32_t);
+    char *buf = malloc(f->size < ZBLOCK ? f->size : ZBLOCK);
+    if (!buf) return -1;
+
+    uint64_t ns = 0;
+    size_t start = hdr;
+    int rc = 0;
+    for (size_t b = 0; rc >= 0 && b < nb; b++) {
+        uint32_t e;
+        memcpy(&e, z + b * sizeof(uint32_t), sizeof(e));
+        size_t end = hdr + e;
+        size_t len = f->size - b * ZBLOCK < ZBLOCK ? f->size - b * ZBLOCK : ZBLOCK;
+
+        if (end < start || end > f->zsize) {
+            rc = -1;
+        } else if (end - start == len) {
+            rc = fn((const char *)z + start, len, arg);
+        } else {
+            struct timespec t0, t1;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            size_t got = lz_unpack(z + start, end - start, (unsigned char *)buf, len);
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            ns += (uint64_t)((t1.tv_sec - t0.tv_sec) * 1000000000ll + (t1.tv_nsec - t0.tv_nsec));
+            rc = got == len ? fn(buf, len, arg) : -1;
+        }
+        start = end;
+    }
+    free(buf);
+
+    __atomic_add_fetch(&cold.unpacks, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&cold.unpack_bytes, f->size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&cold.unpack_ns, ns, __ATOMIC_RELAXED);
+    return rc < 0 ? -1 : 0;
+}
+
+static int data_copy(const char *p, size_t n, void *arg) {
+    char **dst = arg;
+    memcpy(*dst, p, n);
+    *dst += n;
+    return 0;
+}
+
+/* 内容を連続した領域で *data に返す。縮めてあれば *tmp に展開するので、呼び出し側が free する */
+static int file_data(const struct File *f, const char **data, char **tmp) {
+    *tmp = NULL;
+    *data = f->content;
+    if (!f->zsize) {
+        STAT_BYTES(f->size);
+        return 0;
+    }
+
+    char *p = *tmp = malloc(f->size);
+    if (!p || file_each(f, data_copy, &p) < 0) {
+        free(*tmp);
+        *tmp = NULL;
+        return -1;
+    }
+    *data = *tmp;
+    return 0;
+}
+
+/* イメージを直接指している内容は解放しない */
+static int in_image(const void *p) {
+    const unsigned char *c = p;
+    return image.base && c >= image.base && c < image.base + image.len;
+}
+
+/* dst（src の複製）に src と同じ内容を持たせる。共有の表にあれば参照を増やすだけで、
+ * 縮めた内容は展開して登録する */
+static int file_share(struct File *dst, const struct File *src) {
+    if (!src->zsize && (!src->content || in_image(src->content) ||
+                        store_ref(src->content, src->size, src->hash) == 0)) {
+        dst->content = src->content;
+        dst->zsize = 0;
+        return 0;
+    }
+
+    const char *data;
+    char *tmp;
+    if (file_data(src, &data, &tmp) < 0) return -1;
+    char *p = tmp ? tmp : malloc(src->size);
+    if (!p) return -1;
+    if (!tmp) memcpy(p, data, src->size);
+    dst->content = store_intern(p, src->size, src->hash);
+    dst->zsize = 0;
+    return 0;
+}
+
+/* ファイルを内容ごと解放する（epoch_retire に渡せる形）。共有中の内容は参照を減らすだけ。
+ * 縮めた内容はその File だけが持つ */
+static void file_free(void *p) {
+    struct File *f = p;
+    if (f->zsize) {
+        mem_track(MEM_CONTENT, f->content, f->zsize, -1);
+        free(f->content);
+        __atomic_sub_fetch(&cold.files, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&cold.plain, f->size, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&cold.packed, f->zsize, __ATOMIC_RELAXED);
+    } else if (f->content && !in_image(f->content)) {
+        store_put(f->content, f->size, f->hash);
+    }
+    file_node_free(f);
+}
+
+/* 読み手がもういない前提で、部分木をまとめて解放する */
+static void free_dir(struct Dir *d) {
+    if (!d) return;
+
+    int nf, nd;
+    struct Slots *fs = slots_get(&d->files, &nf);
+    struct Slots *ds = slots_get(&d->subdirs, &nd);
+
+    for (int i = 0; i < nd; i++) {
+        free_dir(slots_at(ds, i));
+    }
+    for (int i = 0; i < nf; i++) {
+        file_free(slots_at(fs, i));
+    }
+    slots_free(ds);
+    slots_free(fs);
+
+    /* 凍結版は一覧の配列だけを持つ（中身は現在の木か、残した File が持つ） */
+    for (struct Dir *p = d->prev, *next; p; p = next) {
+        next = p->prev;
+        slots_free(p->files);
+        slots_free(p->subdirs);
+        pthread_mutex_destroy(&p->lock);
+        dir_node_free(p);
+    }
+    pthread_mutex_destroy(&d->lock);
+    dir_node_free(d);
+}
+
+/* ===== スナップショット =====
+ * snapshot は版の番号を 1 つ進めるだけで、木は写さない。ディレクトリは
+ * スナップショットの後で最初に変更するとき、今の一覧を写した凍結版を prev に
+ * 繋いでから変更する。古い版を読むときは prev を辿り、その版で有効だった
+ * 一覧を使う。写すのは変更したディレクトリの一覧だけで、File と子ディレクトリは
+ * 現在の木と共有する（根までのパスを写し直さないのは、cwd や親の連鎖が
+ * 指すディレクトリをそのまま使い続けるため）。
+ * 凍結版から参照されうる File は、現在の木から外しても終了まで解放しない。 */
+
+static struct {
+    pthread_mutex_t lock;
+    struct Snapshot **snap;
+    size_t n, cap;
+    struct Retired *kept;       /* 凍結版が参照しうるため解放を止めた File */
+    long frozen, nkept;
+} snaps = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static struct Slots *slots_copy(const struct Slots *s) {
+    struct Slots *n = slots_alloc(s ? s->cap : 4);
+    if (!n) return NULL;
+    for (int i = 0; s && i < s->count; i++) n->item[n->count++] = s->item[i];
+    return n;
+}
+
+/* d のロック中、一覧を変える前に呼ぶ。版 now より前のスナップショットが
+ * 今の一覧を見ているなら、今の配列を凍結版へ移し、d には写しを持たせる。
+ * 以後の変更は写しに対して行うので、凍結版の配列は二度と書き換わらない */
+static int dir_freeze_at(struct Dir *d, uint64_t now) {
+    if (d->ver >= now) return 0;
+
+    struct Dir *f = malloc(sizeof(*f));
+    struct Slots *fs = f ? slots_copy(d->files) : NULL;
+    struct Slots *ds = fs ? slots_copy(d->subdirs) : NULL;
+    if (!ds) {
+        slots_free(fs);
+        free(f);
+        return -1;
+    }
+
+    memcpy(f->name, d->name, NAME_LEN);
+    f->parent = d->parent;
+    f->files = d->files;
+    f->subdirs = d->subdirs;
+    memset(&f->usage, 0, sizeof(f->usage));     /* 古い版の集計は usage_view で数え直す */
+    f->img = NULL;
+    f->txn = NULL;
+    f->ver = d->ver;
+    f->prev = d->prev;
+    f->mode = d->mode;
+    f->uid = d->uid;
+    f->gid = d->gid;
+    pthread_mutex_init(&f->lock, NULL);
+    mem_node(MEM_DIRS, f, sizeof(*f), f->name, 1);
+
+    /* prev を先に公開し、新しい ver を見た読み手が必ず凍結版へ辿れるようにする。
+     * 写しは ver の後に公開するので、写しを読んだ読み手は新しい ver も見る */
+    __atomic_store_n(&d->prev, f, __ATOMIC_RELEASE);
+    __atomic_store_n(&d->ver, now, __ATOMIC_RELEASE);
+    __atomic_store_n(&d->files, fs, __ATOMIC_RELEASE);
+    __atomic_store_n(&d->subdirs, ds, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&snaps.frozen, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static int dir_freeze(struct Dir *d) {
+    return dir_freeze_at(d, __atomic_load_n(&tree_ver, __ATOMIC_ACQUIRE));
+}
+
+/* 一覧から外した File を手放す。作った後にスナップショットを取っていれば、
+ * 凍結版が参照しうるので終了まで残す */
+static void file_retire(struct File *f, void (*fn)(void *)) {
+    if (f->ver >= __atomic_load_n(&tree_ver, __ATOMIC_ACQUIRE)) {
+        epoch_retire(f, fn);
+        return;
+    }
+
+    struct Retired *r = malloc(sizeof(*r));
+    if (!r) return;             /* 解放を諦める（漏れるだけで壊れはしない） */
+    r->epoch = 0;
+    r->p = f;
+    r->fn = fn;
+    pthread_mutex_lock(&snaps.lock);
+    r->next = snaps.kept;
+    snaps.kept = r;
+    snaps.nkept++;
+    pthread_mutex_unlock(&snaps.lock);
+}
+
+/* 名前の一致するスナップショットを返す。取ったものは消さないので、ロックの外でも使える */
+static const struct Snapshot *snapshot_find(const char *name) {
+    const struct Snapshot *found = NULL;
+    pthread_mutex_lock(&snaps.lock);
+    for (size_t i = 0; i < snaps.n && !found; i++) {
+        if (strcmp(snaps.snap[i]->name, name) == 0) found = snaps.snap[i];
+    }
+    pthread_mutex_unlock(&snaps.lock);
+    return found;
+}
+
+/* 終了時に、残した File とスナップショットを解放する */
+static void snapshots_free(void) {
+    epoch_free(&snaps.kept, UINT64_MAX);
+    for (size_t i = 0; i < snaps.n; i++) free(snaps.snap[i]);
+    free(snaps.snap);
+}
+
+/* ===== イメージの読み込み ===== */
+
+static const struct ImgDir *img_dir(uint64_t off) {
+    if (off % 8 != 0 || off > image.len ||
+        image.len - off < sizeof(struct ImgDir)) {
+        return NULL;
+    }
+
+    const struct ImgDir *r = (const struct ImgDir *)(image.base + off);
+    uint64_t need = sizeof(*r)
+                  + (uint64_t)r->file_count * sizeof(struct ImgFile)
+                  + (uint64_t)r->subdir_count * sizeof(uint64_t);
+    if (image.len - off < need) return NULL;
+
+    return r;
+}
+
+static void img_name(char *dst, const char *src) {
+    memcpy(dst, src, NAME_LEN - 1);
+    dst[NAME_LEN - 1] = '\0';
+}
+
+/* イメージ上のノードを可変ツリーへ昇格させる。
+ * 子ディレクトリは未展開のまま作り、実際に触れたときに展開する。
+ * 読み手は img が NULL になったのを見てから一覧を読むので、最後に外す。
+ * イメージの内容は起動時からあったものなので、版は 0 にする */
+static int dir_load(struct Dir *d) {
+    const struct ImgDir *r = d->img;
+    if (!r) return 0;
+
+    const struct ImgFile *files = (const struct ImgFile *)(r + 1);
+    const uint64_t *subs = (const uint64_t *)(files + r->file_count);
+    int rc = 0;
+
+    for (uint32_t i = 0; rc == 0 && i < r->file_count; i++) {
+        const struct ImgFile *src = &files[i];
+        char name[NAME_LEN];
+        img_name(name, src->name);
+
+        struct File *f = file_new(name);
+        if (!f) {
+            rc = -1;
+            break;
+        }
+        f->mode = src->mode & 0777;
+        f->uid = src->uid;
+        f->gid = src->gid;
+        f->symlink = (src->flags & IMG_SYMLINK) != 0;
+        f->atime = src->atime;
+        f->mtime = src->mtime;
+        f->ctime = src->ctime;
+        f->ver = 0;
+
+        /* 内容はコピーせずマッピングを直接指す */
+        if (src->content <= image.len && image.len - src->content >= src->size) {
+            f->content = (char *)(image.base + src->content);
+            f->size = (size_t)src->size;
+            f->hash = src->hash;
+        }
+
+        /* 同じ番号の名前は 1 つの inode にまとめる（起動時に展開する部分木だけにある） */
+        struct Inode **ino = src->ino && src->ino <= image.ninodes ? &image.inodes[src->ino - 1] : NULL;
+        if (ino && !*ino) *ino = ino_new();
+        if (ino && *ino) {
+            f->ino = *ino;
+            ino_hold(f->ino);
+        }
+        if ((ino && !*ino) || dir_add_file(d, f) < 0) {
+            file_node_free(f);
+            rc = -1;
+        } else if (f->ino) {
+            link_add(f->ino, d, f->name);
+        }
+    }
+
+    for (uint32_t i = 0; rc == 0 && i < r->subdir_count; i++) {
+        const struct ImgDir *c = img_dir(subs[i]);
+        if (!c) continue;
+
+        char name[NAME_LEN];
+        img_name(name, c->name);
+        struct Dir *sub = create_dir(name, d);
+        if (!sub) {
+            rc = -1;
+            break;
+        }
+        sub->img = c;
+        sub->ver = 0;
+        sub->mode = c->mode & 0777;
+        sub->uid = c->uid;
+        sub->gid = c->gid;
+        sub->usage.bytes = c->bytes;
+        sub->usage.files = c->files;
+        sub->usage.dirs = c->dirs;
+        sub->usage.hash = c->hash;
+        if (dir_add_subdir(d, sub) < 0) {
+            dir_node_free(sub);
+            rc = -1;
+        } else if (c->links > 0) {
+            rc = dir_load(sub);
+        }
+    }
+
+    __atomic_store_n(&d->img, NULL, __ATOMIC_RELEASE);
+    return rc;
+}
+
+/* イメージを mmap してルートだけを展開する。起動時間はツリーの大きさに依存しない */
+static struct Dir *load_image(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct ImgHeader)) {
+        close(fd);
+        puts("broken image");
+        return NULL;
+    }
+
+    void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        perror(path);
+        return NULL;
+    }
+
+    image.base = p;
+    image.len = (size_t)st.st_size;
+
+    const struct ImgHeader *h = p;
+    const struct ImgDir *r = img_dir(h->root);
+    if (memcmp(h->magic, IMG_MAGIC, sizeof(h->magic)) != 0 || !r) {
+        puts("broken image");
+        return NULL;
+    }
+
+    struct Dir *root = create_dir("/", NULL);
+    if (!root) return NULL;
+    root->img = r;
+    root->mode = r->mode & 0777;
+    root->uid = r->uid;
+    root->gid = r->gid;
+    root->usage.bytes = r->bytes;
+    root->usage.files = r->files;
+    root->usage.dirs = r->dirs;
+    root->usage.hash = r->hash;
+
+    /* inode の対応表は展開の間だけ使う。ino_new の参照は表が持つ */
+    image.ninodes = h->inodes <= image.len / sizeof(struct ImgFile) ? h->inodes : 0;
+    image.inodes = image.ninodes ? calloc(image.ninodes, sizeof(*image.inodes)) : NULL;
+    if (image.ninodes && !image.inodes) image.ninodes = 0;
+    if (dir_load(root) < 0) puts("memory error");
+    for (uint64_t i = 0; i < image.ninodes; i++) {
+        if (image.inodes[i]) ino_drop(image.inodes[i]);
+    }
+    free(image.inodes);
+    image.inodes = NULL;
+    image.ninodes = 0;
+
+    return root;
+}
+
+static void unload_image(void) {
+    if (image.base) munmap((void *)image.base, image.len);
+    image.base = NULL;
+    image.len = 0;
+}
+
+/* ===== ディレクトリのロック =====
+ * 書き手どうしはディレクトリごとの mutex で排他する。同時に持つのは原則 1 つだけで、
+ * 2 つ必要な mv はアドレス順に取る。読み手はロックを取らず、エポックの区間内で
+ * 公開中の一覧を読む。ディレクトリは解放も移動もされないため、
+ * ポインタと親の連鎖はいつでもそのまま使える。
+ * 未展開のディレクトリは最初に触れたスレッドがロック下で展開する。 */
+
+static int dir_lock(struct Dir *d) {
+    pthread_mutex_lock(&d->lock);
+    if (dir_load(d) < 0) {
+        pthread_mutex_unlock(&d->lock);
+        return -1;
+    }
+    return 0;
+}
+
+static void dir_unlock(struct Dir *d) {
+    pthread_mutex_unlock(&d->lock);
+}
+
+/* 読み手用。展開済みならロックなしで戻る */
+static int dir_ready(struct Dir *d) {
+    if (!__atomic_load_n(&d->img, __ATOMIC_ACQUIRE)) return 0;
+    if (dir_lock(d) < 0) return -1;
+    dir_unlock(d);
+    return 0;
+}
+
+static int dir_lock2(struct Dir *a, struct Dir *b) {
+    if (a == b) return dir_lock(a);
+
+    struct Dir *first = a < b ? a : b;
+    struct Dir *second = a < b ? b : a;
+    if (dir_lock(first) < 0) return -1;
+    if (dir_lock(second) < 0) {
+        dir_unlock(first);
+        return -1;
+    }
+    return 0;
+}
+
+static void dir_unlock2(struct Dir *a, struct Dir *b) {
+    dir_unlock(a);
+    if (a != b) dir_unlock(b);
+}
+
+/* ===== イメージの書き出し ===== */
+
+/* 共有している内容（同じ領域を指す File）は一度だけ書き、位置を使い回す */
+struct ImgWriter {
+    FILE *fp;
+    uint64_t pos;
+    struct ImgSeen {
+        const char *p;
+        uint64_t off;
+    } *seen;                    /* 書いた内容の位置。開番地法のハッシュ表 */
+    size_t nseen, cap;
+    uint64_t inodes, links;     /* inode には seen で 1 からの番号を振る */
+};
+
+/* p を書いた位置を探す。なければ空きを返す（表を伸ばせなければ NULL） */
+static struct ImgSeen *img_seen(struct ImgWriter *w, const char *p) {
+    if (w->nseen * 2 >= w->cap) {
+        size_t cap = w->cap ? w->cap * 2 : 1024;
+        struct ImgSeen *t = calloc(cap, sizeof(*t));
+        if (!t) return NULL;
+        for (size_t i = 0; i < w->cap; i++) {
+            if (!w->seen[i].p) continue;
+            size_t j = mix64((uintptr_t)w->seen[i].p) & (cap - 1);
+            while (t[j].p) j = (j + 1) & (cap - 1);
+            t[j] = w->seen[i];
+        }
+        free(w->seen);
+        w->seen = t;
+        w->cap = cap;
+    }
+
+    size_t j = mix64((uintptr_t)p) & (w->cap - 1);
+    while (w->seen[j].p && w->seen[j].p != p) j = (j + 1) & (w->cap - 1);
+    return &w->seen[j];
+}
+
+static int img_write(struct ImgWriter *w, const void *p, size_t n) {
+    static const char zero[8];
+    size_t pad = (8 - n % 8) % 8;
+
+    if (n > 0 && fwrite(p, 1, n, w->fp) != n) return -1;
+    if (fwrite(zero, 1, pad, w->fp) != pad) {
+        return -1;
+    }
+    w->pos += n + pad;
+    return 0;
+}
+
+/* 子を先に書き、親レコードが子のオフセットを参照する（後順）。
+ * エポックの区間内で呼ぶ。一覧は読み始めた時点のものを使う */
+static int save_dir(struct ImgWriter *w, struct Dir *d, uint64_t *off) {
+    if (dir_ready(d) < 0) return -1;
+
+    int nfiles, nsubs;
+    struct Slots *fs = slots_get(&d->files, &nfiles);
+    struct Slots *ds = slots_get(&d->subdirs, &nsubs);
+    uint64_t *subs = calloc((size_t)nsubs + 1, sizeof(*subs));
+    struct ImgFile *files = calloc((size_t)nfiles + 1, sizeof(*files));
+    int rc = subs && files ? 0 : -1;
+    uint64_t links = w->links;
+
+    for (int i = 0; rc == 0 && i < nsubs; i++) {
+        rc = save_dir(w, slots_at(ds, i), &subs[i]);
+    }
+
+    for (int i = 0; rc == 0 && i < nfiles; i++) {
+        const struct File *f = slots_at(fs, i);
+        memcpy(files[i].name, f->name, NAME_LEN);
+        files[i].mode = f->mode;
+        files[i].uid = f->uid;
+        files[i].gid = f->gid;
+        files[i].size = f->size;
+        files[i].hash = f->hash;
+        files[i].flags = f->symlink ? IMG_SYMLINK : 0;
+        files[i].atime = __atomic_load_n(&f->atime, __ATOMIC_RELAXED);
+        files[i].mtime = f->mtime;
+        files[i].ctime = f->ctime;
+
+        if (f->ino) {
+            struct ImgSeen *n = img_seen(w, (const char *)f->ino);
+            if (!n) {
+                rc = -1;
+                break;
+            }
+            if (!n->p) {
+                n->p = (const char *)f->ino;
+                n->off = ++w->inodes;
+                w->nseen++;
+            }
+            files[i].ino = n->off;
+            w->links++;
+        }
+
+        struct ImgSeen *e = f->size > 0 ? img_seen(w, f->content) : NULL;
+        if (e && e->p) {
+            files[i].content = e->off;
+            continue;
+        }
+        files[i].content = w->pos;
+        if (e) {
+            e->p = f->content;
+            e->off = w->pos;
+            w->nseen++;
+        }
+        const char *data;
+        char *tmp;
+        rc = file_data(f, &data, &tmp) < 0 ? -1 : img_write(w, data, f->size);
+        free(tmp);
+    }
+
+    struct Usage u;
+    usage_get(d, &u);
+
+    struct ImgDir r;
+    memset(&r, 0, sizeof(r));
+    memcpy(r.name, d->name, NAME_LEN);
+    r.file_count = (uint32_t)nfiles;
+    r.subdir_count = (uint32_t)nsubs;
+    r.bytes = u.bytes;
+    r.files = u.files;
+    r.dirs = u.dirs;
+    r.hash = u.hash;
+    r.links = w->links - links;
+    r.mode = __atomic_load_n(&d->mode, __ATOMIC_RELAXED);
+    r.uid = __atomic_load_n(&d->uid, __ATOMIC_RELAXED);
+    r.gid = __atomic_load_n(&d->gid, __ATOMIC_RELAXED);
+
+    *off = w->pos;
+    if (rc == 0 &&
+        (img_write(w, &r, sizeof(r)) < 0 ||
+         img_write(w, files, sizeof(files[0]) * (size_t)nfiles) < 0 ||
+         img_write(w, subs, sizeof(subs[0]) * (size_t)nsubs) < 0)) {
+        rc = -1;
+    }
+
+    free(subs);
+    free(files);
+    return rc;
+}
+
+/* 一時ファイルに書いてから rename し、途中で失敗しても元のイメージを壊さない */
+static int write_image(struct Dir *root, const char *path) {
+    char tmp[PATH_LEN];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) return -1;
+
+    struct ImgWriter w = { fopen(tmp, "wb"), 0, NULL, 0, 0, 0, 0 };
+    if (!w.fp) return -1;
+
+    struct ImgHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, IMG_MAGIC, sizeof(h.magic));
+
+    epoch_enter();
+    int rc = img_write(&w, &h, sizeof(h));
+    if (rc == 0) rc = save_dir(&w, root, &h.root);
+    epoch_exit();
+    h.inodes = w.inodes;
+    if (rc == 0 && fseek(w.fp, 0, SEEK_SET) == 0) {
+        rc = fwrite(&h, sizeof(h), 1, w.fp) == 1 ? 0 : -1;
+    }
+    if (rc == 0 && (fflush(w.fp) != 0 || fsync(fileno(w.fp)) != 0)) rc = -1;
+    if (fclose(w.fp) != 0) rc = -1;
+    free(w.seen);
+
+    if (rc == 0 && rename(tmp, path) == 0) return 0;
+    remove(tmp);
+    return -1;
+}
+
+/* ===== 権限 =====
+ * ノードは mode（rwx を 3 組）と持ち主 (uid, gid) を持ち、利用者 (cred) から見た
+ * rwx の 3 ビットを持ち主・グループ・その他の順に選んで判定する（uid 0 は判定しない）。
+ * パスの解決では、行き先のディレクトリとその祖先すべてに x があることを確かめる。
+ * ディレクトリは動かないので、この結果は祖先の権限が変わるまで変わらない。
+ * そこでディレクトリごとの結果 (MAY_REACH) と自分の rwx をスレッドごとの表に覚え、
+ * attr_gen が同じ間は表を引くだけで済ませる（解放で進むのはアドレスの使い回し対策）。
+ * 表の項目は利用者ごとなので、同じスレッドで複数のセッションを回しても混ざらない。
+ * 判定はコマンドの側で行い、ジャーナルの再生とトランザクションの取り消しでは行わない。 */
+#define ACCESS_CACHE 256
+
+enum {
+    MAY_X = 1,
+    MAY_W = 2,
+    MAY_R = 4,
+    MAY_REACH = 8,              /* ルートからこのディレクトリまで辿れる */
+};
+
+static _Thread_local struct AccessCache {
+    const struct Dir *d;
+    uint64_t gen;
+    uint32_t uid, gid;
+    int bits;
+} access_cache[ACCESS_CACHE];
+
+static int mode_bits(uint32_t mode, uint32_t uid, uint32_t gid) {
+    if (cred.uid == 0) return MAY_R | MAY_W | MAY_X;
+    if (cred.uid == uid) return (int)(mode >> 6) & 7;
+    if (cred.gid == gid) return (int)(mode >> 3) & 7;
+    return (int)mode & 7;
+}
+
+static int file_bits(const struct File *f) {
+    return mode_bits(f->mode, f->uid, f->gid);
+}
+
+/* cred から見た d の rwx と MAY_REACH */
+static int dir_bits(const struct Dir *d) {
+    if (cred.uid == 0) return MAY_R | MAY_W | MAY_X | MAY_REACH;
+
+    uint64_t gen = __atomic_load_n(&attr_gen, __ATOMIC_ACQUIRE);
+    struct AccessCache *c = &access_cache[mix64((uintptr_t)d) % ACCESS_CACHE];
+    if (c->d == d && c->gen == gen && c->uid == cred.uid && c->gid == cred.gid) return c->bits;
+
+    int bits = mode_bits(__atomic_load_n(&d->mode, __ATOMIC_RELAXED),
+                         __atomic_load_n(&d->uid, __ATOMIC_RELAXED),
+                         __atomic_load_n(&d->gid, __ATOMIC_RELAXED));
+    if ((bits & MAY_X) && (!d->parent || (dir_bits(d->parent) & MAY_REACH))) bits |= MAY_REACH;
+    c->d = d;
+    c->gen = gen;
+    c->uid = cred.uid;
+    c->gid = cred.gid;
+    c->bits = bits;
+    return bits;
+}
+
+/* 中身を読んで降りられるディレクトリか（木を辿るコマンド用） */
+static int dir_readable(const struct Dir *d) {
+    return (dir_bits(d) & (MAY_R | MAY_X)) == (MAY_R | MAY_X);
+}
+
+/* d のロック中に呼ぶ。覚えた判定はすべて捨てる */
+static void dir_set_attr(struct Dir *d, uint32_t mode, uint32_t uid, uint32_t gid) {
+    __atomic_store_n(&d->mode, mode, __ATOMIC_RELAXED);
+    __atomic_store_n(&d->uid, uid, __ATOMIC_RELAXED);
+    __atomic_store_n(&d->gid, gid, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&attr_gen, 1, __ATOMIC_RELEASE);
+}
+
+/* ls -l の 10 文字 */
+static void mode_str(char *buf, char type, uint32_t mode) {
+    static const char rwx[] = "rwxrwxrwx";
+    buf[0] = type;
+    for (int i = 0; i < 9; i++) buf[i + 1] = (mode >> (8 - i)) & 1 ? rwx[i] : '-';
+    buf[10] = '\0';
+}
+
+/* ===== ファイル操作 =====
+ * ツリーを変更する処理の本体。メッセージは出さず結果コードだけを返し、
+ * 表示はコマンド側、ジャーナル再生はここを直接呼ぶ。
+ * 呼び出し側が対象ディレクトリのロックを持っていること。 */
+
+enum {
+    FS_OK = 0,
+    FS_EXIST,
+    FS_NOENT,
+    FS_NOMEM,
+    FS_BUSY,                    /* 他のトランザクションが変更中 */
+    FS_RDONLY,                  /* スナップショットは変更できない */
+    FS_XDEV,                    /* シャードをまたげない */
+    FS_ACCES,                   /* 権限がない */
+    FS_PERM,                    /* 持ち主（chown は uid 0）でない */
+};
+
+/* パスの行き先が変わりうる変更（取り消しで外したディレクトリ、外したシンボリックリンク）
+ * のたびに進む。パス解決が覚えた結果はこれが変わったら捨てる */
+static uint64_t dir_gen;
+
+static void symlink_gone(const struct File *f) {
+    if (f->symlink) __atomic_add_fetch(&dir_gen, 1, __ATOMIC_RELEASE);
+}
+
+static int fs_touch(struct Dir *d, const char *name) {
+    if (name_taken(d, name)) return FS_EXIST;
+
+    struct File *f = file_new(name);
+    if (!f) return FS_NOMEM;
+
+    if (dir_freeze(d) < 0 || dir_add_file(d, f) < 0) {
+        file_node_free(f);
+        return FS_NOMEM;
+    }
+    usage_add(d, 0, 1, 0, file_key(f));
+
+    return FS_OK;
+}
+
+/* keep があれば外した File を解放せずに渡す（トランザクションで戻すため） */
+static int fs_rm(struct Dir *d, const char *name, struct File **keep) {
+    int idx = find_file_index(d, name);
+    if (idx < 0) return FS_NOENT;
+
+    struct File *f = slots_at(d->files, idx);
+    if (dir_freeze(d) < 0 || slots_remove(&d->files, idx) < 0) return FS_NOMEM;
+    usage_add(d, -(int64_t)f->size, -1, 0, -file_key(f));
+    if (f->ino) link_del(f->ino, d, f->name);
+    symlink_gone(f);
+    if (keep) *keep = f;
+    else file_retire(f, file_free);
+
+    return FS_OK;
+}
+
+/* sd と dd が異なるときは両方のロックが必要。
+ * 読み手が見ている File は書き換えず、新しい名前の複製を載せる。
+ * 内容は複製へ引き継ぐので、古い File は本体だけを解放する
+ * （複製は元の版を引き継ぎ、元が残されるなら複製も残されるようにする） */
+static int fs_mv(struct Dir *sd, const char *src, struct Dir *dd, const char *dst) {
+    int idx = find_file_index(sd, src);
+    if (idx < 0) return FS_NOENT;
+    if (name_taken(dd, dst)) return FS_EXIST;
+
+    uint64_t now = __atomic_load_n(&tree_ver, __ATOMIC_ACQUIRE);
+    if (dir_freeze_at(sd, now) < 0 || dir_freeze_at(dd, now) < 0) return FS_NOMEM;
+
+    struct File *old = slots_at(sd->files, idx);
+    struct File *f = file_alloc(dst);
+    if (!f) return FS_NOMEM;
+    file_copy(f, old);
+    memset(f->name, 0, NAME_LEN);
+    strncpy(f->name, dst, NAME_LEN - 1);
+
+    if (sd == dd) {
+        slots_set(sd->files, idx, f);
+        usage_add(sd, 0, 0, 0, file_key(f) - file_key(old));
+    } else {
+        if (dir_add_file(dd, f) < 0) {
+            file_node_free(f);
+            return FS_NOMEM;
+        }
+        /* 失敗したら元から外せないので、追加した側を消して戻す */
+        if (slots_remove(&sd->files, idx) < 0) {
+            if (slots_remove(&dd->files, dd->files->count - 1) == 0) file_retire(f, file_node_free);
+            return FS_NOMEM;
+        }
+        usage_add(sd, -(int64_t)f->size, -1, 0, -file_key(old));
+        usage_add(dd, (int64_t)f->size, 1, 0, file_key(f));
+    }
+    if (f->ino) {
+        link_del(f->ino, sd, old->name);
+        link_add(f->ino, dd, f->name);
+    }
+    symlink_gone(old);
+    file_retire(old, file_node_free);
+
+    return FS_OK;
+}
+
+/* mkdir は失敗しうる準備と、失敗しない公開に分ける。ジャーナルには公開の前に記録する
+ * （公開した直後に他の分担が中へ書くと、その記録が mkdir より先に並びうる）。
+ * 作ったディレクトリは載せる前から実行中のトランザクションのものにする */
+static int mkdir_prepare(struct Dir *d, const char *name, struct Dir **made) {
+    if (name_taken(d, name)) return FS_EXIST;
+
+    struct Dir *sub = create_dir(name, d);
+    if (sub) sub->txn = txn;
+    if (!sub || dir_freeze(d) < 0 || slots_reserve(&d->subdirs) < 0) {
+        free_dir(sub);
+        return FS_NOMEM;
+    }
+    *made = sub;
+
+    return FS_OK;
+}
+
+static void mkdir_publish(struct Dir *d, struct Dir *sub) {
+    dir_add_subdir(d, sub);
+    usage_add(d, 0, 0, 1, dir_key(sub->name, 0));
+}
+
+static int fs_mkdir(struct Dir *d, const char *name) {
+    struct Dir *sub;
+    int rc = mkdir_prepare(d, name, &sub);
+    if (rc == FS_OK) mkdir_publish(d, sub);
+    return rc;
+}
+
+/* data（malloc 領域、所有権ごと受け取る）を内容にする。append なら既存の内容の後ろへ足す。
+ * ファイルがなければ作る。読み手が見ている File は書き換えず、複製を差し替える。
+ * keep には差し替えた元の File（なければ NULL）を解放せずに渡す */
+static int fs_write(struct Dir *d, const char *name, char *data, size_t len, int append,
+                    struct File **keep) {
+    if (keep) *keep = NULL;
+    int idx = find_file_index(d, name);
+    if (idx < 0 && name_taken(d, name)) {
+        free(data);
+        return FS_EXIST;
+    }
+
+    struct File *old = idx >= 0 ? slots_at(d->files, idx) : NULL;
+    if (old && append && old->size > 0) {
+        const char *od;
+        char *tmp;
+        char *p = file_data(old, &od, &tmp) == 0 ? malloc(old->size + len) : NULL;
+        if (!p) {
+            free(tmp);
+            free(data);
+            return FS_NOMEM;
+        }
+        memcpy(p, od, old->size);
+        free(tmp);
+        if (len > 0) memcpy(p + old->size, data, len);
+        free(data);
+        data = p;
+        len += old->size;
+    }
+
+    struct File *f = old ? file_alloc(old->name) : file_new(name);
+    if (!f) {
+        free(data);
+        return FS_NOMEM;
+    }
+    if (old) file_copy(f, old);
+    if (f->ino) f->seq = __atomic_add_fetch(&f->ino->seq, 1, __ATOMIC_RELAXED);
+    STAT_BYTES(len);
+    f->hash = hash64(data, len);
+    f->content = store_intern(data, len, f->hash);
+    f->size = len;
+    f->zsize = 0;
+    f->mtime = f->ctime = clock_ns();
+    f->used = clock_sec();
+    f->zskip = 0;
+    f->ver = __atomic_load_n(&tree_ver, __ATOMIC_ACQUIRE);
+
+    if (dir_freeze(d) < 0) {
+        file_free(f);
+        return FS_NOMEM;
+    }
+    if (old) {
+        slots_set(d->files, idx, f);
+        usage_add(d, (int64_t)len - (int64_t)old->size, 0, 0, file_key(f) - file_key(old));
+        if (f->ino) link_mark(f->ino, d, f->name);
+        if (keep) *keep = old;
+        else file_retire(old, file_free);
+    } else {
+        if (dir_add_file(d, f) < 0) {
+            file_free(f);
+            return FS_NOMEM;
+        }
+        usage_add(d, (int64_t)len, 1, 0, file_key(f));
+    }
+
+    return FS_OK;
+}
+
+/* sd の src の別名を dd に dst として作る。sd と dd が異なるときは両方のロックが必要。
+ * 名前ごとの File は別々のままで、同じ inode を指し内容の参照を共有する。
+ * 初めてのリンクなら inode を作り、src もそれを指す複製へ差し替える */
+static int fs_ln(struct Dir *sd, const char *src, struct Dir *dd, const char *dst) {
+    int idx = find_file_index(sd, src);
+    if (idx < 0) return FS_NOENT;
+    if (name_taken(dd, dst)) return FS_EXIST;
+
+    uint64_t now = __atomic_load_n(&tree_ver, __ATOMIC_ACQUIRE);
+    if (dir_freeze_at(sd, now) < 0 || dir_freeze_at(dd, now) < 0) return FS_NOMEM;
+
+    struct File *old = slots_at(sd->files, idx);
+    if (!old->ino) {
+        struct Inode *ino = ino_new();
+        struct File *s = ino ? file_alloc(old->name) : NULL;
+        if (!s || link_add(ino, sd, old->name) < 0) {
+            file_node_free(s);
+            if (ino) ino_drop(ino);
+            return FS_NOMEM;
+        }
+        file_copy(s, old);
+        s->ino = ino;           /* ino_new の参照を引き継ぐ */
+        slots_set(sd->files, idx, s);
+        file_retire(old, file_node_free);
+        old = s;
+    }
+
+    struct File *f = file_alloc(dst);
+    if (!f) return FS_NOMEM;
+    file_copy(f, old);
+    memset(f->name, 0, NAME_LEN);
+    strncpy(f->name, dst, NAME_LEN - 1);
+    f->ver = now;
+    if (file_share(f, old) < 0) {
+        file_node_free(f);
+        return FS_NOMEM;
+    }
+    if (link_add(f->ino, dd, f->name) < 0) {
+        file_free(f);
+        return FS_NOMEM;
+    }
+    if (dir_add_file(dd, f) < 0) {
+        link_del(f->ino, dd, f->name);
+        file_free(f);
+        return FS_NOMEM;
+    }
+    usage_add(dd, (int64_t)f->size, 1, 0, file_key(f));
+
+    return FS_OK;
+}
+
+/* 内容がリンク先のパス target のファイルとして作る。リンク先は作る時点では確かめない */
+static int fs_symlink(struct Dir *d, const char *name, const char *target) {
+    if (name_taken(d, name)) return FS_EXIST;
+
+    size_t len = strlen(target);
+    char *data = malloc(len);
+    struct File *f = data ? file_new(name) : NULL;
+    if (!f) {
+        free(data);
+        return FS_NOMEM;
+    }
+    memcpy(data, target, len);
+    f->mode = 0777;
+    f->symlink = 1;
+    f->hash = hash64(data, len);
+    f->content = store_intern(data, len, f->hash);
+    f->size = len;
+
+    if (dir_freeze(d) < 0 || dir_add_file(d, f) < 0) {
+        file_free(f);
+        return FS_NOMEM;
+    }
+    usage_add(d, (int64_t)len, 1, 0, file_key(f));
+
+    return FS_OK;
+}
+
+/* name のファイルの mode と持ち主を変える。File は書き換えず、複製を差し替える。
+ * keep には差し替えた元の File を解放せずに渡す（name が空なら d 自身を変え、keep は使わない） */
+static int fs_attr(struct Dir *d, const char *name, uint32_t mode, uint32_t uid, uint32_t gid,
+                   struct File **keep) {
+    if (keep) *keep = NULL;
+    if (!name[0]) {
+        dir_set_attr(d, mode, uid, gid);
+        return FS_OK;
+    }
+
+    int idx = find_file_index(d, name);
+    if (idx < 0) return FS_NOENT;
+    if (dir_freeze(d) < 0) return FS_NOMEM;
+
+    struct File *old = slots_at(d->files, idx);
+    struct File *f = file_alloc(old->name);
+    if (!f) return FS_NOMEM;
+    file_copy(f, old);
+    /* 元を取っておくなら内容を共有し、そうでなければ内容ごと引き継ぐ */
+    if (keep && file_share(f, old) < 0) {
+        file_node_free(f);
+        return FS_NOMEM;
+    }
+    f->mode = mode;
+    f->uid = uid;
+    f->gid = gid;
+    f->ctime = clock_ns();
+    f->ver = __atomic_load_n(&tree_ver, __ATOMIC_ACQUIRE);
+    if (f->ino) f->seq = __atomic_add_fetch(&f->ino->seq, 1, __ATOMIC_RELAXED);
+
+    slots_set(d->files, idx, f);
+    usage_add(d, 0, 0, 0, file_key(f) - file_key(old));
+    if (f->ino) link_mark(f->ino, d, f->name);
+    if (keep) *keep = old;
+    else file_retire(old, file_node_free);
+
+    return FS_OK;
+}
+
+/* dd の dname を sd の sname と同じ内容にする（sname の方が新しく書かれたときだけ）。
+ * 他のトランザクションが変更中のディレクトリには写さない */
+static void link_sync(struct Inode *ino, struct Dir *sd, const char *sname,
+                      struct Dir *dd, const char *dname) {
+    if (dir_lock2(sd, dd) < 0) return;
+
+    const struct File *src = find_file(sd, sname);
+    int idx = find_file_index(dd, dname);
+    struct File *old = idx >= 0 ? slots_at(dd->files, idx) : NULL;
+    if (src && old && src->ino == ino && old->ino == ino && src->seq > old->seq &&
+        (!dd->txn || dd->txn == txn) && dir_freeze(dd) == 0) {
+        struct File *f = file_alloc(dname);
+        if (f) {
+            file_copy(f, src);
+            memset(f->name, 0, NAME_LEN);
+            strncpy(f->name, dname, NAME_LEN - 1);
+            f->ver = __atomic_load_n(&tree_ver, __ATOMIC_ACQUIRE);
+        }
+        if (f && file_share(f, src) == 0) {
+            slots_set(dd->files, idx, f);
+            usage_add(dd, (int64_t)f->size - (int64_t)old->size, 0, 0, file_key(f) - file_key(old));
+            file_retire(old, file_free);
+        } else {
+            file_node_free(f);
+        }
+    }
+    dir_unlock2(sd, dd);
+}
+
+/* コマンドの終わりに、書いた名前の内容を同じ inode の他の名前へ写す。
+ * 写すのは木の上の最新の版だけで、ジャーナルには書かない（再生でも同じように写る） */
+static void link_flush(void) {
+    if (link_npending == 0) return;
+
+    const struct Snapshot *saved = view;
+    view = NULL;
+    epoch_enter();
+    for (size_t i = 0; i < link_npending; i++) {
+        struct LinkSync *p = &link_pending[i];
+        struct Inode *ino = p->ino;
+
+        pthread_mutex_lock(&ino->lock);
+        size_t n = ino->nlinks;
+        struct Link *to = n ? malloc(n * sizeof(*to)) : NULL;
+        if (to) memcpy(to, ino->links, n * sizeof(*to));
+        pthread_mutex_unlock(&ino->lock);
+
+        for (size_t j = 0; to && j < n; j++) {
+            if (to[j].d == p->d && strcmp(to[j].name, p->name) == 0) continue;
+            link_sync(ino, p->d, p->name, to[j].d, to[j].name);
+        }
+        free(to);
+        ino_drop(ino);
+    }
+    epoch_exit();
+    view = saved;
+
+    free(link_pending);
+    link_pending = NULL;
+    link_npending = link_pending_cap = 0;
+}
+
+/* ルートからの絶対パスを組み立てる（ルート自身は "/"） */
+static int dir_path(const struct Dir *d, char *buf, size_t size) {
+    const char *parts[64];
+    int depth = 0;
+
+    for (; d && d->parent; d = d->parent) {
+        if (depth == 64) return -1;
+        parts[depth++] = d->name;
+    }
+
+    size_t len = 0;
+    buf[0] = '\0';
+    for (int i = depth - 1; i >= 0; i--) {
+        int n = snprintf(buf + len, size - len, "/%s", parts[i]);
+        if (n < 0 || (size_t)n >= size - len) return -1;
+        len += (size_t)n;
+    }
+    if (len == 0) snprintf(buf, size, "/");
+
+    return 0;
+}
+
+/* ===== パス解決 =====
+ * 絶対パスはルートから、相対パスは cwd から 1 段ずつ辿る。
+ * 各段はロックを取らずに公開中の一覧から子を探す（エポックの区間内で呼ぶ）。
+ * replay の命令列の引数は Atom として置かれ、起点ごとに解決結果を覚えている。
+ * ディレクトリは動かず、木から外れるのはトランザクションの取り消しだけなので、
+ * 取り消しのたびに進む世代 (dir_gen) が同じ間は、一度たどれたパスの行き先は変わらない。
+ * "@名前/..." はスナップショットのルートから辿り、以後そのコマンドはその版を読む
+ * （"@/..." は現在の木）。古い版を辿った結果は覚えない。
+ * 途中の名前がシンボリックリンクなら、リンクのあるディレクトリ（絶対パスならルート）から
+ * リンク先を辿る。1 回の解決で辿るリンクは SYMLINK_HOPS 個までで、超えたらループとみなす。
+ * リンク先のディレクトリはリンクの File ごとに覚え、長い連鎖も毎回は辿り直さない。
+ * File は書き換えず、リンクを木から外すと dir_gen が進むので、覚えた結果は世代が同じ間だけ使う。 */
+#define ATOM_MAGIC    0x41544f4du
+#define SYMLINK_HOPS  40
+#define LINK_CACHE    256
+
+struct Atom {
+    uint32_t magic;
+    uint64_t gen;               /* 覚えた時点の dir_gen */
+    struct Dir *dir_base;       /* resolve_dir の起点と結果 */
+    struct Dir *dir;
+    struct Dir *parent_base;    /* resolve_parent の起点と結果 */
+    struct Dir *parent;
+    char s[];
+};
+
+/* 再生中の命令列の引数置き場（スレッドごと） */
+static _Thread_local struct {
+    const char *base;
+    size_t len;
+} atoms;
+
+/* p が引数置き場の Atom の文字列そのものなら、その Atom を返す */
+static struct Atom *path_atom(const char *p) {
+    uintptr_t at = (uintptr_t)p - offsetof(struct Atom, s);
+    uintptr_t lo = (uintptr_t)atoms.base;
+    if (!atoms.base || (uintptr_t)p < lo + offsetof(struct Atom, s) || (uintptr_t)p >= lo + atoms.len ||
+        at % _Alignof(struct Atom) != 0) {
+        return NULL;
+    }
+    struct Atom *a = (struct Atom *)at;
+    if (a->magic != ATOM_MAGIC) return NULL;
+
+    uint64_t gen = __atomic_load_n(&dir_gen, __ATOMIC_ACQUIRE);
+    if (a->gen != gen) {
+        a->dir = a->parent = NULL;
+        a->gen = gen;
+    }
+    return a;
+}
+
+/* シンボリックリンクの行き先の覚え書き（スレッドごと、File のアドレスで直接写像） */
+static _Thread_local struct LinkCache {
+    const struct File *f;
+    uint64_t gen;
+    struct Dir *dir;
+} link_cache[LINK_CACHE];
+
+/* 直前の解決が失敗した理由（見つからないときは PATH_OK のまま） */
+enum {
+    PATH_OK = 0,
+    PATH_LOOP,                  /* リンクを辿りすぎた */
+    PATH_DENIED,                /* 途中のディレクトリに x がない */
+};
+
+static _Thread_local int path_err;
+
+static const char *path_msg(const char *fallback) {
+    return path_err == PATH_LOOP ? "too many levels of symbolic links\n" :
+           path_err == PATH_DENIED ? "permission denied\n" : fallback;
+}
+
+/* 辿れないディレクトリなら NULL を返す */
+static struct Dir *path_reach(struct Dir *d) {
+    if (d && !(dir_bits(d) & MAY_REACH)) {
+        path_err = PATH_DENIED;
+        return NULL;
+    }
+    return d;
+}
+
+/* リンク先のパスを buf (PATH_LEN) に取り出す */
+static int symlink_read(const struct File *f, char *buf) {
+    const char *data;
+    char *tmp;
+    if (f->size >= PATH_LEN || file_data(f, &data, &tmp) < 0) return -1;
+    memcpy(buf, data, f->size);
+    buf[f->size] = '\0';
+    free(tmp);
+    return 0;
+}
+
+/* d から rest（書き換える）を 1 段ずつ辿る。hops はこの解決で辿ったリンクの数 */
+static struct Dir *walk_path(const struct Session *s, struct Dir *d, char *rest, int *hops) {
+    char *save;
+    for (char *p = strtok_r(rest, "/", &save); p; p = strtok_r(NULL, "/", &save)) {
+        if (strcmp(p, ".") == 0) continue;
+        if (strcmp(p, "..") == 0) {
+            if (d->parent) d = d->parent;
+            continue;
+        }
+
+        if (dir_ready(d) < 0) return NULL;
+        struct Dir *next = find_subdir(d, p);
+        const struct File *f = next ? NULL : find_file(d, p);
+        if (f && f->symlink) {
+            if (++*hops > SYMLINK_HOPS) {
+                path_err = PATH_LOOP;
+                return NULL;
+            }
+            struct LinkCache *c = &link_cache[mix64((uintptr_t)f) % LINK_CACHE];
+            uint64_t gen = __atomic_load_n(&dir_gen, __ATOMIC_ACQUIRE);
+            if (!view && c->f == f && c->gen == gen) {
+                next = c->dir;
+            } else {
+                char target[PATH_LEN];
+                if (symlink_read(f, target) < 0) return NULL;
+                next = walk_path(s, target[0] == '/' ? s->root : d, target, hops);
+                if (next && !view) {
+                    c->f = f;
+                    c->gen = gen;
+                    c->dir = next;
+                }
+            }
+        }
+        if (!next) return NULL;
+        d = next;
+    }
+
+    return d;
+}
+
+static struct Dir *lookup_path(const struct Session *s, const char *path) {
+    TRACE_SPAN("resolve");
+    char buf[PATH_LEN];
+    if (snprintf(buf, sizeof(buf), "%s", path) >= (int)sizeof(buf)) return NULL;
+
+    struct Dir *d = path[0] == '/' ? s->root : s->cwd;
+    char *rest = buf;
+    if (buf[0] == '@') {
+        char *slash = strchr(buf, '/');
+        if (slash) *slash = '\0';
+        const struct Snapshot *snap = buf[1] ? snapshot_find(buf + 1) : NULL;
+        if (buf[1] && !snap) return NULL;
+        view = snap;
+        d = s->root;
+        rest = slash ? slash + 1 : buf + strlen(buf);
+    }
+
+    int hops = 0;
+    return walk_path(s, d, rest, &hops);
+}
+
+/* 行き先まで辿る権限も確かめる（覚えた結果を使うときも） */
+static struct Dir *resolve_dir(const struct Session *s, const char *path) {
+    path_err = PATH_OK;
+    struct Atom *a = !view && path[0] != '@' ? path_atom(path) : NULL;
+    struct Dir *base = path[0] == '/' ? s->root : s->cwd;
+    if (a && a->dir && a->dir_base == base) return path_reach(a->dir);
+
+    struct Dir *d = lookup_path(s, path);
+    if (a && d) {
+        a->dir_base = base;
+        a->dir = d;
+    }
+    return path_reach(d);
+}
+
+/* 最後の要素を name に切り出し、その親ディレクトリを返す */
+static struct Dir *resolve_parent(const struct Session *s, const char *path, char *name) {
+    path_err = PATH_OK;
+    char buf[PATH_LEN];
+    if (snprintf(buf, sizeof(buf), "%s", path) >= (int)sizeof(buf)) return NULL;
+
+    size_t len = strlen(buf);
+    while (len > 1 && buf[len - 1] == '/') buf[--len] = '\0';
+
+    char *slash = strrchr(buf, '/');
+    const char *leaf = slash ? slash + 1 : buf;
+    if (*leaf == '\0' || strcmp(leaf, ".") == 0 || strcmp(leaf, "..") == 0) {
+        return NULL;
+    }
+    strncpy(name, leaf, NAME_LEN - 1);
+    name[NAME_LEN - 1] = '\0';
+
+    if (!slash) return path_reach(s->cwd);
+    if (slash == buf) return path_reach(s->root);
+    *slash = '\0';
+
+    struct Atom *a = !view && path[0] != '@' ? path_atom(path) : NULL;
+    struct Dir *base = buf[0] == '/' ? s->root : s->cwd;
+    if (a && a->parent && a->parent_base == base) return path_reach(a->parent);
+
+    struct Dir *d = lookup_path(s, buf);
+    if (a && d) {
+        a->parent_base = base;
+        a->parent = d;
+    }
+    return path_reach(d);
+}
+
+/* resolve_parent と同じだが、最後の名前がシンボリックリンクならリンク先の親と名前にする
+ * （読み書きするファイル用。リンク先がまだないファイルでもよい） */
+static struct Dir *resolve_file(const struct Session *s, const char *path, char *name) {
+    struct Dir *d = resolve_parent(s, path, name);
+    for (int hops = 0; d; hops++) {
+        const struct File *f = dir_ready(d) == 0 ? find_file(d, name) : NULL;
+        if (!f || !f->symlink) return d;
+        if (hops == SYMLINK_HOPS) {
+            path_err = PATH_LOOP;
+            return NULL;
+        }
+
+        char target[PATH_LEN];
+        if (symlink_read(f, target) < 0) return NULL;
+        struct Session at = *s;
+        at.cwd = d;
+        d = resolve_parent(&at, target, name);
+    }
+    return NULL;
+}
+
+/* ===== ジャーナル =====
+ * 永続モード (-p) では変更操作を追記専用のジャーナルに記録する。
+ * レコードはメモリに貯め、JOURNAL_BATCH 件ごとにまとめて write + fsync する
+ * （グループコミット）。バッファは 2 面持ち、fsync 中も追記を止めない。
+ * JOURNAL_CHECKPOINT 件を超えたらイメージへ書き戻してジャーナルを空にする。
+ * 起動時はイメージを読んだあとジャーナルを再生する。
+ *
+ * レコード: [長さ u32][チェックサム u32][op u8][cred][時刻 u64][dir\0][arg1\0][dir2\0][arg2\0][data]\0
+ * cred は記録したコマンドの利用者 (struct Cred)、時刻はそのコマンドの clock_ns。
+ * 作るノードの持ち主と mode、ファイルの時刻を再生で揃える。
+ * dir2 が空なら dir と同じ。data はリダイレクトで書いた内容（他の op では空）。
+ * 末尾の書きかけレコードはチェックサムで検出して捨てる。
+ * トランザクション中の記録は BEGIN と COMMIT の印で挟んで一度に書き、
+ * 再生では COMMIT まで揃ったまとまりだけを適用する。
+ *
+ * 記録は対象ディレクトリのロック中に行うので、同じディレクトリへの
+ * 操作は実行順に並ぶ。チェックポイントは checkpoint_lock を書き込みで取り、
+ * 実行中のコマンドがない状態でイメージを書く。 */
+#define JOURNAL_BUF        (1024 * 1024)
+#define JOURNAL_BATCH      4096
+#define JOURNAL_CHECKPOINT (256 * 1024)
+#define JOURNAL_HEAD       (1 + (uint32_t)sizeof(struct Cred) + 8)   /* op と cred と時刻 */
+#define JOURNAL_MARK       (JOURNAL_HEAD + 5)   /* BEGIN / COMMIT の本体 */
+
+enum {
+    OP_TOUCH = 1,
+    OP_RM,
+    OP_MV,
+    OP_MKDIR,
+    OP_WRITE,
+    OP_APPEND,
+    OP_BEGIN,                   /* トランザクションの印。文字列はすべて空 */
+    OP_COMMIT,
+    OP_LN,
+    OP_SYMLINK,                 /* リンク先のパスは 2 つ目の名前の欄に置く */
+    OP_ATTR,                    /* "mode uid gid" を 2 つ目の名前の欄に置く。名前が空ならディレクトリ自身 */
+};
+
+static struct {
+    int fd;
+    const char *image;
+    struct Dir *root;
+    pthread_mutex_t lock;       /* 追記用バッファ */
+    pthread_mutex_t sync_lock;  /* write + fsync の直列化 */
+    char buf[2][JOURNAL_BUF];
+    size_t len[2];
+    int cur;
+    int pending;
+    long since_checkpoint;
+    int checkpoint_due;
+} journal = {
+    .fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .sync_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static pthread_rwlock_t checkpoint_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* 立っている間、このスレッドの変更は記録しない（bench の作業用の木） */
+static _Thread_local int journal_muted;
+
+static uint32_t fnv1a(const void *p, size_t n) {
+    const unsigned char *s = p;
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < n; i++) {
+        h = (h ^ s[i]) * 16777619u;
+    }
+    return h;
+}
+
+static int write_all(int fd, const void *p, size_t n) {
+    const char *s = p;
+    while (n > 0) {
+        ssize_t w = write(fd, s, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        s += w;
+        n -= (size_t)w;
+    }
+    return 0;
+}
+
+/* 追記面を切り替えてから、ロックの外で書き込みと fsync を行う。
+ * extra（nrec 件分）があれば、切り替えた面の直後に続けて書く */
+static void journal_flush(const char *extra, size_t elen, long nrec) {
+    pthread_mutex_lock(&journal.sync_lock);
+    if (journal.fd < 0) {
+        pthread_mutex_unlock(&journal.sync_lock);
+        return;
+    }
+
+    pthread_mutex_lock(&journal.lock);
+    int b = journal.cur;
+    size_t len = journal.len[b];
+    journal.cur = !b;
+    journal.pending = 0;
+    journal.since_checkpoint += nrec;
+    if (journal.since_checkpoint >= JOURNAL_CHECKPOINT) journal.checkpoint_due = 1;
+    pthread_mutex_unlock(&journal.lock);
+
+    if (len > 0 || elen > 0) {
+        if ((len > 0 && write_all(journal.fd, journal.buf[b], len) < 0) ||
+            (elen > 0 && write_all(journal.fd, extra, elen) < 0) || fsync(journal.fd) < 0) {
+            perror("journal");
+        }
+        journal.len[b] = 0;
+    }
+    pthread_mutex_unlock(&journal.sync_lock);
+}
+
+static void journal_sync(void) {
+    journal_flush(NULL, 0, 0);
+}
+
+/* 開いているトランザクションがあれば、その変更を含めないよう取らずに -1 を返す */
+static int journal_checkpoint(void) {
+    pthread_rwlock_wrlock(&checkpoint_lock);
+    if (__atomic_load_n(&txn_open, __ATOMIC_ACQUIRE) > 0) {
+        pthread_rwlock_unlock(&checkpoint_lock);
+        return -1;
+    }
+    journal_sync();
+
+    if (write_image(journal.root, journal.image) < 0) {
+        fputs("checkpoint failed\n", stderr);
+    } else {
+        /* 書き込み位置も先頭へ戻す（戻さないと先頭が 0 で埋まり、再生がそこで止まる） */
+        if (ftruncate(journal.fd, 0) < 0 || lseek(journal.fd, 0, SEEK_SET) < 0) perror("journal");
+        journal.since_checkpoint = 0;
+    }
+    journal.checkpoint_due = 0;
+    pthread_rwlock_unlock(&checkpoint_lock);
+    return 0;
+}
+
+/* コマンドの実行後（ロックを何も持たない状態）に呼ぶ。
+ * トランザクションが開いている間のチェックポイントは閉じるまで延ばす */
+static void journal_maintain(void) {
+    if (journal.fd < 0) return;
+
+    pthread_mutex_lock(&journal.lock);
+    int full = journal.pending >= JOURNAL_BATCH;
+    int due = journal.checkpoint_due && __atomic_load_n(&txn_open, __ATOMIC_ACQUIRE) == 0;
+    pthread_mutex_unlock(&journal.lock);
+
+    if (due) journal_checkpoint();
+    else if (full) journal_sync();
+}
+
+static int journal_checkpoint_due(void) {
+    pthread_mutex_lock(&journal.lock);
+    int due = journal.checkpoint_due;
+    pthread_mutex_unlock(&journal.lock);
+    return due;
+}
+
+static void journal_request_checkpoint(void) {
+    pthread_mutex_lock(&journal.lock);
+    journal.checkpoint_due = 1;
+    pthread_mutex_unlock(&journal.lock);
+}
+
+/* 本体の長さ len のレコードを rec へ組み立てる（ヘッダの 8 バイトを含めて 8 + len） */
+static void journal_encode(char *rec, uint32_t len, int op, const char *path, const char *a,
+                           const char *path2, const char *b, const char *data, size_t dlen) {
+    char *p = rec + 8;
+    *p++ = (char)op;
+    uint64_t now = clock_ns();
+    memcpy(p, &cred, sizeof(cred));
+    p += sizeof(cred);
+    memcpy(p, &now, sizeof(now));
+    p += sizeof(now);
+    p = stpcpy(p, path) + 1;
+    p = stpcpy(p, a) + 1;
+    p = stpcpy(p, path2) + 1;
+    p = stpcpy(p, b) + 1;
+    if (dlen > 0) memcpy(p, data, dlen);
+    p[dlen] = '\0';
+
+    uint32_t sum = fnv1a(rec + 8, len);
+    memcpy(rec, &len, 4);
+    memcpy(rec + 4, &sum, 4);
+}
+
+/* トランザクションの記録は手元に溜める。最初の記録の前に BEGIN の印を置く */
+static void txn_journal(int op, const char *path, const char *a, const char *path2,
+                        const char *b, const char *data, size_t dlen, uint32_t len) {
+    struct Txn *t = txn;
+    pthread_mutex_lock(&t->lock);
+    size_t need = t->log_len + 8 + len + (t->log_len == 0 ? 8 + JOURNAL_MARK : 0);
+    if (grow(&t->log, &t->log_cap, need, 1) < 0) {
+        t->failed = 1;
+        pthread_mutex_unlock(&t->lock);
+        return;
+    }
+    if (t->log_len == 0) {
+        journal_encode(t->log, JOURNAL_MARK, OP_BEGIN, "", "", "", "", NULL, 0);
+        t->log_len = 8 + JOURNAL_MARK;
+    }
+    journal_encode(t->log + t->log_len, len, op, path, a, path2, b, data, dlen);
+    t->log_len += 8 + len;
+    t->nrec++;
+    pthread_mutex_unlock(&t->lock);
+}
+
+/* 1 レコードが入りきらない大きさの内容は、記録せずにイメージへ書き戻す。
+ * トランザクションの手元のログには大きさの制限がないので、そのまま記録する */
+static void journal_append(int op, const struct Dir *d, const char *a,
+                           const struct Dir *d2, const char *b,
+                           const char *data, size_t dlen) {
+    if (journal.fd < 0 || journal_muted) return;
+    if (dlen > JOURNAL_BUF / 4 && !txn) {
+        journal_request_checkpoint();
+        return;
+    }
+
+    char path[PATH_LEN], path2[PATH_LEN] = "";
+    if (dir_path(d, path, sizeof(path)) < 0) return;
+    if (d2 && d2 != d && dir_path(d2, path2, sizeof(path2)) < 0) return;
+    if (!b) b = "";
+
+    uint32_t len = (uint32_t)(JOURNAL_HEAD + strlen(path) + 1 + strlen(a) + 1 +
+                              strlen(path2) + 1 + strlen(b) + 1 + dlen + 1);
+    if (txn) {
+        txn_journal(op, path, a, path2, b, data, dlen, len);
+        return;
+    }
+
+    pthread_mutex_lock(&journal.lock);
+    while (journal.len[journal.cur] + 8 + len > JOURNAL_BUF) {
+        pthread_mutex_unlock(&journal.lock);
+        journal_sync();
+        pthread_mutex_lock(&journal.lock);
+    }
+
+    journal_encode(journal.buf[journal.cur] + journal.len[journal.cur], len, op,
+                   path, a, path2, b, data, dlen);
+    journal.len[journal.cur] += 8 + len;
+
+    journal.pending++;
+    if (++journal.since_checkpoint >= JOURNAL_CHECKPOINT) journal.checkpoint_due = 1;
+    pthread_mutex_unlock(&journal.lock);
+}
+
+/* トランザクションの記録を COMMIT の印で閉じ、他の記録を挟まずに続けて置く。
+ * バッファに収まらない大きさなら、溜まっている分に続けて直接書く */
+static void journal_commit(struct Txn *t) {
+    if (journal.fd < 0 || t->nrec == 0) return;
+    if (grow(&t->log, &t->log_cap, t->log_len + 8 + JOURNAL_MARK, 1) < 0) {
+        perror("journal");
+        return;
+    }
+    journal_encode(t->log + t->log_len, JOURNAL_MARK, OP_COMMIT, "", "", "", "", NULL, 0);
+    t->log_len += 8 + JOURNAL_MARK;
+
+    if (t->log_len > JOURNAL_BUF) {
+        journal_flush(t->log, t->log_len, t->nrec);
+        return;
+    }
+
+    pthread_mutex_lock(&journal.lock);
+    while (journal.len[journal.cur] + t->log_len > JOURNAL_BUF) {
+        pthread_mutex_unlock(&journal.lock);
+        journal_sync();
+        pthread_mutex_lock(&journal.lock);
+    }
+    memcpy(journal.buf[journal.cur] + journal.len[journal.cur], t->log, t->log_len);
+    journal.len[journal.cur] += t->log_len;
+    journal.pending += (int)t->nrec;
+    journal.since_checkpoint += t->nrec;
+    if (journal.since_checkpoint >= JOURNAL_CHECKPOINT) journal.checkpoint_due = 1;
+    pthread_mutex_unlock(&journal.lock);
+}
+
+static void journal_log(int op, const struct Dir *d, const char *a,
+                        const struct Dir *d2, const char *b) {
+    journal_append(op, d, a, d2, b, NULL, 0);
+}
+
+static void journal_apply(struct Dir *root, const char *rec, uint32_t len) {
+    const char *end = rec + len;
+    const char *f[4];
+    int n = 0;
+    if (len < JOURNAL_HEAD) return;
+
+    for (const char *p = rec + JOURNAL_HEAD; n < 4 && p < end; p += strlen(p) + 1) {
+        f[n++] = p;
+    }
+    if (n < 4) return;
+
+    /* 4 つ目の文字列の後ろから末尾の \0 の手前までが内容 */
+    const char *data = f[3] + strlen(f[3]) + 1;
+    size_t dlen = data < end ? (size_t)(end - data) - 1 : 0;
+
+    struct Session s = { root, root, 0, NULL, NULL, NULL, { 0, 0, 0 } };
+    struct Dir *d = resolve_dir(&s, f[0]);
+    struct Dir *d2 = f[2][0] ? resolve_dir(&s, f[2]) : d;
+    if (!d || !d2 || dir_lock2(d, d2) < 0) return;
+
+    struct Cred saved = cred;
+    uint64_t saved_clock = clock_now;
+    memcpy(&cred, rec + 1, sizeof(cred));
+    memcpy(&clock_now, rec + 1 + sizeof(cred), sizeof(clock_now));
+    char *copy;
+    unsigned mode, uid, gid;
+    switch (rec[0]) {
+    case OP_TOUCH: fs_touch(d, f[1]); break;
+    case OP_RM:    fs_rm(d, f[1], NULL); break;
+    case OP_MV:    fs_mv(d, f[1], d2, f[3]); break;
+    case OP_LN:    fs_ln(d, f[1], d2, f[3]); break;
+    case OP_SYMLINK: fs_symlink(d, f[1], f[3]); break;
+    case OP_ATTR:
+        if (sscanf(f[3], "%o %u %u", &mode, &uid, &gid) == 3) fs_attr(d, f[1], mode, uid, gid, NULL);
+        break;
+    case OP_MKDIR: fs_mkdir(d, f[1]); break;
+    case OP_WRITE:
+    case OP_APPEND:
+        if ((copy = malloc(dlen + 1)) != NULL) {
+            memcpy(copy, data, dlen);
+            fs_write(d, f[1], copy, dlen, rec[0] == OP_APPEND, NULL);
+        }
+        break;
+    }
+    cred = saved;
+    clock_now = saved_clock;
+    dir_unlock2(d, d2);
+    link_flush();
+}
+
+/* off から始まるレコードが完全なら本体の長さを、書きかけなら 0 を返す */
+static uint32_t journal_record(const char *data, size_t size, size_t off) {
+    uint32_t len, sum;
+    if (size - off < 8) return 0;
+    memcpy(&len, data + off, 4);
+    memcpy(&sum, data + off + 4, 4);
+    if (len == 0 || len > size - off - 8 ||
+        data[off + 8 + len - 1] != '\0' ||
+        fnv1a(data + off + 8, len) != sum) {
+        return 0;
+    }
+    return len;
+}
+
+/* ジャーナルを再生し、以降の追記用に開いたままにする */
+static int journal_open(struct Dir *root, const char *image_path) {
+    char path[PATH_LEN];
+    if (snprintf(path, sizeof(path), "%s.journal", image_path) >= (int)sizeof(path)) {
+        return -1;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    size_t size = (size_t)st.st_size, off = 0;
+    long replayed = 0;
+    if (size > 0) {
+        char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+
+        uint32_t len;
+        while ((len = journal_record(data, size, off)) > 0) {
+            if (data[off + 8] != OP_BEGIN) {
+                journal_apply(root, data + off + 8, len);
+                off += 8 + len;
+                replayed++;
+                continue;
+            }
+
+            /* COMMIT まで揃っていなければ、まとまりごと書きかけとして捨てる */
+            size_t end = off + 8 + len;
+            uint32_t n;
+            while ((n = journal_record(data, size, end)) > 0 && data[end + 8] != OP_COMMIT) {
+                end += 8 + n;
+            }
+            if (n == 0) break;
+            for (size_t p = off + 8 + len, m; p < end; p += 8 + m) {
+                m = journal_record(data, size, p);
+                journal_apply(root, data + p + 8, (uint32_t)m);
+                replayed++;
+            }
+            off = end + 8 + n;
+        }
+        munmap(data, size);
+    }
+
+    /* 書きかけの末尾は捨てる */
+    if (off < size && ftruncate(fd, (off_t)off) < 0) perror(path);
+    lseek(fd, 0, SEEK_END);
+
+    journal.fd = fd;
+    journal.image = image_path;
+    journal.root = root;
+    journal.since_checkpoint = replayed;
+
+    if (replayed > 0) printf("journal: %ld records replayed\n", replayed);
+    return 0;
+}
+
+static void journal_close(void) {
+    if (journal.fd < 0) return;
+
+    journal_sync();
+    pthread_mutex_lock(&journal.sync_lock);
+    close(journal.fd);
+    journal.fd = -1;
+    pthread_mutex_unlock(&journal.sync_lock);
+}
+
+/* ===== トランザクション =====
+ * begin から commit / rollback までの変更をひとまとまりにする。変更は木へその場で
+ * 反映し（読み手には確定前の内容も見える）、戻し方を undo に積む。取り消しは
+ * 積んだ逆順に戻すだけ、確定は溜めたジャーナルを書いて印を外すだけで済む。
+ * 変更したディレクトリには持ち主の印を付け、他の書き手は待たずに FS_BUSY で断る
+ * （1 本のループで全接続を回すサーバーでも、待ち合いで止まらない）。
+ * 取り消しで木から外したディレクトリは cwd などから指されうるので、終了まで解放しない。 */
+
+enum {
+    UNDO_TOUCH = 1,
+    UNDO_RM,
+    UNDO_MV,
+    UNDO_MKDIR,
+    UNDO_WRITE,
+    UNDO_IMPORT,
+    UNDO_ATTR,                  /* ディレクトリの権限。keep は元の struct Attr（malloc） */
+};
+
+struct Attr {
+    uint32_t mode, uid, gid;
+};
+
+/* 取り消しで木から外れたディレクトリの持ち主。以後は誰も変更できない */
+static struct Txn txn_dead;
+
+static struct {
+    pthread_mutex_t lock;
+    struct Dir **dir;
+    size_t n, cap;
+} graveyard = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* d のロック中に呼ぶ。実行中のトランザクションがあれば d をその持ち物にする。
+ * 変更の前には必ず通るので、スナップショットを見ているときはここで断る */
+static int txn_claim(struct Dir *d) {
+    if (view) return FS_RDONLY;
+    if (d->txn == txn) return FS_OK;
+    if (d->txn) return FS_BUSY;
+
+    pthread_mutex_lock(&txn->lock);
+    int rc = grow(&txn->claimed, &txn->claimed_cap, txn->nclaimed + 1, sizeof(*txn->claimed));
+    if (rc == 0) txn->claimed[txn->nclaimed++] = d;
+    pthread_mutex_unlock(&txn->lock);
+    if (rc < 0) return FS_NOMEM;
+
+    d->txn = txn;
+    return FS_OK;
+}
+
+/* まだ木に繋いでいない部分木をまるごと持ち物にする（import 用） */
+static void txn_adopt(struct Dir *d) {
+    int n;
+    struct Slots *ds = slots_get(&d->subdirs, &n);
+    d->txn = txn;
+    for (int i = 0; i < n; i++) txn_adopt(slots_at(ds, i));
+}
+
+/* 持ち主が from なら to に替える。deep なら部分木全体に行う */
+static void txn_mark(struct Dir *d, struct Txn *from, struct Txn *to, int deep) {
+    if (dir_lock(d) < 0) return;
+    if (d->txn == from) d->txn = to;
+    dir_unlock(d);
+    if (!deep) return;
+
+    int n;
+    struct Slots *ds = slots_get(&d->subdirs, &n);
+    for (int i = 0; i < n; i++) txn_mark(slots_at(ds, i), from, to, 1);
+}
+
+static void txn_fail(void) {
+    if (!txn) return;
+    pthread_mutex_lock(&txn->lock);
+    txn->failed = 1;
+    pthread_mutex_unlock(&txn->lock);
+}
+
+/* 成功した変更の戻し方を積む。ロックを何も持たずに呼ぶ。
+ * keep は UNDO_RM / UNDO_WRITE では外した File、UNDO_MKDIR / UNDO_IMPORT では作った Dir */
+static void txn_record(int op, struct Dir *d, const char *name,
+                       struct Dir *d2, const char *name2, void *keep) {
+    struct Txn *t = txn;
+    if (!t) return;
+
+    pthread_mutex_lock(&t->lock);
+    if (grow(&t->undo, &t->undo_cap, t->nundo + 1, sizeof(*t->undo)) < 0) {
+        /* 戻せなくなったので commit させない。取っておく物も手放す */
+        t->failed = 1;
+        pthread_mutex_unlock(&t->lock);
+        if (op == UNDO_RM || op == UNDO_WRITE) {
+            if (keep) file_retire(keep, file_free);
+        } else if (op == UNDO_ATTR) {
+            free(keep);
+        } else if (keep) {
+            txn_mark(keep, t, NULL, op == UNDO_IMPORT);
+        }
+        return;
+    }
+
+    struct Undo *u = &t->undo[t->nundo++];
+    memset(u, 0, sizeof(*u));
+    u->op = op;
+    u->d = d;
+    u->d2 = d2;
+    strncpy(u->name, name, NAME_LEN - 1);
+    if (name2) strncpy(u->name2, name2, NAME_LEN - 1);
+    u->keep = keep;
+    pthread_mutex_unlock(&t->lock);
+}
+
+/* 部分木を親から外し、二度と変更されないようにする。
+ * 外したことは世代を進めて、覚えたパスの解決結果を捨てさせる */
+static void txn_detach(struct Txn *t, struct Dir *parent, struct Dir *sub) {
+    if (dir_lock(parent) < 0) return;
+
+    int n, found = 0;
+    struct Slots *ds = slots_get(&parent->subdirs, &n);
+    for (int i = 0; i < n && !found; i++) {
+        if (slots_at(ds, i) == sub && dir_freeze(parent) == 0 &&
+            slots_remove(&parent->subdirs, i) == 0) found = 1;
+    }
+    if (found) {
+        struct Usage u;
+        usage_get(sub, &u);
+        usage_add(parent, -(int64_t)u.bytes, -(int64_t)u.files, -(int64_t)u.dirs - 1,
+                  -dir_key(sub->name, u.hash));
+    }
+    dir_unlock(parent);
+    if (!found) return;
+
+    txn_mark(sub, t, &txn_dead, 1);
+    __atomic_add_fetch(&dir_gen, 1, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&graveyard.lock);
+    if (grow(&graveyard.dir, &graveyard.cap, graveyard.n + 1, sizeof(*graveyard.dir)) == 0) {
+        graveyard.dir[graveyard.n++] = sub;
+    }
+    pthread_mutex_unlock(&graveyard.lock);
+}
+
+static void txn_undo(struct Txn *t, const struct Undo *u) {
+    struct File *f = u->keep;
+
+    switch (u->op) {
+    case UNDO_TOUCH:
+        if (dir_lock(u->d) < 0) break;
+        fs_rm(u->d, u->name, NULL);
+        dir_unlock(u->d);
+        break;
+    case UNDO_RM:
+        if (dir_lock(u->d) < 0) break;
+        if (dir_freeze(u->d) == 0 && dir_add_file(u->d, f) == 0) {
+            usage_add(u->d, (int64_t)f->size, 1, 0, file_key(f));
+            if (f->ino) link_add(f->ino, u->d, f->name);
+        } else {
+            file_retire(f, file_free);
+        }
+        dir_unlock(u->d);
+        break;
+    case UNDO_MV:
+        if (dir_lock2(u->d, u->d2) < 0) break;
+        fs_mv(u->d2, u->name2, u->d, u->name);
+        dir_unlock2(u->d, u->d2);
+        break;
+    case UNDO_WRITE: {
+        if (dir_lock(u->d) < 0) break;
+        int idx = find_file_index(u->d, u->name);
+        if (idx >= 0 && f && f->ino) {
+            /* 他の名前へ写し戻せるよう、新しい番号を付けた複製を戻す */
+            struct File *c = file_alloc(f->name);
+            if (c) {
+                file_copy(c, f);
+                c->seq = __atomic_add_fetch(&f->ino->seq, 1, __ATOMIC_RELAXED);
+                file_retire(f, file_node_free);
+                f = c;
+            }
+        }
+        if (idx >= 0 && f) {
+            struct File *cur = slots_at(u->d->files, idx);
+            if (dir_freeze(u->d) == 0) {
+                slots_set(u->d->files, idx, f);
+                usage_add(u->d, (int64_t)f->size - (int64_t)cur->size, 0, 0,
+                          file_key(f) - file_key(cur));
+                if (f->ino) link_mark(f->ino, u->d, f->name);
+                file_retire(cur, file_free);
+            } else {
+                file_retire(f, file_free);
+            }
+        } else if (idx >= 0) {
+            fs_rm(u->d, u->name, NULL);
+        }
+        dir_unlock(u->d);
+        break;
+    }
+    case UNDO_MKDIR:
+    case UNDO_IMPORT:
+        txn_detach(t, u->d, u->keep);
+        break;
+    case UNDO_ATTR: {
+        const struct Attr *a = u->keep;
+        if (dir_lock(u->d) == 0) {
+            dir_set_attr(u->d, a->mode, a->uid, a->gid);
+            dir_unlock(u->d);
+        }
+        free(u->keep);
+        break;
+    }
+    }
+}
+
+/* 確定 (commit) か取り消しの後始末をして t を解放する。
+ * 確定では印を外す前にジャーナルへ書き、他の書き手の記録が先に並ばないようにする */
+static void txn_end(struct Txn *t, int commit) {
+    epoch_enter();
+    if (commit) {
+        journal_commit(t);
+        for (size_t i = 0; i < t->nundo; i++) {
+            struct Undo *u = &t->undo[i];
+            if ((u->op == UNDO_RM || u->op == UNDO_WRITE) && u->keep) file_retire(u->keep, file_free);
+            if (u->op == UNDO_ATTR) free(u->keep);
+            if (u->op == UNDO_MKDIR || u->op == UNDO_IMPORT) {
+                txn_mark(u->keep, t, NULL, u->op == UNDO_IMPORT);
+            }
+        }
+    } else {
+        for (size_t i = t->nundo; i-- > 0;) txn_undo(t, &t->undo[i]);
+    }
+    for (size_t i = 0; i < t->nclaimed; i++) txn_mark(t->claimed[i], t, NULL, 0);
+    epoch_exit();
+
+    __atomic_sub_fetch(&txn_open, 1, __ATOMIC_RELEASE);
+    pthread_mutex_destroy(&t->lock);
+    free(t->undo);
+    free(t->claimed);
+    free(t->log);
+    free(t);
+}
+
+static void graveyard_free(void) {
+    for (size_t i = 0; i < graveyard.n; i++) free_dir(graveyard.dir[i]);
+    free(graveyard.dir);
+}
+
+/* ===== 並列ツリー走査 =====
+ * ディレクトリ単位の作業キューを複数のワーカーで処理する（import / export 共通）。
+ * 各ディレクトリはそれを取り出したワーカーだけが触るため、
+ * ロックが必要なのはキューだけ。木を読む visit はエポックの区間内で呼ぶ。 */
+#define WALK_THREADS_MAX 16
+
+struct WalkItem {
+    struct WalkItem *next;
+    struct Dir *dir;
+    char *path;                 /* 対応するホスト側のパス */
+};
+
+struct WalkStats {
+    long dirs, files, skipped;
+    unsigned long long bytes;
+};
+
+struct TreeWalk {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct WalkItem *head;
+    int busy;                   /* キュー上または処理中の項目数 */
+    int with_content;
+    const struct Snapshot *view;    /* 呼び出し元が読んでいる版 */
+    struct Cred cred;               /* 呼び出し元の利用者（取り込んだノードの持ち主） */
+    void (*visit)(struct TreeWalk *tw, struct WalkItem *it, struct WalkStats *st);
+    struct WalkStats st;
+};
+
+static int walk_push(struct TreeWalk *tw, struct Dir *d, const char *dir, const char *name) {
+    struct WalkItem *it = malloc(sizeof(*it));
+    size_t len = strlen(dir) + strlen(name) + 2;
+    char *path = malloc(len);
+    if (!it || !path) {
+        free(it);
+        free(path);
+        return -1;
+    }
+
+    snprintf(path, len, "%s%s%s", dir, *name ? "/" : "", name);
+    it->dir = d;
+    it->path = path;
+
+    pthread_mutex_lock(&tw->lock);
+    it->next = tw->head;
+    tw->head = it;
+    tw->busy++;
+    pthread_cond_signal(&tw->cond);
+    pthread_mutex_unlock(&tw->lock);
+    return 0;
+}
+
+static void *walk_worker(void *arg) {
+    struct TreeWalk *tw = arg;
+    view = tw->view;
+    cred = tw->cred;
+
+    pthread_mutex_lock(&tw->lock);
+    for (;;) {
+        while (!tw->head && tw->busy > 0) {
+            pthread_cond_wait(&tw->cond, &tw->lock);
+        }
+        if (!tw->head) break;
+
+        struct WalkItem *it = tw->head;
+        tw->head = it->next;
+        pthread_mutex_unlock(&tw->lock);
+
+        struct WalkStats st = { 0, 0, 0, 0 };
+        epoch_enter();
+        tw->visit(tw, it, &st);
+        epoch_exit();
+        free(it->path);
+        free(it);
+
+        pthread_mutex_lock(&tw->lock);
+        tw->st.dirs += st.dirs;
+        tw->st.files += st.files;
+        tw->st.skipped += st.skipped;
+        tw->st.bytes += st.bytes;
+        if (--tw->busy == 0) pthread_cond_broadcast(&tw->cond);
+    }
+    pthread_mutex_unlock(&tw->lock);
+
+    return NULL;
+}
+
+static void *walk_thread(void *arg) {
+    walk_worker(arg);
+    epoch_thread_exit();
+    trace_thread_exit();
+    return NULL;
+}
+
+static int walk_run(struct TreeWalk *tw, struct Dir *top, const char *host) {
+    tw->view = view;
+    tw->cred = cred;
+    pthread_mutex_init(&tw->lock, NULL);
+    pthread_cond_init(&tw->cond, NULL);
+
+    int rc = walk_push(tw, top, host, "");
+    if (rc == 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        int nthreads = n < 1 ? 1 : n > WALK_THREADS_MAX ? WALK_THREADS_MAX : (int)n;
+        pthread_t tids[WALK_THREADS_MAX];
+        int started = 0;
+
+        for (int i = 1; i < nthreads; i++) {
+            if (pthread_create(&tids[started], NULL, walk_thread, tw) == 0) started++;
+        }
+        walk_worker(tw);
+        for (int i = 0; i < started; i++) {
+            pthread_join(tids[i], NULL);
+        }
+    }
+
+    pthread_mutex_destroy(&tw->lock);
+    pthread_cond_destroy(&tw->cond);
+    return rc;
+}
+
+/* ===== ホストからの取り込み =====
+ * 取り込み中の部分木はまだ cwd に繋がず、全ワーカーの終了後に繋ぐ。 */
+
+/* 内容はファイルサイズ分を一度に確保し、大きな read で順に読む */
+static int import_content(int dirfd, const char *name, struct File *f) {
+    int fd = openat(dirfd, name, O_RDONLY);
+    if (fd < 0) return -1;
+
+    char *buf = malloc(f->size);
+    size_t got = 0;
+    while (buf && got < f->size) {
+        ssize_t n = read(fd, buf + got, f->size - got);
+        if (n <= 0) break;
+        got += (size_t)n;
+    }
+    close(fd);
+    if (!buf) return -1;
+
+    f->hash = hash64(buf, got);
+    f->content = store_intern(buf, got, f->hash);
+    f->size = got;
+    return 0;
+}
+
+static void import_dir(struct TreeWalk *tw, struct WalkItem *it, struct WalkStats *st) {
+    int fd = open(it->path, O_RDONLY | O_DIRECTORY);
+    DIR *dp = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!dp) {
+        if (fd >= 0) close(fd);
+        st->skipped++;
+        return;
+    }
+
+    struct dirent *e;
+    while ((e = readdir(dp)) != NULL) {
+        const char *name = e->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+        if (strlen(name) >= NAME_LEN) {
+            st->skipped++;
+            continue;
+        }
+
+        /* ディレクトリも mode を写すので stat する */
+        struct stat sb;
+        if (fstatat(fd, name, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
+            st->skipped++;
+            continue;
+        }
+
+        if (S_ISDIR(sb.st_mode)) {
+            struct Dir *sub = create_dir(name, it->dir);
+            if (sub) sub->mode = sb.st_mode & 0777;
+            if (!sub || dir_add_subdir(it->dir, sub) < 0) {
+                dir_node_free(sub);
+                st->skipped++;
+                continue;
+            }
+            /* 積めなければ一覧から外してから捨てる（外せなければ空のまま残す）。
+             * 取り込み中の部分木はまだ誰も読まない */
+            if (walk_push(tw, sub, it->path, name) < 0) {
+                int n;
+                slots_get(&it->dir->subdirs, &n);
+                if (slots_remove(&it->dir->subdirs, n - 1) == 0) dir_node_free(sub);
+                st->skipped++;
+                continue;
+            }
+            st->dirs++;
+        } else if (S_ISREG(sb.st_mode)) {
+            struct File *f = file_new(name);
+            if (!f) {
+                st->skipped++;
+                continue;
+            }
+            f->mode = sb.st_mode & 0777;
+            f->atime = (uint64_t)sb.st_atime * 1000000000ull;
+            f->mtime = (uint64_t)sb.st_mtime * 1000000000ull;
+            f->ctime = (uint64_t)sb.st_ctime * 1000000000ull;
+            /* 内容を読まなければ空のファイルにする（大きさだけ持たせると内容のない File になる） */
+            if (tw->with_content && sb.st_size > 0) {
+                f->size = (size_t)sb.st_size;
+                if (import_content(fd, name, f) < 0) f->size = 0;
+            }
+            if (dir_add_file(it->dir, f) < 0) {
+                file_free(f);
+                st->skipped++;
+                continue;
+            }
+            st->files++;
+            st->bytes += f->size;
+        } else {
+            st->skipped++;
+        }
+    }
+    closedir(dp);
+}
+
+/* ===== ホストへの書き出し =====
+ * ディレクトリ出力は import と同じ作業キューで並列にファイルを作る。
+ * ディレクトリはそれを処理するワーカーが作ってから子を積むので、
+ * 親が先に存在することが保証される。内容は File から直接 write する。 */
+
+static int export_chunk(const char *p, size_t n, void *arg) {
+    return write_all(*(int *)arg, p, n);
+}
+
+static void export_dir(struct TreeWalk *tw, struct WalkItem *it, struct WalkStats *st) {
+    struct Dir *d = it->dir;
+    int fd = -1;
+
+    if ((mkdir(it->path, 0755) < 0 && errno != EEXIST) ||
+        (fd = open(it->path, O_RDONLY | O_DIRECTORY)) < 0 ||
+        dir_ready(d) < 0) {
+        if (fd >= 0) close(fd);
+        st->skipped++;
+        return;
+    }
+
+    int nfiles, nsubs;
+    struct Slots *fs = dir_list(d, 0, &nfiles);
+    struct Slots *ds = dir_list(d, 1, &nsubs);
+
+    /* 読めないファイルと降りられないディレクトリは飛ばす */
+    for (int i = 0; i < nfiles; i++) {
+        const struct File *f = slots_at(fs, i);
+        if (!(file_bits(f) & MAY_R)) {
+            st->skipped++;
+            continue;
+        }
+        if (f->symlink) {
+            /* 上書きできないので、先に同じ名前を消しておく */
+            char target[PATH_LEN];
+            unlinkat(fd, f->name, 0);
+            if (symlink_read(f, target) < 0 || symlinkat(target, fd, f->name) < 0) st->skipped++;
+            else st->files++;
+            continue;
+        }
+        int ffd = openat(fd, f->name, O_WRONLY | O_CREAT | O_TRUNC, (mode_t)f->mode);
+        if (ffd < 0 || file_each(f, export_chunk, &ffd) < 0) {
+            if (ffd >= 0) close(ffd);
+            st->skipped++;
+            continue;
+        }
+        uint64_t at = __atomic_load_n(&f->atime, __ATOMIC_RELAXED);
+        struct timespec ts[2] = {
+            { (time_t)(at / 1000000000ull), (long)(at % 1000000000ull) },
+            { (time_t)(f->mtime / 1000000000ull), (long)(f->mtime % 1000000000ull) },
+        };
+        futimens(ffd, ts);
+        close(ffd);
+        st->files++;
+        st->bytes += f->size;
+    }
+
+    for (int i = 0; i < nsubs; i++) {
+        struct Dir *sub = slots_at(ds, i);
+        if (!dir_readable(sub) || walk_push(tw, sub, it->path, sub->name) < 0) {
+            st->skipped++;
+            continue;
+        }
+        st->dirs++;
+    }
+
+    close(fd);
+}
+
+/* tar (ustar) ストリーム。ヘッダは固定プールに作り、内容は File の
+ * バッファを iovec で直接指して writev でまとめて書く（コピーなし）。
+ * 走査全体がエポックの区間内なので、指した内容は書き終えるまで解放されない */
+#define TAR_BLOCK  512
+#define TAR_BATCH  256          /* iovec は最大 3 倍。Linux / macOS の IOV_MAX 以内 */
+
+struct TarOut {
+    int fd;
+    int err;
+    int nhdr, niov;
+    char hdrs[TAR_BATCH][TAR_BLOCK];
+    struct iovec iov[TAR_BATCH * 3];
+    struct WalkStats st;
+};
+
+static void tar_flush(struct TarOut *t) {
+    TRACE_SPAN("output");
+    struct iovec *iov = t->iov;
+    int n = t->niov;
+
+    while (n > 0 && !t->err) {
+        ssize_t w = writev(t->fd, iov, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            t->err = 1;
+            break;
+        }
+        while (n > 0 && (size_t)w >= iov->iov_len) {
+            w -= (ssize_t)iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= (size_t)w;
+        }
+    }
+    t->nhdr = 0;
+    t->niov = 0;
+}
+
+static void tar_octal(char *dst, size_t len, unsigned long long v) {
+    dst[len - 1] = '\0';
+    for (size_t i = len - 1; i > 0; i--) {
+        dst[i - 1] = (char)('0' + (v & 7));
+        v >>= 3;
+    }
+}
+
+/* ヘッダに書く属性 */
+struct TarAttr {
+    int type;                   /* '0' ファイル、'2' シンボリックリンク、'5' ディレクトリ */
+    mode_t mode;
+    uint32_t uid, gid;
+    uint64_t mtime;
+    const char *link;           /* '2' のリンク先（100 バイトまで） */
+};
+
+/* 100 バイトを超えるパスは prefix と name に分ける */
+static int tar_header(char *h, const char *path, const struct TarAttr *a, size_t size) {
+    size_t len = strlen(path);
+    const char *name = path;
+
+    memset(h, 0, TAR_BLOCK);
+    if (len > 100) {
+        const char *cut = path + len - 101;
+        while (*cut && *cut != '/') cut++;
+        if (!*cut || (size_t)(cut - path) > 155) return -1;
+        memcpy(h + 345, path, (size_t)(cut - path));
+        name = cut + 1;
+    }
+    memcpy(h, name, strlen(name));
+    if (a->link) {
+        if (strlen(a->link) > 100) return -1;
+        memcpy(h + 157, a->link, strlen(a->link));
+    }
+
+    tar_octal(h + 100, 8, a->mode);
+    tar_octal(h + 108, 8, a->uid);
+    tar_octal(h + 116, 8, a->gid);
+    tar_octal(h + 124, 12, size);
+    tar_octal(h + 136, 12, (unsigned long long)(a->mtime / 1000000000ull));
+    h[156] = (char)a->type;
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+
+    unsigned sum = 0;
+    memset(h + 148, ' ', 8);
+    for (int i = 0; i < TAR_BLOCK; i++) {
+        sum += (unsigned char)h[i];
+    }
+    snprintf(h + 148, 8, "%06o", sum);
+    return 0;
+}
+
+static void tar_entry(struct TarOut *t, const char *path, const struct TarAttr *a,
+                      const char *data, size_t size) {
+    static const char zero[TAR_BLOCK];
+
+    if (t->nhdr == TAR_BATCH) tar_flush(t);
+
+    char *h = t->hdrs[t->nhdr];
+    if (tar_header(h, path, a, size) < 0) {
+        t->st.skipped++;
+        return;
+    }
+    t->nhdr++;
+
+    t->iov[t->niov++] = (struct iovec){ h, TAR_BLOCK };
+    if (size > 0) {
+        t->iov[t->niov++] = (struct iovec){ (void *)data, size };
+        if (size % TAR_BLOCK) {
+            t->iov[t->niov++] = (struct iovec){ (void *)zero, TAR_BLOCK - size % TAR_BLOCK };
+        }
+    }
+}
+
+static void tar_walk(struct TarOut *t, struct Dir *d, char *path, size_t len) {
+    if (dir_ready(d) < 0) {
+        t->st.skipped++;
+        return;
+    }
+
+    int nfiles, nsubs;
+    struct Slots *fs = dir_list(d, 0, &nfiles);
+    struct Slots *ds = dir_list(d, 1, &nsubs);
+
+    for (int i = 0; i < nfiles; i++) {
+        const struct File *f = slots_at(fs, i);
+        int n = snprintf(path + len, PATH_LEN - len, "%s%s", len ? "/" : "", f->name);
+        if (n < 0 || (size_t)n >= PATH_LEN - len || !(file_bits(f) & MAY_R)) {
+            t->st.skipped++;
+            continue;
+        }
+        /* シンボリックリンクは内容を書かず、リンク先をヘッダに入れる */
+        if (f->symlink) {
+            char target[PATH_LEN];
+            struct TarAttr a = { '2', (mode_t)f->mode, f->uid, f->gid, f->mtime, target };
+            if (symlink_read(f, target) < 0) {
+                t->st.skipped++;
+                continue;
+            }
+            tar_entry(t, path, &a, NULL, 0);
+            t->st.files++;
+            continue;
+        }
+
+        /* 縮めてあれば展開した領域を指すので、書き終えてから解放する */
+        const char *data;
+        char *tmp;
+        if (file_data(f, &data, &tmp) < 0) {
+            t->st.skipped++;
+            continue;
+        }
+        struct TarAttr a = { '0', (mode_t)f->mode, f->uid, f->gid, f->mtime, NULL };
+        tar_entry(t, path, &a, data, f->size);
+        if (tmp) {
+            tar_flush(t);
+            free(tmp);
+        }
+        t->st.files++;
+        t->st.bytes += f->size;
+    }
+
+    for (int i = 0; i < nsubs; i++) {
+        struct Dir *sub = slots_at(ds, i);
+        int n = snprintf(path + len, PATH_LEN - len, "%s%s", len ? "/" : "", sub->name);
+        if (n < 0 || (size_t)n + 1 >= PATH_LEN - len || !dir_readable(sub)) {
+            t->st.skipped++;
+            continue;
+        }
+        strcat(path, "/");
+        struct TarAttr a = {
+            '5', (mode_t)__atomic_load_n(&sub->mode, __ATOMIC_RELAXED),
+            __atomic_load_n(&sub->uid, __ATOMIC_RELAXED), __atomic_load_n(&sub->gid, __ATOMIC_RELAXED),
+            clock_ns(), NULL,
+        };
+        tar_entry(t, path, &a, NULL, 0);
+        path[len + (size_t)n] = '\0';
+        t->st.dirs++;
+        tar_walk(t, sub, path, len + (size_t)n);
+    }
+    path[len] = '\0';
+}
+
+static int export_tar(struct Dir *d, int fd, struct WalkStats *st) {
+    static const char zero[TAR_BLOCK * 2];
+
+    struct TarOut *t = calloc(1, sizeof(*t));
+    if (!t) return -1;
+    t->fd = fd;
+
+    char path[PATH_LEN] = "";
+    tar_walk(t, d, path, 0);
+    t->iov[t->niov++] = (struct iovec){ (void *)zero, sizeof(zero) };
+    tar_flush(t);
+
+    int rc = t->err ? -1 : 0;
+    *st = t->st;
+    free(t);
+    return rc;
+}
+
+/* ===== シャード =====
+ * -S N を付けたサーバーモードでは、ルート直下の各ディレクトリの部分木を
+ * N 個のシャード（CPU に固定したワーカースレッド）に割り当て、その部分木への
+ * 変更は持ち主のシャードだけが行う。ルート自身はシャード 0 が持つ。
+ * コマンドは受付スレッドが対象の親ディレクトリから持ち主を決めて渡し、
+ * キューはすべて単一生産者・単一消費者 (SPSC) のリングで、ロックを使わない。
+ * 読み取りは持ち主に関係なく、どのシャードからもロックなしで行える。
+ *
+ * 持ち主の異なるディレクトリ間の mv は二相で行う。移動元のシャードが
+ * 移動先のシャードへ準備を頼み、移動先は名前を確かめて追加し投票を返す。
+ * 賛成なら移動元が自分の一覧から外して確定する（推定コミット）。
+ * 外せなかったときだけ取り消しを送る。 */
+#define SHARD_MAX  64
+#define QUEUE_LEN  1024         /* 2 のべき乗 */
+
+/* head と tail は別のキャッシュラインに置き、生産側と消費側で取り合わない */
+struct Spsc {
+    _Alignas(64) uint64_t head;     /* 消費側だけが進める */
+    _Alignas(64) uint64_t tail;     /* 生産側だけが進める */
+    void *slot[QUEUE_LEN];
+};
+
+static int spsc_push(struct Spsc *q, void *p) {
+    uint64_t t = q->tail;
+    if (t - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == QUEUE_LEN) return -1;
+
+    q->slot[t % QUEUE_LEN] = p;
+    /* 眠る前の確認 (spsc_empty) と順序を揃えるため seq_cst */
+    __atomic_store_n(&q->tail, t + 1, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+static void *spsc_pop(struct Spsc *q) {
+    uint64_t h = q->head;
+    if (h == __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE)) return NULL;
+
+    void *p = q->slot[h % QUEUE_LEN];
+    __atomic_store_n(&q->head, h + 1, __ATOMIC_RELEASE);
+    return p;
+}
+
+static int spsc_empty(struct Spsc *q) {
+    return __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) ==
+           __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST);
+}
+
+struct Shard {
+    struct Spsc in;             /* 受付スレッドからのコマンド */
+    struct Spsc done;           /* 受付スレッドへの完了通知 */
+    struct Spsc *mesh;          /* mesh[j] はシャード j からの依頼 */
+    int id;
+    int wake[2];                /* 眠っているシャードを起こすパイプ */
+    int sleeping;
+    pthread_t tid;
+};
+
+static struct {
+    int n;                      /* 0 ならシャードなし */
+    struct Shard *sh;
+    int wake[2];                /* 受付スレッドを起こすパイプ */
+    int sleeping;               /* 受付スレッドが poll で眠っている */
+    int stop;
+} shards;
+
+static _Thread_local struct Shard *self_shard;
+
+enum {
+    MSG_PREPARE = 1,
+    MSG_ABORT,
+};
+
+struct ShardMsg {
+    int kind;
+    int from;
+    struct Dir *sd, *dd;
+    char sname[NAME_LEN], dname[NAME_LEN];
+    struct File *f;             /* 移動先へ載せる複製 */
+    struct Txn *txn;            /* 依頼元のトランザクション */
+    int rc;                     /* 投票結果 (FS_*) */
+    int done;
+};
+
+/* 持ち主はルート直下の祖先の名前から決める。ディレクトリは移動しないので変わらない */
+static int dir_shard(const struct Dir *d) {
+    if (!d->parent) return 0;
+    while (d->parent->parent) d = d->parent;
+    return (int)(fnv1a(d->name, strlen(d->name)) % (uint32_t)shards.n);
+}
+
+static void wake_fd(int fd) {
+    char c = 0;
+    if (write(fd, &c, 1) < 0) {
+        /* パイプが満杯なら相手はもう起きる */
+    }
+}
+
+static void shard_wake(struct Shard *sh) {
+    if (__atomic_load_n(&sh->sleeping, __ATOMIC_SEQ_CST)) wake_fd(sh->wake[1]);
+}
+
+/* 眠ると宣言してからキューを見直し、空のときだけパイプで待つ */
+static void shard_sleep(struct Shard *sh, int with_in) {
+    __atomic_store_n(&sh->sleeping, 1, __ATOMIC_SEQ_CST);
+
+    int idle = !(with_in && !spsc_empty(&sh->in)) && !__atomic_load_n(&shards.stop, __ATOMIC_SEQ_CST);
+    for (int j = 0; idle && j < shards.n; j++) {
+        if (!spsc_empty(&sh->mesh[j])) idle = 0;
+    }
+    if (idle) {
+        char buf[64];
+        if (read(sh->wake[0], buf, sizeof(buf)) < 0 && errno != EINTR) perror("shard");
+    }
+    __atomic_store_n(&sh->sleeping, 0, __ATOMIC_SEQ_CST);
+}
+
+/* 依頼元のトランザクションの一部として処理する（印もジャーナルもそちらに付く） */
+static void shard_handle(struct ShardMsg *m) {
+    struct Txn *saved = txn;
+    txn = m->txn;
+
+    if (m->kind == MSG_ABORT) {
+        if (dir_lock(m->dd) == 0) {
+            int n;
+            struct Slots *fs = slots_get(&m->dd->files, &n);
+            for (int i = 0; i < n; i++) {
+                if (slots_at(fs, i) == m->f && dir_freeze(m->dd) == 0 &&
+                    slots_remove(&m->dd->files, i) == 0) {
+                    usage_add(m->dd, -(int64_t)m->f->size, -1, 0, -file_key(m->f));
+                    journal_log(OP_MV, m->dd, m->dname, m->sd, m->sname);
+                    file_retire(m->f, file_node_free);
+                    break;
+                }
+            }
+            dir_unlock(m->dd);
+        }
+        free(m);
+        txn = saved;
+        return;
+    }
+
+    /* 準備: 名前が空いていれば載せて賛成を返す。記録もここで行い、
+     * 移動先のその後の操作より前にジャーナルへ並ぶようにする */
+    int rc = dir_lock(m->dd) < 0 ? FS_NOMEM : FS_OK;
+    if (rc == FS_OK) {
+        rc = txn_claim(m->dd);
+        if (rc == FS_OK && name_taken(m->dd, m->dname)) {
+            rc = FS_EXIST;
+        } else if (rc == FS_OK && (dir_freeze(m->dd) < 0 || dir_add_file(m->dd, m->f) < 0)) {
+            rc = FS_NOMEM;
+        } else if (rc == FS_OK) {
+            usage_add(m->dd, (int64_t)m->f->size, 1, 0, file_key(m->f));
+            journal_log(OP_MV, m->sd, m->sname, m->dd, m->dname);
+        }
+        dir_unlock(m->dd);
+    }
+
+    /* done を立てた時点で依頼元は m を解放しうる */
+    struct Shard *from = &shards.sh[m->from];
+    m->rc = rc;
+    __atomic_store_n(&m->done, 1, __ATOMIC_RELEASE);
+    shard_wake(from);
+    txn = saved;
+}
+
+/* 他のシャードからの依頼をすべて処理し、処理したかを返す */
+static int shard_poll_mesh(struct Shard *sh) {
+    int did = 0;
+    for (int j = 0; j < shards.n; j++) {
+        struct ShardMsg *m;
+        while ((m = spsc_pop(&sh->mesh[j])) != NULL) {
+            shard_handle(m);
+            did = 1;
+        }
+    }
+    return did;
+}
+
+/* 相手のキューが満杯の間も自分宛ての依頼は処理し、待ち合いで止まらない */
+static void shard_send(int to, struct ShardMsg *m) {
+    struct Shard *dst = &shards.sh[to];
+    while (spsc_push(&dst->mesh[self_shard->id], m) < 0) {
+        shard_poll_mesh(self_shard);
+        sched_yield();
+    }
+    shard_wake(dst);
+}
+
+/* 移動元のシャードで呼ぶ。sd は自分の持ち物なので、待つ間も他から変更されない */
+static int shard_mv(struct Dir *sd, const char *src, struct Dir *dd, const char *dst) {
+    struct Shard *sh = self_shard;
+
+    if (dir_lock(sd) < 0) return FS_NOMEM;
+    int rc = txn_claim(sd);
+    int idx = find_file_index(sd, src);
+    struct File *old = idx >= 0 ? slots_at(sd->files, idx) : NULL;
+    dir_unlock(sd);
+    if (rc != FS_OK) return rc;
+    if (!old) return FS_NOENT;
+    if (old->ino) return FS_XDEV;   /* 名前の一覧は 1 つのシャードの中だけで持つ */
+
+    /* 取り消しにも同じ依頼を使うので、確保の失敗は最初に済ませる */
+    struct File *f = file_alloc(dst);
+    struct ShardMsg *m = calloc(1, sizeof(*m));
+    if (!f || !m) {
+        file_node_free(f);
+        free(m);
+        return FS_NOMEM;
+    }
+    file_copy(f, old);
+    memset(f->name, 0, NAME_LEN);
+    strcpy(f->name, dst);       /* dst は NAME_LEN に収まった名前 */
+
+    m->kind = MSG_PREPARE;
+    m->from = sh->id;
+    m->sd = sd;
+    m->dd = dd;
+    strcpy(m->sname, old->name);
+    strcpy(m->dname, f->name);
+    m->f = f;
+    m->txn = txn;
+
+    /* 投票を待つ間も自分宛ての依頼は受け付ける（互いに待ち合っても止まらない） */
+    shard_send(dir_shard(dd), m);
+    while (!__atomic_load_n(&m->done, __ATOMIC_ACQUIRE)) {
+        if (!shard_poll_mesh(sh)) shard_sleep(sh, 0);
+    }
+    if (m->rc != FS_OK) {
+        int vote = m->rc;
+        file_node_free(f);
+        free(m);
+        return vote;
+    }
+
+    /* 確定: 移動元から外す。ここで失敗したら移動先へ取り消しを送る */
+    rc = dir_lock(sd) < 0 ? FS_NOMEM : FS_OK;
+    if (rc == FS_OK) {
+        idx = find_file_index(sd, src);
+        if (dir_freeze(sd) < 0 || slots_remove(&sd->files, idx) < 0) rc = FS_NOMEM;
+        dir_unlock(sd);
+    }
+    if (rc != FS_OK) {
+        m->kind = MSG_ABORT;
+        shard_send(dir_shard(dd), m);
+        return rc;
+    }
+
+    usage_add(sd, -(int64_t)f->size, -1, 0, -file_key(old));
+    file_retire(old, file_node_free);
+    free(m);
+    return FS_OK;
+}
+
+/* ===== コマンド実装 ===== */
+
+/* スナップショットの中では "@名前" を前に付ける */
+static void pwd_cmd(const struct Session *s) {
+    struct Dir *cwd = s->cwd;
+    if (s->snap) fprintf(out, "@%s", s->snap->name);
+    if (cwd->parent == NULL) {
+        fputs("/\n", out);
+        return;
+    }
+
+    const char *parts[64];
+    int depth = 0;
+
+    while (cwd) {
+        parts[depth++] = cwd->name;
+        cwd = cwd->parent;
+    }
+
+    for (int i = depth - 1; i >= 0; i--) {
+        if (i == 0 && strcmp(parts[i], "/") == 0) {
+            fprintf(out, "/");
+        } else {
+            fprintf(out, "%s", parts[i]);
+            if (i > 0) fprintf(out, "/");
+        }
+    }
+    fputc('\n', out);
+}
+
+/* ls -t の順（新しい順、同じ時刻なら名前順） */
+static int ls_mtime_cmp(const void *a, const void *b) {
+    const struct File *x = *(const struct File *const *)a, *y = *(const struct File *const *)b;
+    if (x->mtime != y->mtime) return x->mtime < y->mtime ? 1 : -1;
+    return strcmp(x->name, y->name);
+}
+
+static void ls_cmd(struct Session *s, const char *a, const char *b) {
+    const char *opt = a && a[0] == '-' ? a : b && b[0] == '-' ? b : NULL;
+    const char *path = a && a[0] != '-' ? a : b && b[0] != '-' ? b : NULL;
+    int longfmt = opt && strchr(opt, 'l');
+    int bytime = opt && strchr(opt, 't');
+
+    struct Dir *d = path ? resolve_dir(s, path) : s->cwd;
+    if (!d) {
+        fputs(path_msg("no such directory\n"), out);
+        return;
+    }
+    if (!(dir_bits(d) & MAY_R)) {
+        fputs("permission denied\n", out);
+        return;
+    }
+    if (dir_ready(d) < 0) {
+        fputs("memory error\n", out);
+        return;
+    }
+
+    int nfiles, nsubs;
+    struct Slots *fs = dir_list(d, 0, &nfiles);
+    struct Slots *ds = dir_list(d, 1, &nsubs);
+
+    for (int i = 0; i < nsubs; i++) {
+        const struct Dir *sub = slots_at(ds, i);
+        char m[11];
+        if (longfmt) {
+            mode_str(m, 'd', __atomic_load_n(&sub->mode, __ATOMIC_RELAXED));
+            fprintf(out, "%s  - %4u %4u ---- %s/\n", m, __atomic_load_n(&sub->uid, __ATOMIC_RELAXED),
+                    __atomic_load_n(&sub->gid, __ATOMIC_RELAXED), sub->name);
+        } else {
+            fprintf(out, "%s/\n", sub->name);
+        }
+    }
+
+    /* ファイルは -t なら変更時刻の新しい順に並べ替える（一覧は公開中のものを写して使う） */
+    const struct File **order = NULL;
+    if (bytime && nfiles > 0) {
+        if (!(order = malloc((size_t)nfiles * sizeof(*order)))) {
+            fputs("memory error\n", out);
+            return;
+        }
+        for (int i = 0; i < nfiles; i++) order[i] = slots_at(fs, i);
+        qsort(order, (size_t)nfiles, sizeof(*order), ls_mtime_cmp);
+    }
+
+    for (int i = 0; i < nfiles; i++) {
+        const struct File *f = order ? order[i] : slots_at(fs, i);
+        char target[PATH_LEN], m[11];
+        if (longfmt) mode_str(m, f->symlink ? 'l' : '-', f->mode);
+        if (f->symlink && longfmt) {
+            if (symlink_read(f, target) < 0) strcpy(target, "?");
+            fprintf(out, "%s %2ld %4u %4u %4zu %s -> %s\n", m, file_nlink(f), f->uid, f->gid, f->size,
+                    f->name, target);
+        } else if (longfmt) {
+            fprintf(out, "%s %2ld %4u %4u %4zu %s\n", m, file_nlink(f), f->uid, f->gid, f->size, f->name);
+        } else {
+            fprintf(out, f->symlink ? "%s@\n" : "%s\n", f->name);
+        }
+    }
+    free(order);
+}
+
+static void touch_cmd(struct Session *s, const char *path) {
+    if (!path) {
+        fputs("usage: touch <name>\n", out);
+        return;
+    }
+
+    char name[NAME_LEN];
+    struct Dir *d = resolve_parent(s, path, name);
+    if (!d) {
+        txn_fail();
+        fputs(path_msg("no such directory\n"), out);
+        return;
+    }
+    if (dir_lock(d) < 0) {
+        txn_fail();
+        fputs("memory error\n", out);
+        return;
+    }
+
+    int rc = dir_bits(d) & MAY_W ? txn_claim(d) : FS_ACCES;
+    if (rc == FS_OK) rc = fs_touch(d, name);
+    if (rc == FS_OK) journal_log(OP_TOUCH, d, name, NULL, NULL);
+    dir_unlock(d);
+
+    if (rc == FS_OK) txn_record(UNDO_TOUCH, d, name, NULL, NULL, NULL);
+    else txn_fail();
+    switch (rc) {
+    case FS_OK:    fprintf(out, "file '%s' created\n", path); break;
+    case FS_EXIST: fputs("name already exists\n", out); break;
+    case FS_BUSY:  fputs("directory is locked by a transaction\n", out); break;
+    case FS_RDONLY: fputs("snapshot is read-only\n", out); break;
+    case FS_ACCES: fputs("permission denied\n", out); break;
+    default:       fputs("memory error\n", out); break;
+    }
+}
+
+static void rm_cmd(struct Session *s, const char *path) {
+    if (!path) {
+        fputs("usage: rm <name>\n", out);
+        return;
+    }
+
+    char name[NAME_LEN];
+    struct Dir *d = resolve_parent(s, path, name);
+    if (!d || dir_lock(d) < 0) {
+        txn_fail();
+        fputs(path_msg("no such file\n"), out);
+        return;
+    }
+
+    /* トランザクション中は外した File を取っておき、rollback で戻す */
+    struct File *keep = NULL;
+    int rc = dir_bits(d) & MAY_W ? txn_claim(d) : FS_ACCES;
+    if (rc == FS_OK) rc = fs_rm(d, name, txn ? &keep : NULL);
+    if (rc == FS_OK) journal_log(OP_RM, d, name, NULL, NULL);
+    dir_unlock(d);
+
+    if (rc != FS_OK) {
+        txn_fail();
+        fputs(rc == FS_BUSY ? "directory is locked by a transaction\n" :
+              rc == FS_RDONLY ? "snapshot is read-only\n" :
+              rc == FS_ACCES ? "permission denied\n" : "no such file\n", out);
+        return;
+    }
+    txn_record(UNDO_RM, d, name, NULL, NULL, keep);
+    fprintf(out, "file '%s' removed\n", path);
+}
+
+/* 移動先が既存のディレクトリならその中へ同じ名前で移す。
+ * 2 つのディレクトリはアドレス順にロックするのでデッドロックしない。
+ * シャードの上で持ち主が異なるときは二相の手続きに任せる
+ * （パイプラインの段など、シャード以外のスレッドはロックだけで移す） */
+static void mv_cmd(struct Session *s, const char *src, const char *dst) {
+    if (!src || !dst) {
+        fputs("usage: mv <old> <new>\n", out);
+        return;
+    }
+
+    char sname[NAME_LEN], dname[NAME_LEN];
+    struct Dir *sd = resolve_parent(s, src, sname);
+    if (!sd) {
+        txn_fail();
+        fputs(path_msg("source not found\n"), out);
+        return;
+    }
+
+    struct Dir *dd = resolve_dir(s, dst);
+    if (dd) {
+        strcpy(dname, sname);
+    } else if (!(dd = resolve_parent(s, dst, dname))) {
+        txn_fail();
+        fputs(path_msg("no such directory\n"), out);
+        return;
+    }
+
+    int rc;
+    if (!(dir_bits(sd) & dir_bits(dd) & MAY_W)) {
+        rc = FS_ACCES;
+    } else if (self_shard && dir_shard(sd) != dir_shard(dd)) {
+        rc = shard_mv(sd, sname, dd, dname);
+    } else if (dir_lock2(sd, dd) < 0) {
+        rc = FS_NOMEM;
+    } else {
+        rc = txn_claim(sd);
+        if (rc == FS_OK) rc = txn_claim(dd);
+        if (rc == FS_OK) rc = fs_mv(sd, sname, dd, dname);
+        if (rc == FS_OK) journal_log(OP_MV, sd, sname, dd, dname);
+        dir_unlock2(sd, dd);
+    }
+
+    if (rc == FS_OK) txn_record(UNDO_MV, sd, sname, dd, dname, NULL);
+    else txn_fail();
+    switch (rc) {
+    case FS_OK:    fprintf(out, "renamed '%s' -> '%s'\n", src, dst); break;
+    case FS_NOENT: fputs("source not found\n", out); break;
+    case FS_EXIST: fputs("destination already exists\n", out); break;
+    case FS_BUSY:  fputs("directory is locked by a transaction\n", out); break;
+    case FS_RDONLY: fputs("snapshot is read-only\n", out); break;
+    case FS_XDEV:  fputs("cannot move a hard-linked file across shards\n", out); break;
+    case FS_ACCES: fputs("permission denied\n", out); break;
+    default:       fputs("memory error\n", out); break;
+    }
+}
+
+/* ln -s: リンク先はそのまま内容として持つ。dst が既存のディレクトリなら
+ * その中にリンク先の最後の名前で作る */
+static void symlink_cmd(struct Session *s, const char *target, const char *dst) {
+    if (!target || !dst) {
+        fputs("usage: ln -s <target> <name>\n", out);
+        return;
+    }
+    if (target[0] == '\0' || target[0] == '@' || strlen(target) >= PATH_LEN) {
+        fputs("invalid link target\n", out);
+        return;
+    }
+
+    char name[NAME_LEN];
+    struct Dir *d = resolve_dir(s, dst);
+    if (d) {
+        const char *leaf = strrchr(target, '/');
+        leaf = leaf ? leaf + 1 : target;
+        if (*leaf == '\0' || strlen(leaf) >= NAME_LEN) {
+            fputs("invalid link target\n", out);
+            return;
+        }
+        strcpy(name, leaf);
+    } else if (!(d = resolve_parent(s, dst, name))) {
+        txn_fail();
+        fputs(path_msg("no such directory\n"), out);
+        return;
+    }
+
+    if (dir_lock(d) < 0) {
+        txn_fail();
+        fputs("memory error\n", out);
+        return;
+    }
+    int rc = dir_bits(d) & MAY_W ? txn_claim(d) : FS_ACCES;
+    if (rc == FS_OK) rc = fs_symlink(d, name, target);
+    if (rc == FS_OK) journal_log(OP_SYMLINK, d, name, NULL, target);
+    dir_unlock(d);
+
+    if (rc == FS_OK) txn_record(UNDO_TOUCH, d, name, NULL, NULL, NULL);
+    else txn_fail();
+    switch (rc) {
+    case FS_OK:    fprintf(out, "linked '%s' -> '%s'\n", dst, target); break;
+    case FS_EXIST: fputs("name already exists\n", out); break;
+    case FS_BUSY:  fputs("directory is locked by a transaction\n", out); break;
+    case FS_RDONLY: fputs("snapshot is read-only\n", out); break;
+    case FS_ACCES: fputs("permission denied\n", out); break;
+    default:       fputs("memory error\n", out); break;
+    }
+}
+
+/* リンクそのものの内容（リンク先のパス）を出す。辿らない */
+static void readlink_cmd(struct Session *s, const char *path) {
+    if (!path) {
+        fputs("usage: readlink <name>\n", out);
+        return;
+    }
+
+    char name[NAME_LEN], target[PATH_LEN];
+    struct Dir *d = resolve_parent(s, path, name);
+    const struct File *f = d && dir_ready(d) == 0 ? find_file(d, name) : NULL;
+    if (!f) {
+        fputs(path_msg("no such file\n"), out);
+    } else if (!f->symlink) {
+        fputs("not a symbolic link\n", out);
+    } else if (symlink_read(f, target) < 0) {
+        fputs("memory error\n", out);
+    } else {
+        fprintf(out, "%s\n", target);
+    }
+}
+
+/* 時刻を "2026-01-02 03:04:05.123456789 +0900" の形で出す */
+static void stat_time(const char *label, uint64_t ns) {
+    time_t t = (time_t)(ns / 1000000000ull);
+    struct tm tm;
+    char date[32], zone[8];
+    localtime_r(&t, &tm);
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+    strftime(zone, sizeof(zone), "%z", &tm);
+    fprintf(out, "%s: %s.%09llu %s\n", label, date, (unsigned long long)(ns % 1000000000ull), zone);
+}
+
+/* リンクは辿らずにそのものを出す。ディレクトリは時刻を持たない */
+static void stat_cmd(struct Session *s, const char *path) {
+    if (!path) {
+        fputs("usage: stat <name>\n", out);
+        return;
+    }
+
+    char name[NAME_LEN], m[11];
+    struct Dir *d = resolve_parent(s, path, name);
+    const struct File *f = d && dir_ready(d) == 0 ? find_file(d, name) : NULL;
+    if (!f) {
+        if (!(d = resolve_dir(s, path))) {
+            fputs(path_msg("no such file\n"), out);
+            return;
+        }
+        uint32_t mode = __atomic_load_n(&d->mode, __ATOMIC_RELAXED);
+        mode_str(m, 'd', mode);
+        fprintf(out, "  File: %s/\n", d->parent ? d->name : "");
+        fprintf(out, "  Mode: (%04o/%s)  Uid: %u  Gid: %u\n", mode, m,
+                __atomic_load_n(&d->uid, __ATOMIC_RELAXED),
+                __atomic_load_n(&d->gid, __ATOMIC_RELAXED));
+        return;
+    }
+
+    char target[PATH_LEN];
+    if (f->symlink && symlink_read(f, target) < 0) strcpy(target, "?");
+    mode_str(m, f->symlink ? 'l' : '-', f->mode);
+    if (f->symlink) fprintf(out, "  File: %s -> %s\n", f->name, target);
+    else fprintf(out, "  File: %s\n", f->name);
+    fprintf(out, "  Size: %-10zu Links: %ld\n", f->size, file_nlink(f));
+    fprintf(out, "  Mode: (%04o/%s)  Uid: %u  Gid: %u\n", f->mode, m, f->uid, f->gid);
+    stat_time("Access", __atomic_load_n(&f->atime, __ATOMIC_RELAXED));
+    stat_time("Modify", f->mtime);
+    stat_time("Change", f->ctime);
+}
+
+/* 読み込みで atime をどう書くか。全体の設定 */
+static void atime_cmd(const char *opt) {
+    static const char *names[] = { "relatime", "strict", "noatime" };
+    if (!opt) {
+        fprintf(out, "atime: %s\n", names[__atomic_load_n(&atime_mode, __ATOMIC_RELAXED)]);
+        return;
+    }
+    for (int i = 0; i < 3; i++) {
+        if (strcmp(opt, names[i]) == 0) {
+            __atomic_store_n(&atime_mode, i, __ATOMIC_RELAXED);
+            fprintf(out, "atime: %s\n", names[i]);
+            return;
+        }
+    }
+    fputs("usage: atime [relatime|strict|noatime]\n", out);
+}
+
+/* 移動先の決め方は mv と同じ。リンクの一覧はシャードをまたいで持たない */
+static void ln_cmd(struct Session *s, const char *src, const char *dst) {
+    if (!src || !dst) {
+        fputs("usage: ln <src> <dst>\n", out);
+        return;
+    }
+
+    char sname[NAME_LEN], dname[NAME_LEN];
+    struct Dir *sd = resolve_parent(s, src, sname);
+    if (!sd) {
+        txn_fail();
+        fputs(path_msg("source not found\n"), out);
+        return;
+    }
+
+    struct Dir *dd = resolve_dir(s, dst);
+    if (dd) {
+        strcpy(dname, sname);
+    } else if (!(dd = resolve_parent(s, dst, dname))) {
+        txn_fail();
+        fputs(path_msg("no such directory\n"), out);
+        return;
+    }
+
+    int rc;
+    if (!(dir_bits(dd) & MAY_W)) {
+        rc = FS_ACCES;
+    } else if (self_shard && dir_shard(sd) != dir_shard(dd)) {
+        rc = FS_XDEV;
+    } else if (dir_lock2(sd, dd) < 0) {
+        rc = FS_NOMEM;
+    } else {
+        rc = txn_claim(sd);
+        if (rc == FS_OK) rc = txn_claim(dd);
+        if (rc == FS_OK) rc = fs_ln(sd, sname, dd, dname);
+        if (rc == FS_OK) journal_log(OP_LN, sd, sname, dd, dname);
+        dir_unlock2(sd, dd);
+    }
+
+    if (rc == FS_OK) txn_record(UNDO_TOUCH, dd, dname, NULL, NULL, NULL);
+    else txn_fail();
+    switch (rc) {
+    case FS_OK:    fprintf(out, "linked '%s' -> '%s'\n", dst, src); break;
+    case FS_NOENT: fputs("no such file\n", out); break;
+    case FS_EXIST: fputs("name already exists\n", out); break;
+    case FS_BUSY:  fputs("directory is locked by a transaction\n", out); break;
+    case FS_RDONLY: fputs("snapshot is read-only\n", out); break;
+    case FS_XDEV:  fputs("cannot link across shards\n", out); break;
+    case FS_ACCES: fputs("permission denied\n", out); break;
+    default:       fputs("memory error\n", out); break;
+    }
+}
+
+static void mkdir_cmd(struct Session *s, const char *path) {
+    if (!path) {
+        fputs("usage: mkdir <name>\n", out);
+        return;
+    }
+
+    char name[NAME_LEN];
+    struct Dir *d = resolve_parent(s, path, name);
+    if (!d) {
+        txn_fail();
+        fputs(path_msg("no such directory\n"), out);
+        return;
+    }
+    if (dir_lock(d) < 0) {
+        txn_fail();
+        fputs("memory error\n", out);
+        return;
+    }
+
+    struct Dir *sub = NULL;
+    int rc = dir_bits(d) & MAY_W ? txn_claim(d) : FS_ACCES;
+    if (rc == FS_OK) rc = mkdir_prepare(d, name, &sub);
+    if (rc == FS_OK) {
+        journal_log(OP_MKDIR, d, name, NULL, NULL);
+        mkdir_publish(d, sub);
+    }
+    dir_unlock(d);
+
+    if (rc == FS_OK) txn_record(UNDO_MKDIR, d, name, NULL, NULL, sub);
+    else txn_fail();
+    switch (rc) {
+    case FS_OK:    fprintf(out, "directory '%s' created\n", path); break;
+    case FS_EXIST: fputs("name already exists\n", out); break;
+    case FS_BUSY:  fputs("directory is locked by a transaction\n", out); break;
+    case FS_RDONLY: fputs("snapshot is read-only\n", out); break;
+    case FS_ACCES: fputs("permission denied\n", out); break;
+    default:       fputs("memory error\n", out); break;
+    }
+}
+
+/* chmod/chown の本体。パスがディレクトリならその属性を、ファイルなら File を替える
+ * （シンボリックリンクはリンク先）。負の値は今のまま。持ち主は uid 0 しか替えられない */
+static void attr_change(struct Session *s, const char *path, long mode, long uid, long gid) {
+    char name[NAME_LEN] = "";
+    struct Dir *d = resolve_dir(s, path);
+    if (!d && !(d = resolve_file(s, path, name))) {
+        txn_fail();
+        fputs(path_msg("no such file\n"), out);
+        return;
+    }
+    if (dir_lock(d) < 0) {
+        txn_fail();
+        fputs("memory error\n", out);
+        return;
+    }
+
+    struct Attr old = { d->mode, d->uid, d->gid };
+    const struct File *f = name[0] ? find_file(d, name) : NULL;
+    if (f) old = (struct Attr){ f->mode, f->uid, f->gid };
+    uint32_t m = mode < 0 ? old.mode : (uint32_t)mode;
+    uint32_t u = uid < 0 ? old.uid : (uint32_t)uid;
+    uint32_t g = gid < 0 ? old.gid : (uint32_t)gid;
+
+    int rc;
+    if (name[0] && !f) {
+        rc = FS_NOENT;
+    } else if (cred.uid != 0 && (cred.uid != old.uid || u != old.uid || g != old.gid)) {
+        rc = FS_PERM;
+    } else {
+        rc = txn_claim(d);
+    }
+
+    /* ファイルは書き込みと同じく元の File を、ディレクトリは元の値を取っておく */
+    struct File *keep = NULL;
+    struct Attr *was = NULL;
+    if (rc == FS_OK && txn && !name[0] && !(was = malloc(sizeof(*was)))) rc = FS_NOMEM;
+    if (rc == FS_OK) rc = fs_attr(d, name, m, u, g, txn ? &keep : NULL);
+    if (rc == FS_OK) {
+        char arg[64];
+        snprintf(arg, sizeof(arg), "%o %u %u", m, u, g);
+        journal_log(OP_ATTR, d, name, NULL, arg);
+    }
+    dir_unlock(d);
+
+    if (rc != FS_OK) {
+        free(was);
+        txn_fail();
+        fputs(rc == FS_NOENT ? path_msg("no such file\n") :
+              rc == FS_PERM ? "operation not permitted\n" :
+              rc == FS_BUSY ? "directory is locked by a transaction\n" :
+              rc == FS_RDONLY ? "snapshot is read-only\n" : "memory error\n", out);
+        return;
+    }
+    if (was) {
+        *was = old;
+        txn_record(UNDO_ATTR, d, name, NULL, NULL, was);
+    } else if (name[0]) {
+        txn_record(UNDO_WRITE, d, name, NULL, NULL, keep);
+    }
+    fprintf(out, "'%s': %04o %u:%u\n", path, m, u, g);
+}
+
+static void chmod_cmd(struct Session *s, const char *mode, const char *path) {
+    char *end;
+    unsigned long m = mode ? strtoul(mode, &end, 8) : 0;
+    if (!mode || !path || *end != '\0' || end == mode || m > 0777) {
+        fputs("usage: chmod <octal mode> <name>\n", out);
+        return;
+    }
+    attr_change(s, path, (long)m, -1, -1);
+}
+
+static void chown_cmd(struct Session *s, const char *owner, const char *path) {
+    char *end;
+    unsigned long uid = owner ? strtoul(owner, &end, 10) : 0, gid = 0;
+    int with_gid = owner && *end == ':';
+    if (with_gid) gid = strtoul(end + 1, &end, 10);
+    if (!owner || !path || !isdigit((unsigned char)owner[0]) || *end != '\0' ||
+        uid > UINT32_MAX || gid > UINT32_MAX) {
+        fputs("usage: chown <uid>[:<gid>] <name>\n", out);
+        return;
+    }
+    attr_change(s, path, -1, (long)uid, with_gid ? (long)gid : -1);
+}
+
+/* 新しく作るファイルとディレクトリから落とすビット */
+static void umask_cmd(struct Session *s, const char *arg) {
+    if (!arg) {
+        fprintf(out, "%04o\n", s->cred.umask);
+        return;
+    }
+    char *end;
+    unsigned long m = strtoul(arg, &end, 8);
+    if (*end != '\0' || end == arg || m > 0777) {
+        fputs("usage: umask [octal mask]\n", out);
+        return;
+    }
+    s->cred.umask = cred.umask = (uint32_t)m;
+}
+
+/* 利用者を切り替える。シミュレータなので認証はしない */
+static void su_cmd(struct Session *s, const char *u, const char *g) {
+    char *end = NULL, *gend = NULL;
+    unsigned long uid = u ? strtoul(u, &end, 10) : 0;
+    unsigned long gid = g ? strtoul(g, &gend, 10) : uid;
+    if (!u || !isdigit((unsigned char)u[0]) || *end != '\0' || uid > UINT32_MAX ||
+        (g && (!isdigit((unsigned char)g[0]) || *gend != '\0')) || gid > UINT32_MAX) {
+        fputs("usage: su <uid> [gid]\n", out);
+        return;
+    }
+    s->cred.uid = cred.uid = (uint32_t)uid;
+    s->cred.gid = cred.gid = (uint32_t)gid;
+}
+
+static void id_cmd(const struct Session *s) {
+    fprintf(out, "uid=%u gid=%u umask=%04o\n", s->cred.uid, s->cred.gid, s->cred.umask);
+}
+
+static void cd_cmd(struct Session *s, const char *arg) {
+    if (!arg) {
+        fputs("usage: cd <dir>\n", out);
+        return;
+    }
+
+    /* "@名前" を含むパスなら、以後のコマンドはその版を読む */
+    struct Dir *d = resolve_dir(s, arg);
+    if (!d) {
+        fputs(path_msg("no such directory\n"), out);
+        return;
+    }
+
+    s->cwd = d;
+    s->snap = view;
+}
+
+/* 最後の文字を覚えておき、改行で終わっていなければ cat が足す */
+static int cat_chunk(const char *p, size_t n, void *arg) {
+    fwrite(p, 1, n, out);
+    *(int *)arg = (unsigned char)p[n - 1];
+    return 0;
+}
+
+static void cat_cmd(struct Session *s, const char *path) {
+    /* パイプラインの後段では入力をそのまま流す */
+    if (!path && in) {
+        char buf[4096];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), in)) > 0) fwrite(buf, 1, n, out);
+        return;
+    }
+    if (!path) {
+        fputs("usage: cat <name>\n", out);
+        return;
+    }
+
+    char name[NAME_LEN];
+    struct Dir *d = resolve_file(s, path, name);
+    const struct File *f = d && dir_ready(d) == 0 ? find_file(d, name) : NULL;
+    if (!f) {
+        fputs(path_msg("no such file\n"), out);
+        return;
+    }
+    if (!(file_bits(f) & MAY_R)) {
+        fputs("permission denied\n", out);
+        return;
+    }
+
+    int last = '\n';
+    file_used(f);
+    if (file_each(f, cat_chunk, &last) < 0) {
+        fputs("memory error\n", out);
+        return;
+    }
+    if (last != '\n') fputc('\n', out);
+}
+
+static int input_chunk(const char *p, size_t n, void *arg) {
+    return fwrite(p, 1, n, arg) == n ? 0 : -1;
+}
+
+/* path があればそのファイルの内容を、なければパイプラインの入力を読む。
+ * どちらもなければ usage を出して NULL を返す。返した FILE は close_input で閉じる */
+static FILE *open_input(struct Session *s, const char *path, const char *usage) {
+    if (!path) {
+        if (!in) fputs(usage, out);
+        return in;
+    }
+
+    char name[NAME_LEN];
+    struct Dir *d = resolve_file(s, path, name);
+    const struct File *f = d && dir_ready(d) == 0 ? find_file(d, name) : NULL;
+    if (!f) {
+        fputs(path_msg("no such file\n"), out);
+        return NULL;
+    }
+    if (!(file_bits(f) & MAY_R)) {
+        fputs("permission denied\n", out);
+        return NULL;
+    }
+
+    /* 内容は書き換えられないので、エポックの区間内ならそのまま読める。
+     * 縮めてあれば fmemopen が確保する領域へ展開する（fclose で解放される。
+     * 満杯まで書くと最後のバイトが終端の NUL で潰れるので 1 バイト余分に取る） */
+    file_used(f);
+    FILE *fp;
+    if (f->zsize) {
+        fp = fmemopen(NULL, f->size + 1, "w+");
+        if (fp && (file_each(f, input_chunk, fp) < 0 || fseek(fp, 0, SEEK_SET) < 0)) {
+            fclose(fp);
+            fp = NULL;
+        }
+    } else {
+        STAT_BYTES(f->size);
+        fp = fmemopen(f->size > 0 ? f->content : "", f->size, "r");
+    }
+    if (!fp) fputs("memory error\n", out);
+    return fp;
+}
+
+static void close_input(FILE *fp) {
+    if (fp && fp != in) fclose(fp);
+}
+
+static void echo_cmd(char **words) {
+    for (int i = 0; words[i]; i++) {
+        if (i > 0) fputc(' ', out);
+        fputs(words[i], out);
+    }
+    fputc('\n', out);
+}
+
+/* 正規表現は使わず、部分文字列で照合する */
+static void grep_cmd(struct Session *s, const char *pattern, const char *path) {
+    if (!pattern) {
+        fputs("usage: grep <pattern> [file]\n", out);
+        return;
+    }
+
+    FILE *fp = open_input(s, path, "usage: grep <pattern> [file]\n");
+    if (!fp) return;
+
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t n;
+    while ((n = getline(&line, &cap, fp)) > 0) {
+        if (!strstr(line, pattern)) continue;
+        fwrite(line, 1, (size_t)n, out);
+        if (line[n - 1] != '\n') fputc('\n', out);
+    }
+    free(line);
+    close_input(fp);
+}
+
+static void wc_cmd(struct Session *s, const char *path) {
+    FILE *fp = open_input(s, path, "usage: wc [file]\n");
+    if (!fp) return;
+
+    unsigned long long lines = 0, words = 0, bytes = 0;
+    int inword = 0, c;
+    while ((c = getc(fp)) != EOF) {
+        bytes++;
+        if (c == '\n') lines++;
+        if (isspace(c)) {
+            inword = 0;
+        } else if (!inword) {
+            inword = 1;
+            words++;
+        }
+    }
+    close_input(fp);
+
+    fprintf(out, "%7llu %7llu %7llu\n", lines, words, bytes);
+}
+
+/* newer が 0 でなければ、それより後に変更したファイルだけを出す（ディレクトリは出さない） */
+static void find_walk(struct Dir *d, char *path, size_t len, uint64_t newer) {
+    if (!dir_readable(d)) {
+        fprintf(out, "%s: permission denied\n", path);
+        return;
+    }
+    if (dir_ready(d) < 0) {
+        fputs("memory error\n", out);
+        return;
+    }
+
+    int nfiles, nsubs;
+    struct Slots *fs = dir_list(d, 0, &nfiles);
+    struct Slots *ds = dir_list(d, 1, &nsubs);
+
+    for (int i = 0; i < nfiles; i++) {
+        const struct File *f = slots_at(fs, i);
+        if (f->mtime > newer) fprintf(out, "%s/%s\n", path, f->name);
+    }
+
+    for (int i = 0; i < nsubs; i++) {
+        struct Dir *sub = slots_at(ds, i);
+        int w = snprintf(path + len, PATH_LEN - len, "/%s", sub->name);
+        if (w < 0 || (size_t)w >= PATH_LEN - len) {
+            fputs("path too long\n", out);
+            continue;
+        }
+        if (!newer) fprintf(out, "%s\n", path);
+        find_walk(sub, path, len + (size_t)w, newer);
+        path[len] = '\0';
+    }
+}
+
+static void find_cmd(struct Session *s, char **args) {
+    const char *arg = args[0] && strcmp(args[0], "-newer") != 0 ? args[0] : NULL;
+    char **opt = arg ? args + 1 : args;
+    if (opt[0] && (strcmp(opt[0], "-newer") != 0 || !opt[1])) {
+        fputs("usage: find [dir] [-newer <name>]\n", out);
+        return;
+    }
+
+    /* 比べる相手の時刻。それより後に変えたファイルだけを出す */
+    uint64_t newer = 0;
+    if (opt[0]) {
+        char name[NAME_LEN];
+        struct Dir *rd = resolve_file(s, opt[1], name);
+        const struct File *ref = rd && dir_ready(rd) == 0 ? find_file(rd, name) : NULL;
+        if (!ref) {
+            fputs(path_msg("no such file\n"), out);
+            return;
+        }
+        newer = ref->mtime;
+    }
+
+    char path[PATH_LEN];
+    struct Dir *d = arg ? resolve_dir(s, arg) : s->cwd;
+    if (!d) {
+        fputs(path_msg("no such directory\n"), out);
+        return;
+    }
+
+    snprintf(path, sizeof(path), "%s", arg ? arg : ".");
+    if (!newer) fprintf(out, "%s\n", path);
+    find_walk(d, path, strlen(path), newer);
+}
+
+static void import_cmd(struct Session *s, const char *host, const char *opt) {
+    if (!host) {
+        fputs("usage: import <hostdir> [-c]\n", out);
+        return;
+    }
+
+    struct stat sb;
+    if (stat(host, &sb) < 0 || !S_ISDIR(sb.st_mode)) {
+        txn_fail();
+        fputs("no such host directory\n", out);
+        return;
+    }
+
+    /* 取り込み先の名前はホストパスの最後の要素 */
+    char buf[PATH_LEN];
+    snprintf(buf, sizeof(buf), "%s", host);
+    size_t len = strlen(buf);
+    while (len > 1 && buf[len - 1] == '/') buf[--len] = '\0';
+    const char *name = strrchr(buf, '/') ? strrchr(buf, '/') + 1 : buf;
+    if (*name == '\0') name = "host";
+
+    /* 断られるものは走査の前に断る（-c ならホストの内容まで読み終えてしまう）。
+     * 走査中に変わりうるので、繋ぐ直前にも確かめ直す */
+    struct Dir *cwd = s->cwd;
+    if (dir_lock(cwd) < 0) {
+        txn_fail();
+        fputs("memory error\n", out);
+        return;
+    }
+    int rc = view ? FS_RDONLY : !(dir_bits(cwd) & MAY_W) ? FS_ACCES :
+             name_taken(cwd, name) ? FS_EXIST : FS_OK;
+    dir_unlock(cwd);
+    if (rc != FS_OK) {
+        txn_fail();
+        fputs(rc == FS_EXIST ? "name already exists\n" :
+              rc == FS_ACCES ? "permission denied\n" : "snapshot is read-only\n", out);
+        return;
+    }
+
+    struct Dir *top = create_dir(name, cwd);
+    if (top) top->mode = sb.st_mode & 0777;
+    struct TreeWalk tw;
+    memset(&tw, 0, sizeof(tw));
+    tw.visit = import_dir;
+    tw.with_content = opt && strcmp(opt, "-c") == 0;
+
+    if (!top || walk_run(&tw, top, host) < 0 || dir_lock(cwd) < 0) {
+        free_dir(top);
+        txn_fail();
+        fputs("memory error\n", out);
+        return;
+    }
+
+    /* 走査中はロックを持たないので、繋ぐ直前に名前の重複と書き込みの権限を確かめる */
+    rc = dir_bits(cwd) & MAY_W ? txn_claim(cwd) : FS_ACCES;
+    if (rc == FS_OK && name_taken(cwd, name)) rc = FS_EXIST;
+    if (rc == FS_OK) {
+        if (txn) txn_adopt(top);
+        if (dir_freeze(cwd) < 0 || dir_add_subdir(cwd, top) < 0) {
+            rc = FS_NOMEM;
+        } else {
+            usage_rebuild(top);
+            usage_add(cwd, (int64_t)top->usage.bytes, (int64_t)top->usage.files,
+                      (int64_t)top->usage.dirs + 1, dir_key(top->name, top->usage.hash));
+        }
+    }
+    dir_unlock(cwd);
+
+    if (rc != FS_OK) {
+        free_dir(top);
+        txn_fail();
+        fputs(rc == FS_EXIST ? "name already exists\n" :
+              rc == FS_BUSY ? "directory is locked by a transaction\n" :
+              rc == FS_ACCES ? "permission denied\n" :
+              rc == FS_RDONLY ? "snapshot is read-only\n" : "memory error\n", out);
+        return;
+    }
+    txn_record(UNDO_IMPORT, cwd, name, NULL, NULL, top);
+
+    struct WalkStats *st = &tw.st;
+    fprintf(out, "imported '%s': %ld dirs, %ld files, %llu bytes",
+            name, st->dirs, st->files, st->bytes);
+    if (st->skipped > 0) fprintf(out, " (%ld skipped)", st->skipped);
+    fputc('\n', out);
+
+    /* 取り込みはジャーナルで再現できないので、コマンド後にイメージへ書き戻す */
+    if (journal.fd >= 0) journal_request_checkpoint();
+}
+
+static void export_cmd(struct Session *s, const char *arg, const char *file) {
+    if (!arg) {
+        fputs("usage: export <hostdir> | export -t [file|-]\n", out);
+        return;
+    }
+
+    if (!(dir_bits(s->cwd) & MAY_R)) {
+        fputs("permission denied\n", out);
+        return;
+    }
+
+    struct WalkStats st;
+    FILE *msg = out;
+
+    if (strcmp(arg, "-t") == 0) {
+        /* 出力先へ直接流すときはアーカイブを汚さないよう結果は stderr へ */
+        int to_out = !file || strcmp(file, "-") == 0;
+        int fd = to_out ? fileno(out) : open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            if (to_out) fputs("cannot stream to this output\n", out);
+            else perror(file);
+            return;
+        }
+        if (to_out) {
+            fflush(out);
+            msg = stderr;
+        }
+
+        int rc = export_tar(s->cwd, fd, &st);
+        if (!to_out) close(fd);
+        if (rc < 0) {
+            fputs("export failed\n", msg);
+            return;
+        }
+    } else {
+        struct TreeWalk tw;
+        memset(&tw, 0, sizeof(tw));
+        tw.visit = export_dir;
+        if (walk_run(&tw, s->cwd, arg) < 0) {
+            fputs("memory error\n", out);
+            return;
+        }
+        st = tw.st;
+    }
+
+    fprintf(msg, "exported %ld dirs, %ld files, %llu bytes", st.dirs, st.files, st.bytes);
+    if (st.skipped > 0) fprintf(msg, " (%ld skipped)", st.skipped);
+    fputc('\n', msg);
+}
+
+static void sync_cmd(void) {
+    if (journal.fd < 0) {
+        fputs("not in persistent mode\n", out);
+        return;
+    }
+
+    if (journal_checkpoint() < 0) fputs("checkpoint deferred: transaction in progress\n", out);
+    else fputs("checkpoint done\n", out);
+}
+
+static void begin_cmd(struct Session *s) {
+    if (s->txn) {
+        fputs("transaction already open\n", out);
+        return;
+    }
+
+    struct Txn *t = calloc(1, sizeof(*t));
+    if (!t) {
+        fputs("memory error\n", out);
+        return;
+    }
+    pthread_mutex_init(&t->lock, NULL);
+    s->txn = t;
+    __atomic_add_fetch(&txn_open, 1, __ATOMIC_RELEASE);
+    fputs("transaction started\n", out);
+}
+
+/* 途中で失敗した変更があれば、確定せずにすべて取り消す */
+static void commit_cmd(struct Session *s) {
+    struct Txn *t = s->txn;
+    if (!t) {
+        fputs("no transaction\n", out);
+        return;
+    }
+
+    size_t n = t->nundo;
+    int failed = t->failed;
+    s->txn = NULL;
+    txn_end(t, !failed);
+    if (failed) fprintf(out, "commit failed: rolled back %zu changes\n", n);
+    else fprintf(out, "committed %zu changes\n", n);
+}
+
+static void rollback_cmd(struct Session *s) {
+    struct Txn *t = s->txn;
+    if (!t) {
+        fputs("no transaction\n", out);
+        return;
+    }
+
+    size_t n = t->nundo;
+    s->txn = NULL;
+    txn_end(t, 0);
+    fprintf(out, "rolled back %zu changes\n", n);
+}
+
+/* 版の番号を進めるだけなので木の大きさによらず O(1)。
+ * 確定前の変更を写さないよう、トランザクションの実行中は取らない */
+static void snapshot_cmd(const char *name) {
+    if (!name) {
+        pthread_mutex_lock(&snaps.lock);
+        for (size_t i = 0; i < snaps.n; i++) {
+            fprintf(out, "@%s\tversion %llu\n", snaps.snap[i]->name,
+                    (unsigned long long)snaps.snap[i]->ver);
+        }
+        fprintf(out, "%ld frozen dirs, %ld retained files\n",
+                __atomic_load_n(&snaps.frozen, __ATOMIC_RELAXED), snaps.nkept);
+        pthread_mutex_unlock(&snaps.lock);
+        return;
+    }
+    if (strlen(name) >= NAME_LEN || strchr(name, '@')) {
+        fputs("invalid snapshot name\n", out);
+        return;
+    }
+    if (__atomic_load_n(&txn_open, __ATOMIC_ACQUIRE) > 0) {
+        fputs("cannot take snapshot: transaction in progress\n", out);
+        return;
+    }
+
+    struct Snapshot *snap = calloc(1, sizeof(*snap));
+    if (!snap) {
+        fputs("memory error\n", out);
+        return;
+    }
+    strcpy(snap->name, name);
+
+    pthread_mutex_lock(&snaps.lock);
+    int dup = 0;
+    for (size_t i = 0; i < snaps.n && !dup; i++) {
+        if (strcmp(snaps.snap[i]->name, name) == 0) dup = 1;
+    }
+    int rc = dup ? 0 : grow(&snaps.snap, &snaps.cap, snaps.n + 1, sizeof(*snaps.snap));
+    if (!dup && rc == 0) {
+        /* 以後の変更は新しい版として行われ、この版の一覧は凍結版に残る */
+        snap->ver = __atomic_load_n(&tree_ver, __ATOMIC_ACQUIRE);
+        snaps.snap[snaps.n++] = snap;
+        __atomic_store_n(&tree_ver, snap->ver + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&snaps.lock);
+
+    if (dup || rc < 0) {
+        free(snap);
+        fputs(dup ? "snapshot already exists\n" : "memory error\n", out);
+        return;
+    }
+    fprintf(out, "snapshot '%s' taken\n", name);
+}
+
+static void format_size(char *buf, size_t size, uint64_t bytes, int human) {
+    static const char units[] = "BKMGTP";
+
+    if (!human || bytes < 1024) {
+        snprintf(buf, size, "%llu", (unsigned long long)bytes);
+        return;
+    }
+
+    double v = (double)bytes;
+    int u = 0;
+    while (v >= 1024 && u < 5) {
+        v /= 1024;
+        u++;
+    }
+    snprintf(buf, size, v < 10 ? "%.1f%c" : "%.0f%c", v, units[u]);
+}
+
+/* スナップショットの中の集計。その版の後で変わった部分木だけを数え直し、
+ * 変わっていない部分木は今の集計値を使う */
+static void usage_view(struct Dir *d, struct Usage *u) {
+    struct Usage live;
+    usage_get(d, &live);
+    if (live.ver <= view->ver) {
+        u->bytes += live.bytes;
+        u->files += live.files;
+        u->dirs += live.dirs;
+        return;
+    }
+    if (dir_ready(d) < 0) return;
+
+    int nf, nd;
+    struct Slots *fs = dir_list(d, 0, &nf);
+    struct Slots *ds = dir_list(d, 1, &nd);
+    for (int i = 0; i < nf; i++) {
+        const struct File *f = slots_at(fs, i);
+        u->bytes += f->size;
+    }
+    u->files += (uint64_t)nf;
+    u->dirs += (uint64_t)nd;
+    for (int i = 0; i < nd; i++) usage_view(slots_at(ds, i), u);
+}
+
+/* 集計値を読むだけなので、各ディレクトリの表示は O(1)（スナップショットの中では数え直す）。
+ * 表示するディレクトリ数より深くは辿らない */
+static void du_walk(struct Dir *d, char *path, size_t len, int depth, int max_depth, int human) {
+    if (!dir_readable(d)) {
+        fprintf(out, "%s: permission denied\n", path);
+        return;
+    }
+    if (depth < max_depth) {
+        int n;
+        struct Slots *ds = dir_ready(d) == 0 ? dir_list(d, 1, &n) : NULL;
+        for (int i = 0; ds && i < n; i++) {
+            struct Dir *sub = slots_at(ds, i);
+            int w = snprintf(path + len, PATH_LEN - len, "/%s", sub->name);
+            if (w < 0 || (size_t)w >= PATH_LEN - len) {
+                fputs("path too long\n", out);
+                continue;
+            }
+            du_walk(sub, path, len + (size_t)w, depth + 1, max_depth, human);
+            path[len] = '\0';
+        }
+    }
+
+    struct Usage u = { 0, 0, 0, 0, 0 };
+    if (view) usage_view(d, &u);
+    else usage_get(d, &u);
+
+    char sz[32];
+    format_size(sz, sizeof(sz), u.bytes, human);
+    fprintf(out, "%s\t%s\n", sz, path);
+}
+
+static void du_cmd(struct Session *s, char **args, int nargs) {
+    int human = 0, max_depth = -1;
+    const char *target = NULL;
+
+    for (int i = 0; i < nargs && args[i]; i++) {
+        if (strcmp(args[i], "-s") == 0) {
+            max_depth = 0;
+        } else if (strcmp(args[i], "-h") == 0) {
+            human = 1;
+        } else if (strncmp(args[i], "--max-depth=", 12) == 0) {
+            max_depth = atoi(args[i] + 12);
+        } else if (args[i][0] == '-') {
+            fputs("usage: du [-s] [-h] [--max-depth=N] [dir]\n", out);
+            return;
+        } else {
+            target = args[i];
+        }
+    }
+
+    struct Dir *d = target ? resolve_dir(s, target) : s->cwd;
+    if (!d) {
+        fputs(path_msg("no such directory\n"), out);
+        return;
+    }
+
+    char path[PATH_LEN];
+    snprintf(path, sizeof(path), "%s", target ? target : ".");
+    du_walk(d, path, strlen(path), 0, max_depth < 0 ? INT32_MAX : max_depth, human);
+}
+
+/* ルートの集計値を出すだけなので即座に返る（スナップショットの中では数え直す） */
+static void df_cmd(struct Dir *root, const char *opt) {
+    int human = opt && strcmp(opt, "-h") == 0;
+    struct Usage u = { 0, 0, 0, 0, 0 };
+    char sz[32];
+
+    if (view) usage_view(root, &u);
+    else usage_get(root, &u);
+    format_size(sz, sizeof(sz), u.bytes, human);
+    fprintf(out, "%-12s %10s %10s %10s  %s\n", "Filesystem", "Used", "Files", "Dirs", "Mounted on");
+    fprintf(out, "%-12s %10s %10llu %10llu  %s\n", "pseudofs", sz,
+            (unsigned long long)u.files, (unsigned long long)u.dirs + 1, "/");
+}
+
+/* 共有の効き具合を出す。on / off は以後の書き込みで共有するかを切り替える（速さの比較用） */
+static void dedup_cmd(const char *opt) {
+    if (opt && strcmp(opt, "on") != 0 && strcmp(opt, "off") != 0) {
+        fputs("usage: dedup [on|off]\n", out);
+        return;
+    }
+    if (opt) {
+        __atomic_store_n(&store.off, strcmp(opt, "off") == 0, __ATOMIC_RELAXED);
+        fprintf(out, "dedup %s\n", opt);
+        return;
+    }
+
+    uint64_t refs = __atomic_load_n(&store.refs, __ATOMIC_RELAXED);
+    uint64_t blobs = __atomic_load_n(&store.blobs, __ATOMIC_RELAXED);
+    uint64_t logical = __atomic_load_n(&store.logical, __ATOMIC_RELAXED);
+    uint64_t stored = __atomic_load_n(&store.stored, __ATOMIC_RELAXED);
+    fprintf(out, "dedup %s: %llu references to %llu blobs, %llu bytes stored for %llu bytes (%.2fx)\n",
+            __atomic_load_n(&store.off, __ATOMIC_RELAXED) ? "off" : "on",
+            (unsigned long long)refs, (unsigned long long)blobs, (unsigned long long)stored,
+            (unsigned long long)logical, stored ? (double)logical / (double)stored : 1.0);
+}
+
+/* ----- 冷えた内容を縮める -----
+ * compress now は今すぐ、compress on は裏のスレッドが age / 2 秒ごとに木を見回り、
+ * age 秒読まれていないファイルを縮める。スナップショットが参照しうる File は
+ * 差し替えても元を解放できないので縮めない。トランザクション中のディレクトリも飛ばす。
+ * シャードのあるサーバーでは、ディレクトリを持ち主のシャード以外が変えないことを
+ * 前提にしているので使えない。 */
+
+static int cold_candidate(const struct File *f, uint32_t now, unsigned age) {
+    return f->size >= ZMIN && !f->zsize && !f->ino && !in_image(f->content) &&
+           !__atomic_load_n(&f->zskip, __ATOMIC_RELAXED) &&
+           now - __atomic_load_n(&f->used, __ATOMIC_RELAXED) >= age &&
+           f->ver >= __atomic_load_n(&tree_ver, __ATOMIC_ACQUIRE);
+}
+
+/* 縮める間はロックを外し、差し替える前に同じ File がまだ載っているかを確かめる */
+static long cold_dir(struct Dir *d, uint32_t now, unsigned age) {
+    if (__atomic_load_n(&d->img, __ATOMIC_ACQUIRE)) return 0;     /* 未展開ならイメージ上にあるだけ */
+
+    long packed = 0;
+    int nf, nd;
+    struct Slots *fs = slots_get(&d->files, &nf);
+    for (int i = 0; i < nf; i++) {
+        struct File *f = slots_at(fs, i);
+        if (!cold_candidate(f, now, age)) continue;
+
+        size_t zsize = 0;
+        char *z = cold_pack(f, &zsize);
+        if (!z) {
+            __atomic_store_n(&f->zskip, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        struct File *nf = file_alloc(f->name);
+        if (!nf || dir_lock(d) < 0) {
+            file_node_free(nf);
+            free(z);
+            continue;
+        }
+
+        int idx = find_file_index(d, f->name);
+        int ok = idx >= 0 && slots_at(d->files, idx) == f && !d->txn &&
+                 cold_candidate(f, now, age) && dir_freeze(d) == 0;
+        if (ok) {
+            file_copy(nf, f);
+            nf->content = z;
+            nf->zsize = zsize;
+            slots_set(d->files, idx, nf);
+            file_retire(f, file_free);
+            mem_track(MEM_CONTENT, z, zsize, 1);
+            __atomic_add_fetch(&cold.files, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&cold.plain, nf->size, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&cold.packed, zsize, __ATOMIC_RELAXED);
+            packed++;
+        }
+        dir_unlock(d);
+        if (!ok) {
+            file_node_free(nf);
+            free(z);
+        }
+    }
+
+    struct Slots *ds = slots_get(&d->subdirs, &nd);
+    for (int i = 0; i < nd; i++) packed += cold_dir(slots_at(ds, i), now, age);
+    return packed;
+}
+
+/* 現在の木を見回り、縮めたファイルの数を返す */
+static long cold_sweep(struct Dir *root, unsigned age) {
+    const struct Snapshot *saved = view;
+    view = NULL;
+    epoch_enter();
+    clock_tick();
+    long n = cold_dir(root, clock_sec(), age);
+    epoch_exit();
+    view = saved;
+    __atomic_add_fetch(&cold.sweeps, 1, __ATOMIC_RELAXED);
+    return n;
+}
+
+static void *cold_main(void *arg) {
+    struct Dir *root = arg;
+    pthread_mutex_lock(&cold.lock);
+    while (!cold.stop) {
+        unsigned age = cold.age;
+        pthread_mutex_unlock(&cold.lock);
+        cold_sweep(root, age);
+
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += age / 2 > 0 ? age / 2 : 1;
+        pthread_mutex_lock(&cold.lock);
+        if (!cold.stop) pthread_cond_timedwait(&cold.cond, &cold.lock, &ts);
+    }
+    pthread_mutex_unlock(&cold.lock);
+    epoch_thread_exit();
+    trace_thread_exit();
+    return NULL;
+}
+
+/* 見回りのスレッドを止めて待つ。終了時にも木を解放する前に呼ぶ */
+static void cold_stop(void) {
+    pthread_mutex_lock(&cold.lock);
+    int running = cold.running;
+    cold.stop = 1;
+    pthread_cond_signal(&cold.cond);
+    pthread_mutex_unlock(&cold.lock);
+    if (running) pthread_join(cold.tid, NULL);
+
+    pthread_mutex_lock(&cold.lock);
+    cold.running = 0;
+    cold.stop = 0;
+    pthread_mutex_unlock(&cold.lock);
+}
+
+/* 引数なしなら、縮めて浮いたメモリと展開にかかった時間を並べて出す */
+static void compress_cmd(struct Dir *root, const char *opt, const char *arg) {
+    int now = opt && strcmp(opt, "now") == 0, on = opt && strcmp(opt, "on") == 0;
+    int age = arg ? atoi(arg) : (int)cold.age;
+    if ((opt && !now && !on && strcmp(opt, "off") != 0) || age < 0) {
+        fputs("usage: compress [now [seconds]|on [seconds]|off]\n", out);
+        return;
+    }
+    if (opt && shards.n > 0) {
+        fputs("compress is not available with shards\n", out);
+        return;
+    }
+
+    if (now) {
+        long n = cold_sweep(root, (unsigned)age);
+        fprintf(out, "compressed %ld files\n", n);
+        return;
+    }
+    if (on) {
+        pthread_mutex_lock(&cold.lock);
+        cold.age = (unsigned)age;
+        int start = !cold.running;
+        if (start) cold.running = thread_create(&cold.tid, cold_main, root) == 0;
+        pthread_cond_signal(&cold.cond);
+        int running = cold.running;
+        pthread_mutex_unlock(&cold.lock);
+        if (running) fprintf(out, "compress on after %us idle\n", (unsigned)age);
+        else fputs("cannot start compressor\n", out);
+        return;
+    }
+    if (opt) {
+        cold_stop();
+        fputs("compress off\n", out);
+        return;
+    }
+
+    uint64_t files = __atomic_load_n(&cold.files, __ATOMIC_RELAXED);
+    uint64_t plain = __atomic_load_n(&cold.plain, __ATOMIC_RELAXED);
+    uint64_t packed = __atomic_load_n(&cold.packed, __ATOMIC_RELAXED);
+    uint64_t unpacks = __atomic_load_n(&cold.unpacks, __ATOMIC_RELAXED);
+    uint64_t ubytes = __atomic_load_n(&cold.unpack_bytes, __ATOMIC_RELAXED);
+    uint64_t ns = __atomic_load_n(&cold.unpack_ns, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&cold.lock);
+    int running = cold.running;
+    unsigned cur = cold.age;
+    pthread_mutex_unlock(&cold.lock);
+
+    fprintf(out, "memory: %llu files, %llu bytes packed into %llu (%.1f%%), %llu bytes saved\n",
+            (unsigned long long)files, (unsigned long long)plain, (unsigned long long)packed,
+            plain ? 100.0 * (double)packed / (double)plain : 100.0,
+            (unsigned long long)(plain - packed));
+    fprintf(out, "latency: %llu reads unpacked %llu bytes, %.1f us per read, %.1f MB/s\n",
+            (unsigned long long)unpacks, (unsigned long long)ubytes,
+            unpacks ? (double)ns / 1e3 / (double)unpacks : 0.0,
+            ns ? (double)ubytes / 1e6 / ((double)ns / 1e9) : 0.0);
+    if (running) {
+        fprintf(out, "compressor: on after %us idle, %llu sweeps\n", cur,
+                (unsigned long long)__atomic_load_n(&cold.sweeps, __ATOMIC_RELAXED));
+    } else {
+        fputs("compressor: off\n", out);
+    }
+}
+
+/* ----- メモリの内訳 -----
+ * メモリの計量で数えた値を出すだけなので、木の大きさによらず即座に返る */
+static void memstat_cmd(const char *opt) {
+    static const char *const names[MEM_KINDS] = {
+        "dirs", "files", "names", "content", "index", "slack",
+    };
+    int human = opt && strcmp(opt, "-h") == 0;
+    if (opt && !human) {
+        fputs("usage: memstat [-h]\n", out);
+        return;
+    }
+
+    int64_t b[MEM_KINDS], total = 0;
+    for (int i = 0; i < MEM_KINDS; i++) {
+        b[i] = __atomic_load_n(&mem.bytes[i], __ATOMIC_RELAXED);
+        total += b[i];
+    }
+
+    char sz[32];
+    fprintf(out, "%-8s %12s %6s\n", "kind", "bytes", "share");
+    for (int i = 0; i < MEM_KINDS; i++) {
+        format_size(sz, sizeof(sz), (uint64_t)b[i], human);
+        fprintf(out, "%-8s %12s %5.1f%%\n", names[i], sz, total ? 100.0 * (double)b[i] / (double)total : 0.0);
+    }
+    format_size(sz, sizeof(sz), (uint64_t)total, human);
+    fprintf(out, "%-8s %12s\n", "total", sz);
+
+    fprintf(out, "%lld dirs (%zu bytes each), %lld files (%zu bytes each), name field %d bytes\n",
+            (long long)__atomic_load_n(&mem.dirs, __ATOMIC_RELAXED), sizeof(struct Dir),
+            (long long)__atomic_load_n(&mem.files, __ATOMIC_RELAXED), sizeof(struct File), NAME_LEN);
+    if (image.base) {
+        format_size(sz, sizeof(sz), image.len, human);
+        fprintf(out, "image: %s bytes mapped (not counted above)\n", sz);
+    }
+}
+
+/* ===== 木の比較 =====
+ * diff は 2 つのディレクトリ（それぞれ別のスナップショットでもよい）を名前順に突き合わせる。
+ * 部分木のハッシュが等しい組は中を見ずに読み飛ばすので、手間は違いのある経路の分だけで済む。
+ * スナップショット側のハッシュは、その版の後で部分木が変わっていなければ今の値と同じ。
+ * 変わっていれば分からないので中を比べる。 */
+
+struct DiffEnt {
+    const char *name;
+    void *p;                    /* struct File * か struct Dir * */
+    int dir;
+};
+
+struct Diff {
+    const struct Snapshot *va, *vb;
+    long changes;
+    long skipped;
+    int err;
+};
+
+static int diff_ent_cmp(const void *a, const void *b) {
+    return strcmp(((const struct DiffEnt *)a)->name, ((const struct DiffEnt *)b)->name);
+}
+
+/* 版 v での d の子を名前順に並べる */
+static struct DiffEnt *diff_list(struct Dir *d, const struct Snapshot *v, int *n) {
+    const struct Snapshot *saved = view;
+    view = v;
+
+    struct DiffEnt *e = NULL;
+    *n = 0;
+    if (dir_ready(d) == 0) {
+        int nf, nd;
+        struct Slots *fs = dir_list(d, 0, &nf);
+        struct Slots *ds = dir_list(d, 1, &nd);
+        e = malloc(sizeof(*e) * ((size_t)nf + (size_t)nd + 1));
+        for (int i = 0; e && i < nf; i++) {
+            struct File *f = slots_at(fs, i);
+            e[(*n)++] = (struct DiffEnt){ f->name, f, 0 };
+        }
+        for (int i = 0; e && i < nd; i++) {
+            struct Dir *sub = slots_at(ds, i);
+            e[(*n)++] = (struct DiffEnt){ sub->name, sub, 1 };
+        }
+    }
+    view = saved;
+
+    if (e) qsort(e, (size_t)*n, sizeof(*e), diff_ent_cmp);
+    return e;
+}
+
+/* 版 v での d のハッシュが分かれば h に入れて 1 を返す */
+static int diff_hash(const struct Dir *d, const struct Snapshot *v, uint64_t *h) {
+    struct Usage u;
+    usage_get(d, &u);
+    *h = u.hash;
+    return !v || u.ver <= v->ver;
+}
+
+static void diff_print(struct Diff *df, char mark, const char *path, int dir) {
+    fprintf(out, "%c %s%s\n", mark, path, dir ? "/" : "");
+    df->changes++;
+}
+
+static void diff_walk(struct Diff *df, struct Dir *a, struct Dir *b, char *path, size_t len) {
+    if (!dir_readable(a) || !dir_readable(b)) {
+        fprintf(out, "%s%spermission denied\n", path, len ? ": " : "");
+        return;
+    }
+
+    uint64_t ha, hb;
+    if (diff_hash(a, df->va, &ha) && diff_hash(b, df->vb, &hb) && ha == hb) {
+        df->skipped++;
+        return;
+    }
+
+    int na, nb;
+    struct DiffEnt *ea = diff_list(a, df->va, &na);
+    struct DiffEnt *eb = diff_list(b, df->vb, &nb);
+    if (!ea || !eb) {
+        free(ea);
+        free(eb);
+        df->err = 1;
+        return;
+    }
+
+    int i = 0, j = 0;
+    while ((i < na || j < nb) && !df->err) {
+        int c = i == na ? 1 : j == nb ? -1 : strcmp(ea[i].name, eb[j].name);
+        const struct DiffEnt *x = c <= 0 ? &ea[i] : &eb[j];
+        const struct DiffEnt *y = c == 0 ? &eb[j] : NULL;
+        if (c <= 0) i++;
+        if (c >= 0) j++;
+
+        int w = snprintf(path + len, PATH_LEN - len, "%s%s", len ? "/" : "", x->name);
+        if (w < 0 || (size_t)w >= PATH_LEN - len) {
+            fputs("path too long\n", out);
+            path[len] = '\0';
+            continue;
+        }
+
+        if (!y) {
+            diff_print(df, c < 0 ? '-' : '+', path, x->dir);
+        } else if (x->dir != y->dir) {
+            diff_print(df, '-', path, x->dir);
+            diff_print(df, '+', path, y->dir);
+        } else if (x->dir) {
+            diff_walk(df, x->p, y->p, path, len + (size_t)w);
+        } else if (x->p != y->p && file_key(x->p) != file_key(y->p)) {
+            diff_print(df, 'M', path, 0);
+        }
+        path[len] = '\0';
+    }
+
+    free(ea);
+    free(eb);
+}
+
+/* パスごとに "@名前" で版を選べる。出力はそれぞれの起点からの相対パス */
+static void diff_cmd(struct Session *s, const char *a, const char *b) {
+    if (!a || !b) {
+        fputs("usage: diff <dir1> <dir2>\n", out);
+        return;
+    }
+
+    const struct Snapshot *base = view;
+    struct Dir *da = resolve_dir(s, a);
+    const struct Snapshot *va = view;
+    view = base;
+    int err = path_err;
+    struct Dir *db = resolve_dir(s, b);
+    const struct Snapshot *vb = view;
+    view = base;
+    if (!db) err = path_err;
+    if (!da || !db) {
+        path_err = err;
+        fputs(path_msg("no such directory\n"), out);
+        return;
+    }
+
+    struct Diff df = { va, vb, 0, 0, 0 };
+    char path[PATH_LEN] = "";
+    diff_walk(&df, da, db, path, 0);
+    if (df.err) fputs("memory error\n", out);
+    fprintf(out, "%ld differences, %ld identical subtrees skipped\n", df.changes, df.skipped);
+}
+
+/* ===== 作業負荷の生成 =====
+ * gen tree は実際の木に似せた部分木を、分布を指定して直接作る
+ * （ディレクトリごとの子の数、深さ、名前の長さ、ファイルの大きさ）。
+ * gen ops は cwd 以下のディレクトリに Zipf 分布で偏ったアクセスをする操作列を、
+ * replay で流せるスクリプトとしてホストへ書き出す。どちらも seed が同じなら同じものを作る。
+ * 分布は "N"（固定）、"A..B"（一様）、"geo:M"（平均 M の幾何分布）、
+ * "log:M"（中央値 M の対数正規分布）で書く。
+ * libm を使わずに済むよう、対数と指数は級数で求める（分布の形には十分な精度）。 */
+#define GEN_LN2      0.69314718055994530942
+#define GEN_LINE_MAX 80         /* 操作列に使うディレクトリのパスの長さの上限（行は LINE_LEN 未満） */
+
+enum {
+    GEN_FIXED,
+    GEN_UNIFORM,
+    GEN_GEO,
+    GEN_LOG,
+};
+
+struct GenDist {
+    int kind;
+    double a, b;
+};
+
+struct Gen {
+    uint64_t rng;
+    int depth;
+    long max, made;             /* 作るノード数の上限と、作った数 */
+    struct GenDist dirs, files, name, size;
+};
+
+static uint64_t gen_rand(uint64_t *rng) {
+    *rng += 0x9e3779b97f4a7c15ull;
+    return mix64(*rng);
+}
+
+/* (0, 1) の一様乱数 */
+static double gen_unit(uint64_t *rng) {
+    return ((double)(gen_rand(rng) >> 11) + 0.5) / 9007199254740992.0;
+}
+
+static double gen_ln(double x) {
+    int e = 0;
+    while (x >= 2.0) {
+        x /= 2.0;
+        e++;
+    }
+    while (x < 1.0) {
+        x *= 2.0;
+        e--;
+    }
+    /* ln x = 2 atanh((x - 1) / (x + 1)) */
+    double t = (x - 1.0) / (x + 1.0), t2 = t * t, term = t, sum = 0.0;
+    for (int i = 1; i < 40; i += 2) {
+        sum += term / i;
+        term *= t2;
+    }
+    return e * GEN_LN2 + 2.0 * sum;
+}
+
+static double gen_exp(double x) {
+    int k = 0;
+    while (x > GEN_LN2) {
+        x -= GEN_LN2;
+        k++;
+    }
+    while (x < 0.0) {
+        x += GEN_LN2;
+        k--;
+    }
+    double term = 1.0, sum = 1.0;
+    for (int i = 1; i < 20; i++) {
+        term *= x / i;
+        sum += term;
+    }
+    for (; k > 0; k--) sum *= 2.0;
+    for (; k < 0; k++) sum /= 2.0;
+    return sum;
+}
+
+static int gen_dist(const char *v, struct GenDist *d) {
+    char *end;
+    if (strncmp(v, "geo:", 4) == 0 || strncmp(v, "log:", 4) == 0) {
+        d->kind = v[0] == 'g' ? GEN_GEO : GEN_LOG;
+        d->a = strtod(v + 4, &end);
+        return *end || d->a < 0 || (d->kind == GEN_LOG && d->a <= 0) ? -1 : 0;
+    }
+    d->a = (double)strtol(v, &end, 10);
+    d->b = d->a;
+    d->kind = GEN_FIXED;
+    if (strncmp(end, "..", 2) == 0) {
+        d->kind = GEN_UNIFORM;
+        d->b = (double)strtol(end + 2, &end, 10);
+    }
+    return end == v || *end || d->a < 0 || d->b < d->a ? -1 : 0;
+}
+
+static long gen_draw(uint64_t *rng, const struct GenDist *d) {
+    double x;
+    switch (d->kind) {
+    case GEN_UNIFORM:
+        return (long)d->a + (long)(gen_rand(rng) % (uint64_t)((long)d->b - (long)d->a + 1));
+    case GEN_GEO:
+        /* 失敗までの成功回数。成功の確率 M / (M + 1) で平均 M */
+        x = d->a > 0 ? gen_ln(gen_unit(rng)) / gen_ln(d->a / (d->a + 1.0)) : 0.0;
+        break;
+    case GEN_LOG: {
+        /* 一様乱数 12 個の和で正規分布を近似する（σ = 1） */
+        double z = -6.0;
+        for (int i = 0; i < 12; i++) z += gen_unit(rng);
+        x = gen_exp(gen_ln(d->a) + z);
+        break;
+    }
+    default:
+        x = d->a;
+        break;
+    }
+    return x < (double)(1 << 24) ? (long)x : 1 << 24;
+}
+
+/* 英小文字と数字の名前。先頭は英字 */
+static void gen_name(struct Gen *g, char *name) {
+    static const char chars[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+    long len = gen_draw(&g->rng, &g->name);
+    if (len < 1) len = 1;
+    if (len > NAME_LEN - 1) len = NAME_LEN - 1;
+    for (long i = 0; i < len; i++) {
+        name[i] = chars[gen_rand(&g->rng) % (i == 0 ? 26 : sizeof(chars) - 1)];
+    }
+    name[len] = '\0';
+}
+
+/* 単語を空白で並べ、10 語前後ごとに改行する（実際の文章に近い縮み方をする） */
+static char *gen_text(struct Gen *g, size_t size) {
+    char *p = malloc(size ? size : 1);
+    if (!p) return NULL;
+    for (size_t i = 0; i < size; i++) {
+        uint64_t r = gen_rand(&g->rng);
+        p[i] = r % 6 == 0 ? (r % 60 == 0 ? '\n' : ' ') : (char)('a' + (r >> 8) % 26);
+    }
+    if (size > 0) p[size - 1] = '\n';
+    return p;
+}
+
+/* mkdir と書き込みを、メッセージを出さずに 1 件ずつ行う（ジャーナルとトランザクションは通常どおり） */
+static int gen_mkdir(struct Dir *d, const char *name, struct Dir **sub) {
+    if (dir_lock(d) < 0) return FS_NOMEM;
+    int rc = dir_bits(d) & MAY_W ? txn_claim(d) : FS_ACCES;
+    if (rc == FS_OK) rc = mkdir_prepare(d, name, sub);
+    if (rc == FS_OK) {
+        journal_log(OP_MKDIR, d, name, NULL, NULL);
+        mkdir_publish(d, *sub);
+    }
+    dir_unlock(d);
+    if (rc == FS_OK) txn_record(UNDO_MKDIR, d, name, NULL, NULL, *sub);
+    return rc;
+}
+
+static int gen_write(struct Dir *d, const char *name, char *data, size_t len) {
+    if (dir_lock(d) < 0) {
+        free(data);
+        return FS_NOMEM;
+    }
+    struct File *keep = NULL;
+    int rc = dir_bits(d) & MAY_W ? txn_claim(d) : FS_ACCES;
+    if (rc == FS_OK && name_taken(d, name)) rc = FS_EXIST;
+    if (rc == FS_OK) rc = fs_write(d, name, data, len, 0, txn ? &keep : NULL);
+    else free(data);
+    if (rc == FS_OK) journal_append(OP_WRITE, d, name, NULL, NULL, find_file(d, name)->content, len);
+    dir_unlock(d);
+    if (rc == FS_OK) txn_record(UNDO_WRITE, d, name, NULL, NULL, keep);
+    return rc;
+}
+
+/* 名前が重なったものは作らずに進める。それ以外の失敗で止める */
+static int gen_dir(struct Gen *g, struct Dir *d, int level) {
+    long nfiles = gen_draw(&g->rng, &g->files);
+    long ndirs = level < g->depth ? gen_draw(&g->rng, &g->dirs) : 0;
+    char name[NAME_LEN];
+
+    for (long i = 0; i < nfiles && g->made < g->max; i++) {
+        gen_name(g, name);
+        size_t size = (size_t)gen_draw(&g->rng, &g->size);
+        char *data = gen_text(g, size);
+        int rc = data ? gen_write(d, name, data, size) : FS_NOMEM;
+        if (rc == FS_OK) g->made++;
+        else if (rc != FS_EXIST) return rc;
+    }
+    for (long i = 0; i < ndirs && g->made < g->max; i++) {
+        struct Dir *sub = NULL;
+        gen_name(g, name);
+        int rc = gen_mkdir(d, name, &sub);
+        if (rc == FS_EXIST) continue;
+        if (rc != FS_OK) return rc;
+        g->made++;
+        if ((rc = gen_dir(g, sub, level + 1)) != FS_OK) return rc;
+    }
+    return FS_OK;
+}
+
+static void gen_tree(struct Session *s, char **args) {
+    struct Gen g = {
+        .rng = 1, .depth = 4, .max = 100000,
+        .dirs = { GEN_GEO, 3, 0 }, .files = { GEN_GEO, 6, 0 },
+        .name = { GEN_UNIFORM, 3, 12 }, .size = { GEN_LOG, 2048, 0 },
+    };
+    int bad = !args[0];
+    for (int i = 1; !bad && args[i]; i++) {
+        char *v = strchr(args[i], '=');
+        if (!v) {
+            bad = 1;
+            break;
+        }
+        *v++ = '\0';
+        if (strcmp(args[i], "seed") == 0) g.rng = strtoull(v, NULL, 10);
+        else if (strcmp(args[i], "depth") == 0) bad = (g.depth = atoi(v)) < 0 || g.depth > 32;
+        else if (strcmp(args[i], "max") == 0) bad = (g.max = atol(v)) < 1;
+        else if (strcmp(args[i], "dirs") == 0) bad = gen_dist(v, &g.dirs) < 0;
+        else if (strcmp(args[i], "files") == 0) bad = gen_dist(v, &g.files) < 0;
+        else if (strcmp(args[i], "name") == 0) bad = gen_dist(v, &g.name) < 0;
+        else if (strcmp(args[i], "size") == 0) bad = gen_dist(v, &g.size) < 0;
+        else bad = 1;
+    }
+    if (bad) {
+        fputs("usage: gen tree <dir> [seed=N depth=N max=N dirs=D files=D name=D size=D]\n", out);
+        return;
+    }
+    uint64_t seed = g.rng;
+
+    char name[NAME_LEN];
+    struct Dir *d = resolve_parent(s, args[0], name);
+    struct Dir *top = NULL;
+    int rc = d ? gen_mkdir(d, name, &top) : FS_NOENT;
+    if (rc == FS_OK) rc = gen_dir(&g, top, 1);
+    if (rc != FS_OK) txn_fail();
+
+    switch (rc) {
+    case FS_OK:     break;
+    case FS_NOENT:  fputs(path_msg("no such directory\n"), out); return;
+    case FS_EXIST:  fputs("name already exists\n", out); return;
+    case FS_BUSY:   fputs("directory is locked by a transaction\n", out); break;
+    case FS_RDONLY: fputs("snapshot is read-only\n", out); return;
+    case FS_ACCES:  fputs("permission denied\n", out); break;
+    default:        fputs("memory error\n", out); break;
+    }
+    if (!top) return;
+
+    struct Usage u;
+    usage_get(top, &u);
+    fprintf(out, "generated '%s': %llu dirs, %llu files, %llu bytes (seed %llu)\n", args[0],
+            (unsigned long long)u.dirs + 1, (unsigned long long)u.files,
+            (unsigned long long)u.bytes, (unsigned long long)seed);
+}
+
+/* ----- 操作列 ----- */
+
+enum {
+    GOP_LS,
+    GOP_CAT,
+    GOP_WRITE,
+    GOP_TOUCH,
+    GOP_RM,
+    GOP_MV,
+    GOP_COUNT,
+};
+
+static const char *const gen_op_names[GOP_COUNT] = { "ls", "cat", "write", "touch", "rm", "mv" };
+
+/* 操作の対象になるディレクトリ。own は操作列が作ったファイル（t 番号）で、rm と mv はこれだけを使う */
+struct GenTarget {
+    struct Dir *dir;
+    char *path;
+    long *own;
+    size_t nown, cap;
+};
+
+struct GenOps {
+    struct GenTarget *t;
+    size_t n, cap;
+    int err;
+};
+
+static void gen_collect(struct GenOps *go, struct Dir *d) {
+    if (go->err || dir_ready(d) < 0) return;
+
+    char path[PATH_LEN];
+    if (dir_path(d, path, sizeof(path)) == 0 && strlen(path) <= GEN_LINE_MAX) {
+        if (grow(&go->t, &go->cap, go->n + 1, sizeof(*go->t)) < 0) {
+            go->err = 1;
+            return;
+        }
+        struct GenTarget *t = &go->t[go->n];
+        memset(t, 0, sizeof(*t));
+        t->dir = d;
+        /* ルートは "" にして、後ろに "/名前" を付けるだけで済ませる */
+        t->path = strdup(strcmp(path, "/") == 0 ? "" : path);
+        if (!t->path) {
+            go->err = 1;
+            return;
+        }
+        go->n++;
+    }
+
+    int n;
+    struct Slots *ds = dir_list(d, 1, &n);
+    for (int i = 0; i < n; i++) gen_collect(go, slots_at(ds, i));
+}
+
+static int gen_own(struct GenTarget *t, long id) {
+    if (grow(&t->own, &t->cap, t->nown + 1, sizeof(*t->own)) < 0) return -1;
+    t->own[t->nown++] = id;
+    return 0;
+}
+
+/* 1 件分の行を書く。操作できないもの（ファイルのないディレクトリの cat など）は ls にする */
+static int gen_op(FILE *fp, struct GenTarget *t, int op, uint64_t *rng, long *seq) {
+    if (op == GOP_CAT) {
+        int n;
+        struct Slots *fs = dir_list(t->dir, 0, &n);
+        if (n == 0) op = GOP_LS;
+        else {
+            const struct File *f = slots_at(fs, (int)(gen_rand(rng) % (uint64_t)n));
+            return fprintf(fp, "cat %s/%s\n", t->path, f->name) < 0 ? -1 : 0;
+        }
+    }
+    if ((op == GOP_RM || op == GOP_MV) && t->nown == 0) op = GOP_TOUCH;
+
+    size_t k = t->nown ? (size_t)(gen_rand(rng) % t->nown) : 0;
+    switch (op) {
+    case GOP_LS:
+        return fprintf(fp, "ls %s\n", t->path[0] ? t->path : "/") < 0 ? -1 : 0;
+    case GOP_WRITE:
+        return fprintf(fp, "echo %016llx >> %s/w%d\n", (unsigned long long)gen_rand(rng),
+                       t->path, (int)(gen_rand(rng) % 4)) < 0 ? -1 : 0;
+    case GOP_TOUCH:
+        ++*seq;
+        if (gen_own(t, *seq) < 0) return -1;
+        return fprintf(fp, "touch %s/t%ld\n", t->path, *seq) < 0 ? -1 : 0;
+    case GOP_RM:
+        if (fprintf(fp, "rm %s/t%ld\n", t->path, t->own[k]) < 0) return -1;
+        t->own[k] = t->own[--t->nown];
+        return 0;
+    default:
+        ++*seq;
+        if (fprintf(fp, "mv %s/t%ld %s/t%ld\n", t->path, t->own[k], t->path, *seq) < 0) return -1;
+        t->own[k] = *seq;
+        return 0;
+    }
+}
+
+static void gen_ops(struct Session *s, char **args) {
+    uint64_t rng = 1;
+    long n = 1000;
+    double zipf = 1.0;
+    int mix[GOP_COUNT] = { 30, 30, 20, 10, 5, 5 };
+    int bad = !args[0];
+
+    for (int i = 1; !bad && args[i]; i++) {
+        char *v = strchr(args[i], '=');
+        if (!v) {
+            bad = 1;
+            break;
+        }
+        *v++ = '\0';
+        if (strcmp(args[i], "seed") == 0) {
+            rng = strtoull(v, NULL, 10);
+        } else if (strcmp(args[i], "n") == 0) {
+            bad = (n = atol(v)) < 1;
+        } else if (strcmp(args[i], "zipf") == 0) {
+            zipf = strtod(v, NULL);
+            bad = zipf < 0;
+        } else if (strcmp(args[i], "mix") == 0) {
+            /* ls:30,cat:30 のように並べる。書かなかった操作は 0 */
+            memset(mix, 0, sizeof(mix));
+            char *save;
+            for (char *t = strtok_r(v, ",", &save); !bad && t; t = strtok_r(NULL, ",", &save)) {
+                char *w = strchr(t, ':');
+                int op = 0;
+                if (w) *w++ = '\0';
+                while (op < GOP_COUNT && strcmp(gen_op_names[op], t) != 0) op++;
+                bad = !w || op == GOP_COUNT || (mix[op] = atoi(w)) < 0;
+            }
+        } else {
+            bad = 1;
+        }
+    }
+    int total = 0;
+    for (int i = 0; i < GOP_COUNT; i++) total += mix[i];
+    if (bad || total == 0) {
+        fputs("usage: gen ops <hostfile> [seed=N n=N zipf=S mix=ls:30,cat:30,write:20,touch:10,rm:5,mv:5]\n",
+              out);
+        return;
+    }
+    uint64_t seed = rng;
+
+    struct GenOps go = { NULL, 0, 0, 0 };
+    gen_collect(&go, s->cwd);
+    double *cdf = go.n ? malloc(go.n * sizeof(*cdf)) : NULL;
+    FILE *fp = cdf && !go.err ? fopen(args[0], "w") : NULL;
+    int rc = fp ? 0 : -1;
+
+    if (fp) {
+        /* 順位は木の並びと無関係にし、よく使うディレクトリが浅いところに偏らないようにする */
+        for (size_t i = go.n; i > 1; i--) {
+            size_t j = (size_t)(gen_rand(&rng) % i);
+            struct GenTarget tmp = go.t[i - 1];
+            go.t[i - 1] = go.t[j];
+            go.t[j] = tmp;
+        }
+        double sum = 0.0;
+        for (size_t i = 0; i < go.n; i++) {
+            sum += gen_exp(-zipf * gen_ln((double)i + 1.0));
+            cdf[i] = sum;
+        }
+
+        long seq = 0;
+        for (long i = 0; rc == 0 && i < n; i++) {
+            double u = gen_unit(&rng) * sum;
+            size_t lo = 0, hi = go.n - 1;
+            while (lo < hi) {
+                size_t mid = (lo + hi) / 2;
+                if (cdf[mid] < u) lo = mid + 1;
+                else hi = mid;
+            }
+            int w = (int)(gen_rand(&rng) % (uint64_t)total), op = 0;
+            while (w >= mix[op]) w -= mix[op++];
+            rc = gen_op(fp, &go.t[lo], op, &rng, &seq);
+        }
+        if (fclose(fp) != 0) rc = -1;
+    }
+
+    if (!go.err && go.n == 0) fputs("no directories to use\n", out);
+    else if (!cdf || go.err) fputs("memory error\n", out);
+    else if (rc < 0) perror(args[0]);
+    else fprintf(out, "wrote %ld operations over %zu directories to '%s' (seed %llu)\n",
+                 n, go.n, args[0], (unsigned long long)seed);
+
+    for (size_t i = 0; i < go.n; i++) {
+        free(go.t[i].path);
+        free(go.t[i].own);
+    }
+    free(go.t);
+    free(cdf);
+}
+
+/* gen tree <dir> [key=value ...] | gen ops <hostfile> [key=value ...] */
+static void gen_cmd(struct Session *s, char **args) {
+    if (args[0] && strcmp(args[0], "tree") == 0) gen_tree(s, args + 1);
+    else if (args[0] && strcmp(args[0], "ops") == 0) gen_ops(s, args + 1);
+    else fputs("usage: gen tree <dir> [key=value ...] | gen ops <hostfile> [key=value ...]\n", out);
+}
+
+static void history_add(struct Session *s, const char *line) {
+    if (line[strspn(line, " ")] == '\0') return;
+    if (!s->hist && !(s->hist = calloc(1, sizeof(*s->hist)))) return;
+
+    struct History *h = s->hist;
+    snprintf(h->line[h->next % HISTORY_LEN], LINE_LEN, "%s", line);
+    h->next++;
+}
+
+/* 閉じていないトランザクションは取り消す */
+static void session_free(struct Session *s) {
+    free(s->hist);
+    s->hist = NULL;
+    if (s->txn) txn_end(s->txn, 0);
+    s->txn = NULL;
+    link_flush();
+}
+
+/* history -w の出力はそのまま replay に渡せる */
+static void history_cmd(struct Session *s, char **argv) {
+    FILE *fp = out;
+    if (argv[1] && (strcmp(argv[1], "-w") != 0 || !argv[2])) {
+        fputs("usage: history [-w hostfile]\n", out);
+        return;
+    }
+    if (argv[1] && !(fp = fopen(argv[2], "w"))) {
+        fputs("cannot write host file\n", out);
+        return;
+    }
+
+    const struct History *h = s->hist;
+    int n = h ? h->next : 0;
+    for (int i = n > HISTORY_LEN ? n - HISTORY_LEN : 0; i < n; i++) {
+        if (fp == out) fprintf(out, "%5d  %s\n", i + 1, h->line[i % HISTORY_LEN]);
+        else fprintf(fp, "%s\n", h->line[i % HISTORY_LEN]);
+    }
+
+    if (fp != out) {
+        if (fclose(fp) != 0) fputs("cannot write host file\n", out);
+        else fprintf(out, "history written to '%s'\n", argv[2]);
+    }
+}
+
+static void save_cmd(struct Dir *root, const char *path) {
+    if (!path) {
+        fputs("usage: save <image>\n", out);
+        return;
+    }
+
+    if (write_image(root, path) < 0) {
+        fputs("save failed\n", out);
+        return;
+    }
+
+    fprintf(out, "image '%s' saved\n", path);
+}
+
+/* ===== コマンドの振り分け =====
+ * 行は空白で argv に分け、コマンド名を CMD_* に引いてから実行する。
+ * exit / sync / replay / begin / commit / rollback は 1 つのコマンドより外側に効くので、
+ * ここでは扱わない。 */
+#define ARGS_MAX 16             /* コマンド名を含む。超えた分は捨てる */
+
+enum {
+    CMD_UNKNOWN = 0,
+    CMD_PWD,
+    CMD_LS,
+    CMD_TOUCH,
+    CMD_RM,
+    CMD_MV,
+    CMD_MKDIR,
+    CMD_CD,
+    CMD_CAT,
+    CMD_ECHO,
+    CMD_GREP,
+    CMD_WC,
+    CMD_FIND,
+    CMD_SAVE,
+    CMD_IMPORT,
+    CMD_DU,
+    CMD_DF,
+    CMD_EXPORT,
+    CMD_EXIT,
+    CMD_SYNC,
+    CMD_REPLAY,
+    CMD_HISTORY,
+    CMD_BEGIN,
+    CMD_COMMIT,
+    CMD_ROLLBACK,
+    CMD_SNAPSHOT,
+    CMD_DIFF,
+    CMD_DEDUP,
+    CMD_COMPRESS,
+    CMD_GEN,
+    CMD_STATS,
+    CMD_MEMSTAT,
+    CMD_TRACE,
+    CMD_LN,
+    CMD_READLINK,
+    CMD_CHMOD,
+    CMD_CHOWN,
+    CMD_UMASK,
+    CMD_SU,
+    CMD_ID,
+    CMD_STAT,
+    CMD_ATIME,
+    CMD_LINE,                   /* パイプラインなど、行のまま実行するもの（再生用） */
+};
+
+static const struct {
+    const char *name;
+    int id;
+} commands[] = {
+    { "pwd", CMD_PWD }, { "pwt", CMD_PWD }, { "ls", CMD_LS },
+    { "touch", CMD_TOUCH }, { "rm", CMD_RM }, { "mv", CMD_MV },
+    { "mkdir", CMD_MKDIR }, { "cd", CMD_CD }, { "cat", CMD_CAT },
+    { "echo", CMD_ECHO }, { "grep", CMD_GREP }, { "wc", CMD_WC },
+    { "find", CMD_FIND }, { "save", CMD_SAVE }, { "import", CMD_IMPORT },
+    { "du", CMD_DU }, { "df", CMD_DF }, { "export", CMD_EXPORT },
+    { "exit", CMD_EXIT }, { "sync", CMD_SYNC }, { "replay", CMD_REPLAY },
+    { "history", CMD_HISTORY }, { "begin", CMD_BEGIN }, { "commit", CMD_COMMIT },
+    { "rollback", CMD_ROLLBACK }, { "snapshot", CMD_SNAPSHOT },
+    { "diff", CMD_DIFF }, { "dedup", CMD_DEDUP }, { "compress", CMD_COMPRESS },
+    { "gen", CMD_GEN }, { "stats", CMD_STATS }, { "memstat", CMD_MEMSTAT },
+    { "trace", CMD_TRACE }, { "ln", CMD_LN }, { "readlink", CMD_READLINK },
+    { "chmod", CMD_CHMOD }, { "chown", CMD_CHOWN }, { "umask", CMD_UMASK },
+    { "su", CMD_SU }, { "id", CMD_ID }, { "stat", CMD_STAT }, { "atime", CMD_ATIME },
+};
+
+static int command_id(const char *name) {
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+        if (strcmp(commands[i].name, name) == 0) return commands[i].id;
+    }
+    return CMD_UNKNOWN;
+}
+
+static const char *command_name(int id) {
+    if (id == CMD_LINE) return "(line)";
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+        if (commands[i].id == id) return commands[i].name;
+    }
+    return "(unknown)";
+}
+
+/* 空白で区切って argv に入れ、個数を返す。argv は NULL で終わる */
+static int tokenize(char *line, char **argv) {
+    char *save;
+    int argc = 0;
+    for (char *t = strtok_r(line, " ", &save); t && argc < ARGS_MAX; t = strtok_r(NULL, " ", &save)) {
+        argv[argc++] = t;
+    }
+    argv[argc] = NULL;
+    return argc;
+}
+
+/* ===== コマンドごとの統計 =====
+ * exec_command を通るコマンドについて、回数、待ち時間の分布、読み書きした内容のバイト数、
+ * 確保の回数を数える。分布は HDR 風の対数・線形の桶で持ち、2 のべきの区間を
+ * 2^STAT_SUB_BITS に分ける（相対誤差 12.5% 以内）。桶はスレッドをまたいで原子的に足す。
+ * stats で表示し、-t を付けて起動すれば終了時に stderr へ出す。
+ * -DNO_STATS でビルドすると計測のコードごと外れる。 */
+#define STAT_SUB_BITS 3
+#define STAT_BUCKETS  512       /* 2^64 ns まで */
+
+struct CmdStat {
+    uint64_t calls, ns, max;
+    uint64_t bytes, allocs;
+    uint64_t hist[STAT_BUCKETS];
+};
+
+static int stats_at_exit;
+
+#ifndef NO_STATS
+static struct CmdStat cmd_stats[CMD_LINE + 1];
+
+static int stat_bucket(uint64_t v) {
+    if (v < (1u << STAT_SUB_BITS)) return (int)v;
+    int e = 63 - __builtin_clzll(v);
+    return ((e - STAT_SUB_BITS + 1) << STAT_SUB_BITS) +
+           (int)((v >> (e - STAT_SUB_BITS)) & ((1u << STAT_SUB_BITS) - 1));
+}
+
+/* 桶の上端 */
+static uint64_t stat_bucket_max(int i) {
+    if (i < (1 << STAT_SUB_BITS)) return (uint64_t)i;
+    int e = (i >> STAT_SUB_BITS) + STAT_SUB_BITS - 1;
+    uint64_t lo = ((uint64_t)(1u << STAT_SUB_BITS) + (uint64_t)(i & ((1 << STAT_SUB_BITS) - 1)))
+                  << (e - STAT_SUB_BITS);
+    return lo + ((uint64_t)1 << (e - STAT_SUB_BITS)) - 1;
+}
+
+static void stat_record(int id, uint64_t ns, uint64_t bytes, uint64_t allocs) {
+    struct CmdStat *c = &cmd_stats[id];
+    __atomic_add_fetch(&c->calls, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->ns, ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->allocs, allocs, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->hist[stat_bucket(ns)], 1, __ATOMIC_RELAXED);
+
+    uint64_t m = __atomic_load_n(&c->max, __ATOMIC_RELAXED);
+    while (ns > m && !__atomic_compare_exchange_n(&c->max, &m, ns, 1,
+                                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+/* q の分位点を含む桶の上端（最大値を超えない）。桶の合計が calls より少し遅れていても構わない */
+static uint64_t stat_percentile(const struct CmdStat *c, uint64_t calls, double q) {
+    uint64_t want = (uint64_t)((double)calls * q), seen = 0;
+    uint64_t max = __atomic_load_n(&c->max, __ATOMIC_RELAXED);
+    if (want < 1) want = 1;
+    for (int i = 0; i < STAT_BUCKETS; i++) {
+        seen += __atomic_load_n(&c->hist[i], __ATOMIC_RELAXED);
+        if (seen >= want) return stat_bucket_max(i) < max ? stat_bucket_max(i) : max;
+    }
+    return max;
+}
+
+static void stats_print(FILE *fp) {
+    fprintf(fp, "%-10s %8s %10s %9s %9s %9s %9s %10s %12s %8s\n", "command", "calls", "total_ms",
+            "mean_us", "p50_us", "p99_us", "p999_us", "max_us", "bytes", "allocs");
+    for (int id = 0; id <= CMD_LINE; id++) {
+        const struct CmdStat *c = &cmd_stats[id];
+        uint64_t calls = __atomic_load_n(&c->calls, __ATOMIC_RELAXED);
+        if (calls == 0) continue;
+        uint64_t ns = __atomic_load_n(&c->ns, __ATOMIC_RELAXED);
+        fprintf(fp, "%-10s %8llu %10.3f %9.2f %9.2f %9.2f %9.2f %10.2f %12llu %8llu\n",
+                command_name(id), (unsigned long long)calls, (double)ns / 1e6,
+                (double)ns / 1e3 / (double)calls,
+                (double)stat_percentile(c, calls, 0.50) / 1e3,
+                (double)stat_percentile(c, calls, 0.99) / 1e3,
+                (double)stat_percentile(c, calls, 0.999) / 1e3,
+                (double)__atomic_load_n(&c->max, __ATOMIC_RELAXED) / 1e3,
+                (unsigned long long)__atomic_load_n(&c->bytes, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&c->allocs, __ATOMIC_RELAXED));
+    }
+}
+
+/* stats [reset] */
+static void stats_cmd(const char *opt) {
+    if (opt && strcmp(opt, "reset") != 0) {
+        fputs("usage: stats [reset]\n", out);
+        return;
+    }
+    if (!opt) {
+        stats_print(out);
+        return;
+    }
+
+    /* 数えている途中の分は、消す前と後のどちらかに入る */
+    for (int id = 0; id <= CMD_LINE; id++) {
+        uint64_t *p = (uint64_t *)&cmd_stats[id];
+        for (size_t i = 0; i < sizeof(struct CmdStat) / sizeof(uint64_t); i++) {
+            __atomic_store_n(&p[i], 0, __ATOMIC_RELAXED);
+        }
+    }
+    fputs("stats reset\n", out);
+}
+#else
+static void stats_print(FILE *fp) {
+    fputs("stats are disabled (built with -DNO_STATS)\n", fp);
+}
+
+static void stats_cmd(const char *opt) {
+    (void)opt;
+    stats_print(out);
+}
+#endif
+
+/* ----- トレースの操作 -----
+ * trace [on|off|dump <hostfile>]。書き出しは記録を止めずに行い、リングは消さない */
+static void trace_cmd(const char *opt, const char *file) {
+    if (!opt) {
+        uint64_t spans = 0;
+        for (struct TraceRing *r = __atomic_load_n(&trace.rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+            spans += __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        }
+        fprintf(out, "trace %s: %llu spans recorded in %d threads\n",
+                __atomic_load_n(&trace.on, __ATOMIC_RELAXED) ? "on" : "off",
+                (unsigned long long)spans, __atomic_load_n(&trace.nrings, __ATOMIC_RELAXED));
+        return;
+    }
+    if (strcmp(opt, "on") == 0 || strcmp(opt, "off") == 0) {
+        int on = strcmp(opt, "on") == 0;
+        uint64_t zero = 0;
+        if (on) __atomic_compare_exchange_n(&trace.t0, &zero, trace_now(), 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+        __atomic_store_n(&trace.on, on, __ATOMIC_RELAXED);
+        fprintf(out, "trace %s\n", opt);
+        return;
+    }
+    if (strcmp(opt, "dump") != 0 || !file) {
+        fputs("usage: trace [on|off|dump <hostfile>]\n", out);
+        return;
+    }
+
+    long n = trace_dump(file);
+    if (n < 0) perror(file);
+    else fprintf(out, "wrote %ld spans to '%s'\n", n, file);
+}
+
+/* セッション全体に効くもの以外のコマンドを実行する。argv[0] はコマンド名 */
+static void dispatch(struct Session *s, int id, char **argv) {
+    char **a = argv + 1;
+    epoch_enter();
+
+    switch (id) {
+    case CMD_PWD:    pwd_cmd(s); break;
+    case CMD_LS:     ls_cmd(s, a[0], a[0] ? a[1] : NULL); break;
+    case CMD_TOUCH:  touch_cmd(s, a[0]); break;
+    case CMD_RM:     rm_cmd(s, a[0]); break;
+    case CMD_MV:     mv_cmd(s, a[0], a[0] ? a[1] : NULL); break;
+    case CMD_LN:
+        if (a[0] && strcmp(a[0], "-s") == 0) symlink_cmd(s, a[1], a[1] ? a[2] : NULL);
+        else ln_cmd(s, a[0], a[0] ? a[1] : NULL);
+        break;
+    case CMD_READLINK: readlink_cmd(s, a[0]); break;
+    case CMD_CHMOD:  chmod_cmd(s, a[0], a[0] ? a[1] : NULL); break;
+    case CMD_CHOWN:  chown_cmd(s, a[0], a[0] ? a[1] : NULL); break;
+    case CMD_UMASK:  umask_cmd(s, a[0]); break;
+    case CMD_SU:     su_cmd(s, a[0], a[0] ? a[1] : NULL); break;
+    case CMD_ID:     id_cmd(s); break;
+    case CMD_STAT:   stat_cmd(s, a[0]); break;
+    case CMD_ATIME:  atime_cmd(a[0]); break;
+    case CMD_MKDIR:  mkdir_cmd(s, a[0]); break;
+    case CMD_CD:     cd_cmd(s, a[0]); break;
+    case CMD_CAT:    cat_cmd(s, a[0]); break;
+    case CMD_ECHO:   echo_cmd(a); break;
+    case CMD_GREP:   grep_cmd(s, a[0], a[0] ? a[1] : NULL); break;
+    case CMD_WC:     wc_cmd(s, a[0]); break;
+    case CMD_FIND:   find_cmd(s, a); break;
+    case CMD_SAVE:   save_cmd(s->root, a[0]); break;
+    case CMD_IMPORT: import_cmd(s, a[0], a[0] ? a[1] : NULL); break;
+    case CMD_DU: {
+        int n = 0;
+        while (n < 4 && a[n]) n++;
+        du_cmd(s, a, n);
+        break;
+    }
+    case CMD_DF:     df_cmd(s->root, a[0]); break;
+    case CMD_EXPORT: export_cmd(s, a[0], a[0] ? a[1] : NULL); break;
+    case CMD_HISTORY: history_cmd(s, argv); break;
+    case CMD_SNAPSHOT: snapshot_cmd(a[0]); break;
+    case CMD_DIFF:   diff_cmd(s, a[0], a[0] ? a[1] : NULL); break;
+    case CMD_DEDUP:  dedup_cmd(a[0]); break;
+    case CMD_COMPRESS: compress_cmd(s->root, a[0], a[0] ? a[1] : NULL); break;
+    case CMD_GEN:    gen_cmd(s, a); break;
+    case CMD_STATS:  stats_cmd(a[0]); break;
+    case CMD_MEMSTAT: memstat_cmd(a[0]); break;
+    case CMD_TRACE:  trace_cmd(a[0], a[0] ? a[1] : NULL); break;
+    default:         fputs("command not found\n", out); break;
+    }
+
+    epoch_exit();
+}
+
+/* ===== パイプラインとリダイレクト =====
+ * "a | b | c > file" の各段を別スレッドで同時に走らせ、段の間は固定長の
+ * リングバッファでつなぐ。コマンドからは out / in の FILE に見えるので、
+ * 大きな出力も途中で丸ごと溜めずに流れる。最後の段は呼び出し元のスレッドで
+ * 実行し、セッション（cwd）を変えられるのもこの段だけ。
+ * リダイレクト先へは最後の段の出力を溜め、終わってから 1 回で差し替える。 */
+#define PIPE_STAGES 8
+#define PIPE_LEN    (64 * 1024)
+
+struct Pipe {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint64_t head, tail;        /* 読んだ位置と書いた位置（通算） */
+    int reader_gone;
+    int writer_gone;
+    char buf[PIPE_LEN];
+};
+
+struct Stage {
+    struct Session s;
+    char *line;
+    FILE *in, *out;
+    pthread_t tid;
+    int started;
+};
+
+/* 読み手がいなくなったら書いた分だけ返し、残りは捨てる */
+static ssize_t pipe_write(void *cookie, const char *p, size_t n) {
+    struct Pipe *pp = cookie;
+    size_t done = 0;
+
+    pthread_mutex_lock(&pp->lock);
+    while (done < n && !pp->reader_gone) {
+        size_t room = PIPE_LEN - (size_t)(pp->tail - pp->head);
+        if (room == 0) {
+            pthread_cond_wait(&pp->cond, &pp->lock);
+            continue;
+        }
+        size_t off = (size_t)(pp->tail % PIPE_LEN);
+        size_t k = n - done;
+        if (k > room) k = room;
+        if (k > PIPE_LEN - off) k = PIPE_LEN - off;
+        memcpy(pp->buf + off, p + done, k);
+        pp->tail += k;
+        done += k;
+        pthread_cond_broadcast(&pp->cond);
+    }
+    pthread_mutex_unlock(&pp->lock);
+    return done > 0 ? (ssize_t)done : -1;
+}
+
+static ssize_t pipe_read(void *cookie, char *p, size_t n) {
+    struct Pipe *pp = cookie;
+
+    pthread_mutex_lock(&pp->lock);
+    while (pp->tail == pp->head && !pp->writer_gone) {
+        pthread_cond_wait(&pp->cond, &pp->lock);
+    }
+    size_t avail = (size_t)(pp->tail - pp->head);
+    size_t off = (size_t)(pp->head % PIPE_LEN);
+    size_t k = n < avail ? n : avail;
+    if (k > PIPE_LEN - off) k = PIPE_LEN - off;
+    memcpy(p, pp->buf + off, k);
+    pp->head += k;
+    pthread_cond_broadcast(&pp->cond);
+    pthread_mutex_unlock(&pp->lock);
+    return (ssize_t)k;
+}
+
+static int pipe_close_end(struct Pipe *pp, int *gone) {
+    pthread_mutex_lock(&pp->lock);
+    *gone = 1;
+    pthread_cond_broadcast(&pp->cond);
+    pthread_mutex_unlock(&pp->lock);
+    return 0;
+}
+
+static int pipe_close_w(void *cookie) {
+    struct Pipe *pp = cookie;
+    return pipe_close_end(pp, &pp->writer_gone);
+}
+
+static int pipe_close_r(void *cookie) {
+    struct Pipe *pp = cookie;
+    return pipe_close_end(pp, &pp->reader_gone);
+}
+
+static struct Pipe *pipe_new(void) {
+    struct Pipe *pp = malloc(sizeof(*pp));
+    if (!pp) return NULL;
+    pthread_mutex_init(&pp->lock, NULL);
+    pthread_cond_init(&pp->cond, NULL);
+    pp->head = pp->tail = 0;
+    pp->reader_gone = pp->writer_gone = 0;
+    return pp;
+}
+
+static void pipe_free(struct Pipe *pp) {
+    if (!pp) return;
+    pthread_mutex_destroy(&pp->lock);
+    pthread_cond_destroy(&pp->cond);
+    free(pp);
+}
+
+static void stage_run(struct Stage *st) {
+    in = st->in;
+    out = st->out;
+    txn = st->s.txn;
+    view = st->s.snap;
+    cred = st->s.cred;
+    clock_tick();
+
+    char *argv[ARGS_MAX + 1];
+    if (tokenize(st->line, argv) == 0) return;
+
+    /* 段のコマンドはそれぞれのスレッドで区間にする（行全体は exec_command が取る） */
+    int id = command_id(argv[0]);
+    uint64_t span = __atomic_load_n(&trace.on, __ATOMIC_RELAXED) ? trace_now() : 0;
+    dispatch(&st->s, id, argv);
+    link_flush();
+    if (span) trace_end(command_name(id), span);
+}
+
+/* 書き終えたら出力を閉じて後段へ終わりを伝え、入力も閉じて前段を止めないようにする */
+static void *stage_main(void *arg) {
+    struct Stage *st = arg;
+    stage_run(st);
+    fclose(st->out);
+    if (st->in) fclose(st->in);
+    epoch_thread_exit();
+    trace_thread_exit();
+    return NULL;
+}
+
+/* "| " で段に、最後の段は "> file" / ">> file" で出力先に分ける */
+static int pipeline_parse(char *line, char **part, int *n, char **target, int *append) {
+    *n = 0;
+    *target = NULL;
+    *append = 0;
+
+    for (char *p = line;;) {
+        if (*n == PIPE_STAGES) return -1;
+        part[(*n)++] = p;
+        char *bar = strchr(p, '|');
+        if (!bar) break;
+        *bar = '\0';
+        p = bar + 1;
+    }
+    for (int i = 0; i < *n - 1; i++) {
+        if (strchr(part[i], '>')) return -1;
+    }
+
+    char *gt = strchr(part[*n - 1], '>');
+    if (gt) {
+        *gt = '\0';
+        *append = gt[1] == '>';
+        char *save;
+        *target = strtok_r(gt + 1 + *append, " ", &save);
+        if (!*target || strchr(*target, '>') || strtok_r(NULL, " ", &save)) return -1;
+    }
+
+    for (int i = 0; i < *n; i++) {
+        if (part[i][strspn(part[i], " ")] == '\0') return -1;
+    }
+    return 0;
+}
+
+static void redirect_write(struct Dir *d, const char *name, const char *target,
+                           char *data, size_t len, int append) {
+    if (dir_lock(d) < 0) {
+        free(data);
+        txn_fail();
+        fputs("memory error\n", out);
+        return;
+    }
+
+    /* リンクされたファイルは inode も押さえ、名前をまたいで書いた順とジャーナルの順を揃える */
+    struct File *keep = NULL;
+    const struct File *cur = find_file(d, name);
+    struct Inode *ino = cur ? cur->ino : NULL;
+    if (ino) pthread_mutex_lock(&ino->lock);
+    int rc = (cur ? file_bits(cur) : dir_bits(d)) & MAY_W ? txn_claim(d) : FS_ACCES;
+    if (rc == FS_OK) {
+        rc = fs_write(d, name, data, len, append, txn ? &keep : NULL);
+    } else {
+        free(data);
+    }
+    if (rc == FS_OK) {
+        /* 記録するのは今回書いた分だけ（append なら末尾） */
+        const struct File *f = find_file(d, name);
+        journal_append(append ? OP_APPEND : OP_WRITE, d, name, NULL, NULL,
+                       f->content + f->size - len, len);
+    }
+    if (ino) pthread_mutex_unlock(&ino->lock);
+    dir_unlock(d);
+
+    if (rc == FS_OK) txn_record(UNDO_WRITE, d, name, NULL, NULL, keep);
+    else txn_fail();
+    switch (rc) {
+    case FS_OK:    break;
+    case FS_EXIST: fprintf(out, "'%s' is a directory\n", target); break;
+    case FS_BUSY:  fputs("directory is locked by a transaction\n", out); break;
+    case FS_RDONLY: fputs("snapshot is read-only\n", out); break;
+    case FS_ACCES: fputs("permission denied\n", out); break;
+    default:       fputs("memory error\n", out); break;
+    }
+}
+
+static void run_pipeline(struct Session *s, char *line) {
+    char *part[PIPE_STAGES], *target;
+    int n, append;
+    if (pipeline_parse(line, part, &n, &target, &append) < 0) {
+        fputs("syntax error\n", out);
+        return;
+    }
+
+    epoch_enter();
+
+    /* 出力先のディレクトリは先に確かめる（ディレクトリは消えないので後でも有効）。
+     * シンボリックリンクならリンク先へ書く */
+    char name[NAME_LEN];
+    struct Dir *d = NULL;
+    if (target && !(d = resolve_file(s, target, name))) {
+        txn_fail();
+        fputs(path_msg("no such directory\n"), out);
+        epoch_exit();
+        return;
+    }
+    /* "@名前/..." なら解決した版を覚えておき、書くときに戻す（段の実行で版が替わるため） */
+    const struct Snapshot *target_view = view;
+
+    FILE *saved_in = in, *saved_out = out;
+    char *buf = NULL;
+    size_t blen = 0;
+    FILE *sink = target ? open_memstream(&buf, &blen) : out;
+
+    struct Stage st[PIPE_STAGES];
+    struct Pipe *pipes[PIPE_STAGES - 1] = { NULL };
+    int ok = sink != NULL;
+    memset(st, 0, sizeof(st));
+    for (int i = 0; i < n; i++) {
+        st[i].s = *s;
+        st[i].line = part[i];
+    }
+    st[n - 1].out = sink;
+
+    for (int i = 0; ok && i < n - 1; i++) {
+        static const cookie_io_functions_t wio = { NULL, pipe_write, NULL, pipe_close_w };
+        static const cookie_io_functions_t rio = { pipe_read, NULL, NULL, pipe_close_r };
+        pipes[i] = pipe_new();
+        if (!pipes[i]) {
+            ok = 0;
+            break;
+        }
+        st[i].out = fopencookie(pipes[i], "w", wio);
+        st[i + 1].in = fopencookie(pipes[i], "r", rio);
+        if (!st[i].out || !st[i + 1].in) ok = 0;
+    }
+
+    /* 前段を起動する。起動できなかった段は何も出さずに終わったものとして扱う */
+    for (int i = 0; ok && i < n - 1; i++) {
+        if (thread_create(&st[i].tid, stage_main, &st[i]) == 0) {
+            st[i].started = 1;
+        } else {
+            ok = 0;
+        }
+    }
+    for (int i = 0; i < n - 1; i++) {
+        if (st[i].started) continue;
+        if (st[i].out) fclose(st[i].out);
+        if (st[i].in) fclose(st[i].in);
+    }
+
+    if (ok) {
+        stage_run(&st[n - 1]);
+        *s = st[n - 1].s;
+    }
+    if (st[n - 1].in) fclose(st[n - 1].in);
+    in = saved_in;
+    out = saved_out;
+
+    /* パイプの読み側は次の段が閉じるので、全段を待ってから解放する */
+    for (int i = 0; i < n - 1; i++) {
+        if (st[i].started) pthread_join(st[i].tid, NULL);
+    }
+    for (int i = 0; i < n - 1; i++) pipe_free(pipes[i]);
+
+    if (!ok) fputs("memory error\n", out);
+    if (target && sink) {
+        fclose(sink);
+        const struct Snapshot *cur = view;
+        view = target_view;
+        if (ok) redirect_write(d, name, target, buf, blen, append);
+        else free(buf);
+        view = cur;
+    }
+    epoch_exit();
+}
+
+/* シャードの上ではチェックポイントを受付スレッドが取るので、読みロックも後始末もしない */
+static void run_command(struct Session *s, int id, char **argv) {
+    if (id == CMD_EXIT) {
+        s->done = 1;
+        return;
+    }
+
+    /* チェックポイントは自分で全体を止めるので、読みロックの外で実行する */
+    if (id == CMD_SYNC) {
+        if (self_shard && journal.fd >= 0) {
+            journal_request_checkpoint();
+            fputs("checkpoint scheduled\n", out);
+        } else {
+            sync_cmd();
+        }
+        return;
+    }
+
+    /* begin も読みロックの中で数え、チェックポイントと行き違わないようにする */
+    int locked = journal.fd >= 0 && !self_shard;
+    struct Txn *saved = txn;
+    const struct Snapshot *saved_view = view;
+    struct Cred saved_cred = cred;
+    txn = s->txn;
+    view = s->snap;
+    cred = s->cred;
+    clock_tick();
+    if (locked) pthread_rwlock_rdlock(&checkpoint_lock);
+    switch (id) {
+    case CMD_LINE:     run_pipeline(s, argv[0]); break;
+    case CMD_BEGIN:    begin_cmd(s); break;
+    case CMD_COMMIT:   commit_cmd(s); break;
+    case CMD_ROLLBACK: rollback_cmd(s); break;
+    default:           dispatch(s, id, argv); break;
+    }
+    txn = s->txn;
+    link_flush();
+    txn = saved;
+    view = saved_view;
+    cred = saved_cred;
+    if (locked) {
+        pthread_rwlock_unlock(&checkpoint_lock);
+        journal_maintain();
+    }
+}
+
+/* コマンドを 1 つ実行する。CMD_LINE なら argv[0] は行そのもの。
+ * コマンドごとの統計とトレースの区間はここで取る */
+static void exec_command(struct Session *s, int id, char **argv) {
+    uint64_t span = __atomic_load_n(&trace.on, __ATOMIC_RELAXED) ? trace_now() : 0;
+#ifdef NO_STATS
+    run_command(s, id, argv);
+#else
+    uint64_t allocs = stat_allocs, bytes = stat_bytes;
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    run_command(s, id, argv);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    stat_record(id, (uint64_t)((t1.tv_sec - t0.tv_sec) * 1000000000ll + (t1.tv_nsec - t0.tv_nsec)),
+                stat_bytes - bytes, stat_allocs - allocs);
+#endif
+    if (span) trace_end(command_name(id), span);
+}
+
+/* ===== スクリプトの再生 =====
+ * replay はホスト上のスクリプトを一度だけ解析して命令列（コマンド番号と、
+ * 重複を除いて 1 か所に並べた引数の Atom）に変え、行の分割やコマンド名の
+ * 照合をせずに何度でも実行する。パスの解決結果は Atom ごとに覚える（パス解決を参照）。
+ * スクリプトはセッションの複製で走らせ、cd や exit は呼び出し元に影響しない。 */
+struct Insn {
+    uint16_t cmd;               /* CMD_* */
+    uint16_t argc;              /* コマンド名を含む */
+    uint32_t arg;               /* Plan.args の先頭 */
+};
+
+struct Plan {
+    struct Insn *code;
+    size_t ncode, code_cap;
+    uint32_t *args;             /* pool 内の Atom の位置 */
+    size_t nargs, args_cap;
+    char *pool;                 /* Atom を詰めて並べる */
+    size_t pool_len, pool_cap;
+    uint32_t *intern;           /* 構築中の重複除去表。位置 + 1、0 は空き */
+    size_t intern_cap, natoms;
+};
+
+static void plan_free(struct Plan *pl) {
+    free(pl->code);
+    free(pl->args);
+    free(pl->pool);
+    free(pl->intern);
+    memset(pl, 0, sizeof(*pl));
+}
+
+/* 同じ文字列は 1 つの Atom にまとめ、その位置を返す。失敗したら UINT32_MAX */
+static uint32_t plan_intern(struct Plan *pl, const char *str) {
+    const size_t hdr = offsetof(struct Atom, s);
+
+    if (pl->natoms * 2 >= pl->intern_cap) {
+        size_t cap = pl->intern_cap ? pl->intern_cap * 2 : 256;
+        uint32_t *t = calloc(cap, sizeof(*t));
+        if (!t) return UINT32_MAX;
+        for (size_t i = 0; i < pl->intern_cap; i++) {
+            uint32_t v = pl->intern[i];
+            if (!v) continue;
+            const char *k = pl->pool + v - 1 + hdr;
+            size_t j = fnv1a(k, strlen(k)) & (cap - 1);
+            while (t[j]) j = (j + 1) & (cap - 1);
+            t[j] = v;
+        }
+        free(pl->intern);
+        pl->intern = t;
+        pl->intern_cap = cap;
+    }
+
+    size_t len = strlen(str);
+    size_t j = fnv1a(str, len) & (pl->intern_cap - 1);
+    for (; pl->intern[j]; j = (j + 1) & (pl->intern_cap - 1)) {
+        uint32_t off = pl->intern[j] - 1;
+        if (strcmp(pl->pool + off + hdr, str) == 0) return off;
+    }
+
+    const size_t align = _Alignof(struct Atom);
+    size_t size = (hdr + len + 1 + align - 1) / align * align;
+    size_t off = pl->pool_len;
+    if (off + size >= UINT32_MAX || grow(&pl->pool, &pl->pool_cap, off + size, 1) < 0) {
+        return UINT32_MAX;
+    }
+
+    struct Atom *a = (struct Atom *)(pl->pool + off);
+    memset(a, 0, hdr);
+    a->magic = ATOM_MAGIC;
+    memcpy(a->s, str, len + 1);
+    pl->pool_len += size;
+    pl->intern[j] = (uint32_t)off + 1;
+    pl->natoms++;
+    return (uint32_t)off;
+}
+
+static int plan_emit(struct Plan *pl, int cmd, char **argv, int argc) {
+    if (grow(&pl->code, &pl->code_cap, pl->ncode + 1, sizeof(struct Insn)) < 0 ||
+        grow(&pl->args, &pl->args_cap, pl->nargs + (size_t)argc, sizeof(uint32_t)) < 0) {
+        return -1;
+    }
+
+    struct Insn *in_ = &pl->code[pl->ncode];
+    in_->cmd = (uint16_t)cmd;
+    in_->argc = (uint16_t)argc;
+    in_->arg = (uint32_t)pl->nargs;
+    for (int i = 0; i < argc; i++) {
+        uint32_t off = plan_intern(pl, argv[i]);
+        if (off == UINT32_MAX) return -1;
+        pl->args[pl->nargs + (size_t)i] = off;
+    }
+    pl->nargs += (size_t)argc;
+    pl->ncode++;
+    return 0;
+}
+
+/* REPL と同じく 1 行は LINE_LEN で区切り、同じ規則で argv に分ける */
+static int plan_compile(struct Plan *pl, FILE *fp) {
+    char line[LINE_LEN];
+    memset(pl, 0, sizeof(*pl));
+
+    while (fgets(line, sizeof(line), fp)) {
+        trim_newline(line);
+        if (strpbrk(line, "|>")) {
+            char *argv[1] = { line };
+            if (plan_emit(pl, CMD_LINE, argv, 1) < 0) return -1;
+            continue;
+        }
+
+        char *argv[ARGS_MAX + 1];
+        int argc = tokenize(line, argv);
+        if (argc > 0 && plan_emit(pl, command_id(argv[0]), argv, argc) < 0) return -1;
+    }
+
+    /* 引数の置き場はもう動かないので、重複除去表は要らない */
+    free(pl->intern);
+    pl->intern = NULL;
+    pl->intern_cap = 0;
+    return 0;
+}
+
+/* begin / commit / rollback は呼び出し元のセッションに効く（打ち込んだときと同じ） */
+static void plan_run(struct Session *s, const struct Plan *pl) {
+    struct Session run = *s;
+    run.done = 0;
+    atoms.base = pl->pool;
+    atoms.len = pl->pool_len;
+
+    for (size_t i = 0; i < pl->ncode && !run.done; i++) {
+        const struct Insn *op = &pl->code[i];
+        char *argv[ARGS_MAX + 1];
+        for (int k = 0; k < op->argc; k++) {
+            argv[k] = pl->pool + pl->args[op->arg + (uint32_t)k] + offsetof(struct Atom, s);
+        }
+        argv[op->argc] = NULL;
+
+        /* パイプラインは行を書き換えながら分けるので、写しを渡す */
+        char line[LINE_LEN];
+        switch (op->cmd) {
+        case CMD_LINE:
+            snprintf(line, sizeof(line), "%s", argv[0]);
+            argv[0] = line;
+            exec_command(&run, CMD_LINE, argv);
+            break;
+        case CMD_REPLAY:
+            fputs("replay: nested replay is not supported\n", out);
+            break;
+        default:
+            exec_command(&run, op->cmd, argv);
+            break;
+        }
+    }
+
+    atoms.base = NULL;
+    atoms.len = 0;
+    s->txn = run.txn;
+}
+
+static double elapsed_ms(const struct timespec *t0, const struct timespec *t1) {
+    return (double)(t1->tv_sec - t0->tv_sec) * 1e3 + (double)(t1->tv_nsec - t0->tv_nsec) / 1e6;
+}
+
+/* 1 行を実行する。replay の中からも使うので、replay 自体は受け付けない */
+static void exec_line(struct Session *s, char *line) {
+    if (strpbrk(line, "|>")) {
+        char *argv[2] = { line, NULL };
+        exec_command(s, CMD_LINE, argv);
+        return;
+    }
+
+    char *argv[ARGS_MAX + 1];
+    if (tokenize(line, argv) == 0) return;
+
+    int id = command_id(argv[0]);
+    if (id == CMD_REPLAY) fputs("replay: nested replay is not supported\n", out);
+    else exec_command(s, id, argv);
+}
+
+/* replay [-b] <hostfile> [count]
+ * -b では出力を捨て、同じスクリプトを行ごとに解釈する従来の経路と速さを比べる */
+static void replay_cmd(struct Session *s, char **argv) {
+    int bench = argv[1] && strcmp(argv[1], "-b") == 0;
+    const char *path = argv[1 + bench];
+    int count = path && argv[2 + bench] ? atoi(argv[2 + bench]) : 1;
+    if (!path || count < 1) {
+        fputs("usage: replay [-b] <hostfile> [count]\n", out);
+        return;
+    }
+
+    /* 行ごとの経路でも同じ入力を読めるよう、スクリプトは丸ごと読み込む */
+    FILE *fp = fopen(path, "r");
+    char *text = NULL;
+    size_t len = 0;
+    FILE *mem = fp ? open_memstream(&text, &len) : NULL;
+    if (!fp || !mem) {
+        if (fp) fclose(fp);
+        fputs("no such host file\n", out);
+        return;
+    }
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) fwrite(buf, 1, n, mem);
+    fclose(fp);
+    fclose(mem);
+
+    struct Plan pl = { 0 };
+    struct timespec t0, tc, t1, t2, t3;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    FILE *src = fmemopen(text, len, "r");
+    int rc = src ? plan_compile(&pl, src) : -1;
+    if (src) fclose(src);
+    clock_gettime(CLOCK_MONOTONIC, &tc);
+    if (rc < 0) {
+        plan_free(&pl);
+        free(text);
+        fputs("memory error\n", out);
+        return;
+    }
+
+    FILE *saved = out, *null = NULL;
+    if (bench && !(null = fopen("/dev/null", "w"))) bench = 0;
+    if (bench) out = null;
+
+    if (bench) plan_run(s, &pl);        /* 1 回目の変更を済ませ、両者を同じ状態から測る */
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    for (int i = 0; i < count; i++) plan_run(s, &pl);
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+
+    if (bench) {
+        for (int i = 0; i < count; i++) {
+            struct Session run = *s;
+            run.done = 0;
+            FILE *lines = fmemopen(text, len, "r");
+            if (!lines) break;
+            char line[LINE_LEN];
+            while (!run.done && fgets(line, sizeof(line), lines)) {
+                trim_newline(line);
+                exec_line(&run, line);
+            }
+            fclose(lines);
+            s->txn = run.txn;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t3);
+
+    if (bench) {
+        out = saved;
+        fclose(null);
+        double per = (double)pl.ncode * count;
+        double planned = elapsed_ms(&t1, &t2), lined = elapsed_ms(&t2, &t3);
+        fprintf(out, "replay: %zu commands x %d, %zu unique strings\n", pl.ncode, count, pl.natoms);
+        fprintf(out, "  compile       %10.3f ms\n", elapsed_ms(&t0, &tc));
+        fprintf(out, "  line-by-line  %10.3f ms  %8.3f us/cmd\n", lined, per > 0 ? lined * 1e3 / per : 0.0);
+        fprintf(out, "  compiled      %10.3f ms  %8.3f us/cmd  %.2fx\n", planned,
+                per > 0 ? planned * 1e3 / per : 0.0, planned > 0 ? lined / planned : 0.0);
+    }
+
+    plan_free(&pl);
+    free(text);
+}
+
+/* ===== ベンチマーク =====
+ * bench は作業用の木（ルートとは別に作り、終わったら捨てる）で各コマンドを 1 回ずつ計り、
+ * 操作ごとに ops/s、待ち時間の p50 / p99、その時点までの最大 RSS を 1 行で出す。
+ * direct はコマンドの関数を直接、repl は入力行と同じ経路 (exec_line) で呼ぶ。
+ * ディレクトリの大きさと、操作するディレクトリの深さを変えて測る。
+ * 行の組み立ては計測に含めず、コマンドの出力は捨てる。作業用の木はジャーナルに残さない。 */
+#define BENCH_REPEAT 1000       /* cd と pwd の回数。ls はこれを大きさで割る（最低 10 回） */
+
+static const int bench_depths[] = { 1, 4, 16 };
+
+struct Bench {
+    struct Session s;
+    int repl;
+    FILE *null;
+    uint64_t *ns;
+};
+
+static int bench_ns_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* 最大 RSS を KB で返す（macOS の ru_maxrss はバイト） */
+static long bench_maxrss(void) {
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) < 0) return 0;
+#ifdef __APPLE__
+    return ru.ru_maxrss / 1024;
+#else
+    return ru.ru_maxrss;
+#endif
+}
+
+/* 1 行分を実行する。direct ではエポックの区間だけを dispatch と同じように張る */
+static void bench_exec(struct Bench *b, char *line) {
+    if (b->repl) {
+        exec_line(&b->s, line);
+        return;
+    }
+
+    char *argv[ARGS_MAX + 1];
+    if (tokenize(line, argv) == 0) return;
+    char **a = argv + 1;
+    epoch_enter();
+    switch (command_id(argv[0])) {
+    case CMD_TOUCH: touch_cmd(&b->s, a[0]); break;
+    case CMD_MKDIR: mkdir_cmd(&b->s, a[0]); break;
+    case CMD_RM:    rm_cmd(&b->s, a[0]); break;
+    case CMD_MV:    mv_cmd(&b->s, a[0], a[0] ? a[1] : NULL); break;
+    case CMD_CD:    cd_cmd(&b->s, a[0]); break;
+    case CMD_LS:    ls_cmd(&b->s, a[0], NULL); break;
+    case CMD_PWD:   pwd_cmd(&b->s); break;
+    default:        break;
+    }
+    epoch_exit();
+}
+
+/* fmt に arg（NULL なら番号）を入れた行を n 回計り、1 行の結果を出す */
+static void bench_op(struct Bench *b, const char *op, const char *fmt, const char *arg,
+                     int n, int size, int depth) {
+    FILE *saved = out;
+    out = b->null;
+    for (int i = 0; i < n; i++) {
+        char line[LINE_LEN], tmp[LINE_LEN];
+        if (arg) snprintf(tmp, sizeof(tmp), fmt, arg);
+        else snprintf(tmp, sizeof(tmp), fmt, i, i);
+
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        strcpy(line, tmp);
+        bench_exec(b, line);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        b->ns[i] = (uint64_t)((t1.tv_sec - t0.tv_sec) * 1000000000ll + (t1.tv_nsec - t0.tv_nsec));
+    }
+    out = saved;
+
+    uint64_t total = 0;
+    for (int i = 0; i < n; i++) total += b->ns[i];
+    qsort(b->ns, (size_t)n, sizeof(*b->ns), bench_ns_cmp);
+    fprintf(out, "%-6s %-6s %6d %5d %6d %12.0f %10.3f %10.3f %10ld\n",
+            b->repl ? "repl" : "direct", op, size, depth, n,
+            total ? (double)n * 1e9 / (double)total : 0.0,
+            (double)b->ns[n / 2] / 1e3, (double)b->ns[(size_t)n * 99 / 100] / 1e3, bench_maxrss());
+}
+
+/* 新しい作業用の木に深さ depth の鎖を作り、その先で各操作を計る */
+static int bench_tree(struct Bench *b, int size, int depth) {
+    struct Dir *root = create_dir("/", NULL);
+    if (!root) return -1;
+    b->s = (struct Session){ root, root, 0, NULL, NULL, NULL, { 0, 0, UMASK_DEFAULT } };
+
+    char leaf[PATH_LEN] = "";
+    FILE *saved = out;
+    out = b->null;
+    /* leaf は PATH_LEN まで伸びうるので、行もコマンド名の分だけ広く取る */
+    char line[PATH_LEN + 8];
+    for (int i = 0; i < depth; i++) {
+        strcat(leaf, "/d");
+        snprintf(line, sizeof(line), "mkdir %s", leaf);
+        bench_exec(b, line);
+    }
+    snprintf(line, sizeof(line), "cd %s", leaf);
+    bench_exec(b, line);
+    out = saved;
+
+    int reps = BENCH_REPEAT / size > 10 ? BENCH_REPEAT / size : 10;
+    bench_op(b, "touch", "touch f%d", NULL, size, size, depth);
+    bench_op(b, "ls", "ls", NULL, reps, size, depth);
+    bench_op(b, "mv", "mv f%d g%d", NULL, size, size, depth);
+    bench_op(b, "rm", "rm g%d", NULL, size, size, depth);
+    bench_op(b, "mkdir", "mkdir m%d", NULL, size, size, depth);
+    bench_op(b, "cd", "cd %s", leaf, BENCH_REPEAT, size, depth);
+    bench_op(b, "pwd", "pwd", NULL, BENCH_REPEAT, size, depth);
+
+    free_dir(root);
+    return 0;
+}
+
+/* bench [size ...]
+ * 大きさを省くと 10 100 1000。列は空白区切りで、1 行目が見出し */
+static void bench_cmd(struct Session *s, char **argv) {
+    int sizes[ARGS_MAX] = { 10, 100, 1000 };
+    int nsizes = 3, max = 0;
+    if (argv[1]) nsizes = 0;
+    for (int i = 1; argv[i]; i++) sizes[nsizes++] = atoi(argv[i]);
+    for (int i = 0; i < nsizes; i++) {
+        if (sizes[i] < 1) {
+            fputs("usage: bench [size ...]\n", out);
+            return;
+        }
+        if (sizes[i] > max) max = sizes[i];
+    }
+    if (s->txn) {
+        fputs("bench cannot run inside a transaction\n", out);
+        return;
+    }
+    if (shards.n > 0) {
+        fputs("bench is not available with shards\n", out);
+        return;
+    }
+
+    struct Bench b;
+    memset(&b, 0, sizeof(b));
+    b.null = fopen("/dev/null", "w");
+    b.ns = malloc(sizeof(*b.ns) * (size_t)(max > BENCH_REPEAT ? max : BENCH_REPEAT));
+    if (!b.null || !b.ns) {
+        if (b.null) fclose(b.null);
+        free(b.ns);
+        fputs("memory error\n", out);
+        return;
+    }
+
+    journal_muted = 1;
+    fprintf(out, "%-6s %-6s %6s %5s %6s %12s %10s %10s %10s\n",
+            "mode", "op", "size", "depth", "n", "ops/s", "p50_us", "p99_us", "maxrss_kb");
+    for (b.repl = 0; b.repl < 2; b.repl++) {
+        for (int i = 0; i < nsizes; i++) {
+            for (size_t j = 0; j < sizeof(bench_depths) / sizeof(bench_depths[0]); j++) {
+                if (bench_tree(&b, sizes[i], bench_depths[j]) < 0) fputs("memory error\n", out);
+            }
+        }
+    }
+    journal_muted = 0;
+
+    fclose(b.null);
+    free(b.ns);
+}
+
+/* 1 行分のコマンドを実行する。REPL とサーバーの各接続から呼ばれる */
+static void run_line(struct Session *s, char *line) {
+    char *argv[ARGS_MAX + 1];
+    if (line_is(line, "replay") && !strpbrk(line, "|>") && tokenize(line, argv) > 0) {
+        replay_cmd(s, argv);
+        return;
+    }
+    if (line_is(line, "bench") && !strpbrk(line, "|>") && tokenize(line, argv) > 0) {
+        bench_cmd(s, argv);
+        return;
+    }
+    exec_line(s, line);
+}
+
+/* ===== サーバーモード =====
+ * Unix ドメインソケットで待ち受け、1 本のイベントループで全接続の入出力を扱う。
+ * 接続ごとにセッション（cwd）を持ち、届いた入力はまとめて読んで、そろった行を
+ * 順に実行する。応答は接続ごとに溜め、ループの 1 周につき 1 回の write で返す。
+ * -S なしではループのスレッドが実行し、-S N ではシャードへ振り分ける。
+ * 永続モードでは JOURNAL_FLUSH_MS ごとにジャーナルをまとめて fsync する。 */
+#define JOURNAL_FLUSH_MS 10
+
+static volatile sig_atomic_t server_stop;
+
+static void server_signal(int sig) {
+    (void)sig;
+    server_stop = 1;
+}
+
+static void *journal_flusher(void *arg) {
+    (void)arg;
+    for (;;) {
+        usleep(JOURNAL_FLUSH_MS * 1000);
+        journal_sync();
+    }
+    return NULL;
+}
+
+/* ----- イベントループ -----
+ * Linux では epoll、それ以外では poll で同じ操作を提供する。
+ * 関心は常にレベルトリガで、読み書きの要否は接続側で切り替える。 */
+#define LOOP_EVENTS 256
+
+enum {
+    LOOP_IN = 1,
+    LOOP_OUT = 2,
+    LOOP_HUP = 4,
+};
+
+struct LoopEvent {
+    void *ptr;
+    int ev;
+};
+
+#ifdef __linux__
+
+struct Loop {
+    int ep;
+};
+
+static int loop_init(struct Loop *l) {
+    l->ep = epoll_create1(EPOLL_CLOEXEC);
+    return l->ep < 0 ? -1 : 0;
+}
+
+static int loop_ctl(struct Loop *l, int op, int fd, void *ptr, int want) {
+    struct epoll_event e;
+    memset(&e, 0, sizeof(e));
+    e.events = (want & LOOP_IN ? EPOLLIN : 0) | (want & LOOP_OUT ? EPOLLOUT : 0);
+    e.data.ptr = ptr;
+    return epoll_ctl(l->ep, op, fd, &e);
+}
+
+static int loop_add(struct Loop *l, int fd, void *ptr, int want) {
+    return loop_ctl(l, EPOLL_CTL_ADD, fd, ptr, want);
+}
+
+static int loop_mod(struct Loop *l, int fd, void *ptr, int want) {
+    return loop_ctl(l, EPOLL_CTL_MOD, fd, ptr, want);
+}
+
+static void loop_del(struct Loop *l, int fd) {
+    loop_ctl(l, EPOLL_CTL_DEL, fd, NULL, 0);
+}
+
+static int loop_wait(struct Loop *l, struct LoopEvent *ev, int timeout) {
+    struct epoll_event e[LOOP_EVENTS];
+    int n = epoll_wait(l->ep, e, LOOP_EVENTS, timeout);
+
+    for (int i = 0; i < n; i++) {
+        ev[i].ptr = e[i].data.ptr;
+        ev[i].ev = (e[i].events & EPOLLIN ? LOOP_IN : 0) |
+                   (e[i].events & EPOLLOUT ? LOOP_OUT : 0) |
+                   (e[i].events & (EPOLLHUP | EPOLLERR) ? LOOP_HUP : 0);
+    }
+    return n;
+}
+
+static void loop_free(struct Loop *l) {
+    close(l->ep);
+}
+
+#else
+
+/* 登録順の配列を毎回 poll に渡す。接続数に比例するが移植用なので割り切る */
+struct Loop {
+    struct pollfd *pfd;
+    void **ptr;
+    int n, cap;
+};
+
+static int loop_init(struct Loop *l) {
+    memset(l, 0, sizeof(*l));
+    return 0;
+}
+
+static short loop_events(int want) {
+    return (short)((want & LOOP_IN ? POLLIN : 0) | (want & LOOP_OUT ? POLLOUT : 0));
+}
+
+static int loop_find(struct Loop *l, int fd) {
+    for (int i = 0; i < l->n; i++) {
+        if (l->pfd[i].fd == fd) return i;
+    }
+    return -1;
+}
+
+static int loop_add(struct Loop *l, int fd, void *ptr, int want) {
+    if (l->n == l->cap) {
+        int cap = l->cap ? l->cap * 2 : 64;
+        struct pollfd *p = realloc(l->pfd, sizeof(*p) * (size_t)cap);
+        if (p) l->pfd = p;
+        void **q = realloc(l->ptr, sizeof(*q) * (size_t)cap);
+        if (q) l->ptr = q;
+        if (!p || !q) return -1;
+        l->cap = cap;
+    }
+    l->pfd[l->n] = (struct pollfd){ fd, loop_events(want), 0 };
+    l->ptr[l->n++] = ptr;
+    return 0;
+}
+
+static int loop_mod(struct Loop *l, int fd, void *ptr, int want) {
+    int i = loop_find(l, fd);
+    if (i < 0) return -1;
+    l->pfd[i].events = loop_events(want);
+    l->ptr[i] = ptr;
+    return 0;
+}
+
+static void loop_del(struct Loop *l, int fd) {
+    int i = loop_find(l, fd);
+    if (i < 0) return;
+    l->pfd[i] = l->pfd[--l->n];
+    l->ptr[i] = l->ptr[l->n];
+}
+
+static int loop_wait(struct Loop *l, struct LoopEvent *ev, int timeout) {
+    int r = poll(l->pfd, (nfds_t)l->n, timeout);
+    int n = 0;
+
+    for (int i = 0; r > 0 && i < l->n && n < LOOP_EVENTS; i++) {
+        short re = l->pfd[i].revents;
+        if (!re) continue;
+        ev[n].ptr = l->ptr[i];
+        ev[n++].ev = (re & POLLIN ? LOOP_IN : 0) | (re & POLLOUT ? LOOP_OUT : 0) |
+                     (re & (POLLHUP | POLLERR) ? LOOP_HUP : 0);
+    }
+    return r < 0 ? -1 : n;
+}
+
+static void loop_free(struct Loop *l) {
+    free(l->pfd);
+    free(l->ptr);
+}
+
+#endif
+
+/* ----- 接続 -----
+ * 接続はループのスレッドだけが持ち、-S ではコマンドの実行中だけシャードへ貸す。
+ * 応答はメモリに溜め、ループの 1 周ごとにまとめて書く。書き切れない分は
+ * 書き込み可能を待つ。相手が読まずに OUT_MAX を超えたら次の行を実行しない。 */
+#define OUT_MAX (64 * 1024)
+
+struct Client {
+    int fd;
+    struct Session s;
+    char in[LINE_LEN * 4];      /* 受信済みでまだ実行していない入力 */
+    size_t len;
+    char line[LINE_LEN];        /* 実行中のコマンド */
+    FILE *o;                    /* 未送信の応答。溜めるときだけ開く */
+    char *obuf;
+    size_t olen, osent;
+    int busy;                   /* シャードで実行中 */
+    int eof;                    /* もう読まない */
+    int dead;                   /* もう書けない */
+    int sync_wait;              /* チェックポイントの完了待ち */
+    int want;                   /* ループに登録中の関心 (LOOP_*)。外したら -1 */
+    int queued;                 /* dirty の一覧に載っている */
+    int stalled;                /* stalled の一覧に載っている */
+    struct Client *next;        /* dirty の一覧 */
+    struct Client *stall_next;  /* stalled の一覧 */
+};
+
+static FILE *client_out(struct Client *c) {
+    if (!c->o) {
+        c->o = open_memstream(&c->obuf, &c->olen);
+        c->osent = 0;
+    }
+    return c->o ? c->o : stderr;
+}
+
+static size_t client_backlog(struct Client *c) {
+    if (!c->o) return 0;
+    long pos = ftell(c->o);
+    return pos > 0 ? (size_t)pos - c->osent : 0;
+}
+
+/* 次の 1 行がそろっているか。LINE_LEN を超えた行は途中で切る */
+static size_t client_has_line(const struct Client *c) {
+    const char *nl = memchr(c->in, '\n', c->len);
+    if (nl) return (size_t)(nl - c->in) + 1;
+    if (c->len == sizeof(c->in) || (c->eof && c->len > 0)) return c->len;
+    return 0;
+}
+
+static int client_line(struct Client *c) {
+    size_t n = client_has_line(c);
+    if (n == 0) return 0;
+
+    size_t k = n < LINE_LEN ? n : LINE_LEN - 1;
+    memcpy(c->line, c->in, k);
+    c->line[k] = '\0';
+    trim_newline(c->line);
+
+    memmove(c->in, c->in + n, c->len - n);
+    c->len -= n;
+    return 1;
+}
+
+/* 溜めた応答を書けるだけ書く。書き切ったらバッファを閉じる */
+static void client_flush(struct Client *c) {
+    if (!c->o) return;
+    TRACE_SPAN("output");
+
+    fflush(c->o);
+    while (!c->dead && c->osent < c->olen) {
+        ssize_t w = write(c->fd, c->obuf + c->osent, c->olen - c->osent);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                c->dead = c->eof = 1;
+                c->len = 0;
+            }
+            break;
+        }
+        c->osent += (size_t)w;
+    }
+
+    if (c->dead || c->osent == c->olen) {
+        fclose(c->o);
+        free(c->obuf);
+        c->o = NULL;
+        c->obuf = NULL;
+        c->olen = c->osent = 0;
+    }
+}
+
+/* ----- シャードの実行 ----- */
+
+static void shard_exec(struct Client *c) {
+    out = client_out(c);
+    run_line(&c->s, c->line);
+}
+
+static void *shard_main(void *arg) {
+    struct Shard *sh = arg;
+    self_shard = sh;
+
+#ifdef __linux__
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu > 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET((int)(sh->id % ncpu), &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+#endif
+
+    for (;;) {
+        int did = shard_poll_mesh(sh);
+
+        struct Client *c = spsc_pop(&sh->in);
+        if (c) {
+            shard_exec(c);
+            while (spsc_push(&sh->done, c) < 0) sched_yield();
+            if (__atomic_load_n(&shards.sleeping, __ATOMIC_SEQ_CST)) wake_fd(shards.wake[1]);
+            did = 1;
+        }
+
+        if (!did) {
+            if (__atomic_load_n(&shards.stop, __ATOMIC_SEQ_CST)) break;
+            shard_sleep(sh, 1);
+        }
+    }
+
+    epoch_thread_exit();
+    trace_thread_exit();
+    return NULL;
+}
+
+static int nonblock_pipe(int fds[2]) {
+    if (pipe(fds) < 0) return -1;
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    return 0;
+}
+
+static int shards_start(void) {
+    int n = shards.n;
+    shards.sh = aligned_alloc(64, sizeof(struct Shard) * (size_t)n);
+    if (!shards.sh || nonblock_pipe(shards.wake) < 0) return -1;
+    memset(shards.sh, 0, sizeof(struct Shard) * (size_t)n);
+
+    for (int i = 0; i < n; i++) {
+        struct Shard *sh = &shards.sh[i];
+        sh->id = i;
+        sh->mesh = aligned_alloc(64, sizeof(struct Spsc) * (size_t)n);
+        if (!sh->mesh || pipe(sh->wake) < 0) return -1;
+        memset(sh->mesh, 0, sizeof(struct Spsc) * (size_t)n);
+        fcntl(sh->wake[1], F_SETFL, O_NONBLOCK);
+    }
+    for (int i = 0; i < n; i++) {
+        if (thread_create(&shards.sh[i].tid, shard_main, &shards.sh[i]) != 0) return -1;
+    }
+    return 0;
+}
+
+/* 書き込み系は対象の親ディレクトリの持ち主へ、それ以外は cwd の持ち主へ送る。
+ * リダイレクトがあれば出力先の親ディレクトリの持ち主へ送る。
+ * ディレクトリは消えも動きもしないので、ここで決めた持ち主は実行時も変わらない。
+ * スナップショットの凍結版も名前と親は元と同じなので、同じ持ち主になる */
+static int route(struct Client *c) {
+    char buf[LINE_LEN], name[NAME_LEN], *save;
+    strcpy(buf, c->line);
+    struct Dir *d = c->s.cwd;
+    struct Dir *p = NULL;
+    const struct Snapshot *saved = view;
+    view = c->s.snap;
+
+    char *gt = strrchr(buf, '>');
+    char *cmd = gt ? NULL : strtok_r(buf, " ", &save);
+    char *arg = gt ? strtok_r(gt + 1, " ", &save) : strtok_r(NULL, " ", &save);
+    if (arg && !gt && strcmp(cmd, "ln") == 0 && strcmp(arg, "-s") == 0) {
+        strtok_r(NULL, " ", &save);
+        arg = strtok_r(NULL, " ", &save);   /* ln -s はリンクを作る側 */
+    }
+
+    if (arg && (gt || strcmp(cmd, "touch") == 0 || strcmp(cmd, "rm") == 0 ||
+                strcmp(cmd, "mkdir") == 0 || strcmp(cmd, "mv") == 0 ||
+                strcmp(cmd, "ln") == 0)) {
+        epoch_enter();
+        p = resolve_parent(&c->s, arg, name);
+        epoch_exit();
+    }
+    view = saved;
+    return dir_shard(p ? p : d);
+}
+
+/* ----- ループ本体 ----- */
+
+struct Server {
+    struct Loop loop;
+    struct Dir *root;
+    int lfd;
+    int spare;                  /* fd 枯渇時に接続を断るための予備 */
+    int inflight;               /* シャードで実行中のコマンド数 */
+    int quiesce;                /* チェックポイントのため振り分けを止めている */
+    struct Client *dirty;       /* 応答の送信や後片付けが必要な接続 */
+    struct Client *stalled;     /* quiesce で止めた接続 */
+};
+
+static void client_touch(struct Server *sv, struct Client *c) {
+    if (c->queued) return;
+    c->queued = 1;
+    c->next = sv->dirty;
+    sv->dirty = c;
+}
+
+/* チェックポイントが終わるまで待たせる */
+static void client_stall(struct Server *sv, struct Client *c) {
+    if (c->stalled) return;
+    c->stalled = 1;
+    c->stall_next = sv->stalled;
+    sv->stalled = c;
+}
+
+/* そろった行を順に実行する。-S なしではその場で、-S ではシャードへ 1 つずつ送る。
+ * 相手がもう読めなくても、受け取った分の行は実行する */
+static void client_pump(struct Server *sv, struct Client *c) {
+    int did = 0;
+
+    while (!c->busy && !c->sync_wait && client_backlog(c) < OUT_MAX) {
+        if (shards.n > 0 && sv->quiesce) {
+            if (client_has_line(c)) client_stall(sv, c);
+            break;
+        }
+        if (!client_line(c)) break;
+        did = 1;
+        if (c->line[strspn(c->line, " ")] == '\0') continue;
+        history_add(&c->s, c->line);
+
+        if (shards.n == 0) {
+            out = client_out(c);
+            run_line(&c->s, c->line);
+            if (c->s.done) {
+                c->eof = 1;
+                c->len = 0;
+            }
+        } else if (line_is(c->line, "exit")) {
+            c->eof = 1;
+            c->len = 0;
+        } else if (line_is(c->line, "sync")) {
+            if (journal.fd < 0) {
+                fputs("not in persistent mode\n", client_out(c));
+                continue;
+            }
+            if (__atomic_load_n(&txn_open, __ATOMIC_ACQUIRE) > 0) {
+                fputs("checkpoint deferred: transaction in progress\n", client_out(c));
+                continue;
+            }
+            c->sync_wait = 1;
+            sv->quiesce = 1;
+            client_stall(sv, c);
+        } else {
+            struct Shard *sh = &shards.sh[route(c)];
+            c->busy = 1;
+            sv->inflight++;
+            while (spsc_push(&sh->in, c) < 0) sched_yield();
+            shard_wake(sh);
+        }
+    }
+    if (did) client_touch(sv, c);
+}
+
+static void client_read(struct Server *sv, struct Client *c) {
+    while (!c->eof && c->len < sizeof(c->in)) {
+        ssize_t n = read(c->fd, c->in + c->len, sizeof(c->in) - c->len);
+        if (n > 0) {
+            c->len += (size_t)n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) c->eof = 1;
+        break;
+    }
+    client_pump(sv, c);
+    client_touch(sv, c);
+}
+
+static void client_accept(struct Server *sv) {
+    for (;;) {
+        int fd = accept(sv->lfd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            /* fd が尽きたら予備を空けて 1 本受けて閉じる。待ち行列に残すとレベルトリガーで回り続ける */
+            if ((errno == EMFILE || errno == ENFILE) && sv->spare >= 0) {
+                close(sv->spare);
+                fd = accept(sv->lfd, NULL, NULL);
+                if (fd >= 0) close(fd);
+                sv->spare = open("/dev/null", O_RDONLY);
+                if (fd < 0) return;
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+            return;
+        }
+
+        struct Client *c = calloc(1, sizeof(*c));
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        if (!c || loop_add(&sv->loop, fd, c, LOOP_IN) < 0) {
+            free(c);
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->s = (struct Session){ sv->root, sv->root, 0, NULL, NULL, NULL, { 0, 0, UMASK_DEFAULT } };
+        c->want = LOOP_IN;
+    }
+}
+
+/* 応答を書き、関心を付け直し、終わった接続を閉じる。
+ * 実行中（busy）の接続の応答バッファはシャードが使っているので触らない */
+static void client_settle(struct Server *sv, struct Client *c) {
+    if (!c->busy) {
+        client_flush(c);
+        if (c->eof && !c->sync_wait && !c->stalled && c->len == 0 && !c->o) {
+            if (c->want >= 0) loop_del(&sv->loop, c->fd);
+            close(c->fd);
+            session_free(&c->s);
+            free(c);
+            return;
+        }
+        /* 溜まりすぎで止めていた行を続ける */
+        if (client_has_line(c)) client_pump(sv, c);
+    }
+
+    /* 相手が切れたら外す（レベルトリガの HUP が出続けるため） */
+    if (c->dead) {
+        if (c->want >= 0) loop_del(&sv->loop, c->fd);
+        c->want = -1;
+        return;
+    }
+
+    int want = (!c->eof && c->len < sizeof(c->in) ? LOOP_IN : 0) |
+               (!c->busy && c->o ? LOOP_OUT : 0);
+    if (want != c->want && loop_mod(&sv->loop, c->fd, c, want) == 0) c->want = want;
+}
+
+static void server_complete(struct Server *sv) {
+    for (int i = 0; i < shards.n; i++) {
+        struct Client *c;
+        while ((c = spsc_pop(&shards.sh[i].done)) != NULL) {
+            c->busy = 0;
+            sv->inflight--;
+            client_pump(sv, c);
+            client_touch(sv, c);
+        }
+    }
+
+    /* トランザクションが開いている間は止めない（閉じるコマンドまで止まってしまう） */
+    if (shards.n > 0 && journal.fd >= 0 && journal_checkpoint_due() &&
+        __atomic_load_n(&txn_open, __ATOMIC_ACQUIRE) == 0) {
+        sv->quiesce = 1;
+    }
+    if (!sv->quiesce || sv->inflight > 0) return;
+
+    /* 実行中のコマンドがなくなったので、このスレッドでチェックポイントを取る。
+     * 止める間に begin が届いていたら取らずに再開する */
+    int rc = journal.fd >= 0 ? journal_checkpoint() : 0;
+    sv->quiesce = 0;
+
+    struct Client *c = sv->stalled;
+    sv->stalled = NULL;
+    while (c) {
+        struct Client *next = c->stall_next;
+        c->stalled = 0;
+        c->stall_next = NULL;
+        if (c->sync_wait) {
+            fputs(rc < 0 ? "checkpoint deferred: transaction in progress\n" : "checkpoint done\n",
+                  client_out(c));
+            c->sync_wait = 0;
+        }
+        client_pump(sv, c);
+        client_touch(sv, c);
+        c = next;
+    }
+}
+
+static int serve_loop(int lfd, struct Dir *root) {
+    static char listen_tag, wake_tag;
+    struct Server sv;
+    memset(&sv, 0, sizeof(sv));
+    sv.root = root;
+    sv.lfd = lfd;
+    sv.spare = open("/dev/null", O_RDONLY);
+
+    if (loop_init(&sv.loop) < 0 || (shards.n > 0 && shards_start() < 0)) {
+        fputs("cannot start server\n", stderr);
+        return 1;
+    }
+    fcntl(lfd, F_SETFL, O_NONBLOCK);
+    loop_add(&sv.loop, lfd, &listen_tag, LOOP_IN);
+    if (shards.n > 0) loop_add(&sv.loop, shards.wake[0], &wake_tag, LOOP_IN);
+
+    struct LoopEvent ev[LOOP_EVENTS];
+    while (!server_stop) {
+        server_complete(&sv);
+
+        /* 1 周分の応答をまとめて書く。処理中に載った接続は次の周へ回す */
+        struct Client *c = sv.dirty;
+        sv.dirty = NULL;
+        while (c) {
+            struct Client *next = c->next;
+            c->queued = 0;
+            c->next = NULL;
+            client_settle(&sv, c);
+            c = next;
+        }
+
+        /* 眠ると宣言してから完了キューを見直し、取りこぼしを防ぐ */
+        __atomic_store_n(&shards.sleeping, 1, __ATOMIC_SEQ_CST);
+        int timeout = sv.dirty || (sv.quiesce && sv.inflight == 0) ? 0 : -1;
+        for (int i = 0; i < shards.n; i++) {
+            if (!spsc_empty(&shards.sh[i].done)) timeout = 0;
+        }
+        int n = loop_wait(&sv.loop, ev, timeout);
+        __atomic_store_n(&shards.sleeping, 0, __ATOMIC_SEQ_CST);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("server");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (ev[i].ptr == &listen_tag) {
+                client_accept(&sv);
+            } else if (ev[i].ptr == &wake_tag) {
+                char buf[64];
+                while (read(shards.wake[0], buf, sizeof(buf)) > 0) {}
+            } else {
+                c = ev[i].ptr;
+                if (ev[i].ev & (LOOP_IN | LOOP_HUP)) client_read(&sv, c);
+                if ((ev[i].ev & LOOP_HUP) && c->eof) c->dead = 1;
+                client_touch(&sv, c);
+            }
+        }
+    }
+
+    /* 実行中のコマンドを待ってからシャードを止める */
+    while (sv.inflight > 0) {
+        for (int i = 0; i < shards.n; i++) {
+            while (spsc_pop(&shards.sh[i].done) != NULL) sv.inflight--;
+        }
+        sched_yield();
+    }
+    __atomic_store_n(&shards.stop, 1, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < shards.n; i++) {
+        wake_fd(shards.sh[i].wake[1]);
+        pthread_join(shards.sh[i].tid, NULL);
+    }
+
+    loop_free(&sv.loop);
+    if (sv.spare >= 0) close(sv.spare);
+    epoch_thread_exit();
+    trace_thread_exit();
+    return 0;
+}
+
+static int serve(struct Dir *root, const char *sock_path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(sock_path) >= sizeof(addr.sun_path)) {
+        fputs("socket path too long\n", stderr);
+        return 1;
+    }
+    strcpy(addr.sun_path, sock_path);
+
+    int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(sock_path);
+    if (lfd < 0 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(lfd, SOMAXCONN) < 0) {
+        perror(sock_path);
+        if (lfd >= 0) close(lfd);
+        return 1;
+    }
+
+    /* 多数の接続を持てるよう、fd の上限をハードリミットまで上げる */
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    /* SA_RESTART なしにして、シグナルで待ちを抜ける */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = server_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_t tid;
+    if (journal.fd >= 0 && thread_create(&tid, journal_flusher, NULL) == 0) {
+        pthread_detach(tid);
+    }
+
+    printf("listening on %s\n", sock_path);
+    fflush(stdout);
+
+    int rc = serve_loop(lfd, root);
+
+    close(lfd);
+    unlink(sock_path);
+    return rc;
+}
+
+/* ===== メイン ===== */
+
+int main(int argc, char **argv) {
+    const char *image_path = NULL, *sock_path = NULL;
+    int persist = 0, opt;
+
+    while ((opt = getopt(argc, argv, "p:s:S:tT:")) != -1) {
+        switch (opt) {
+        case 'p':
+            image_path = optarg;
+            persist = 1;
+            break;
+        case 's':
+            sock_path = optarg;
+            break;
+        case 'S':
+            shards.n = atoi(optarg);
+            break;
+        case 't':
+            stats_at_exit = 1;
+            break;
+        case 'T':
+            trace.path = optarg;
+            trace.t0 = trace_now();
+            trace.on = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t] [-T trace.json] [-s socket [-S shards]] [-p image | image]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (!image_path && optind < argc) image_path = argv[optind];
+    if (shards.n < 0 || shards.n > SHARD_MAX || (shards.n > 0 && !sock_path)) {
+        fprintf(stderr, "-S needs -s and 1..%d shards\n", SHARD_MAX);
+        return 1;
+    }
+
+    out = stdout;
+    store_init();
+
+    struct Dir *root;
+    if (image_path && (!persist || access(image_path, F_OK) == 0)) {
+        root = load_image(image_path);
+    } else {
+        root = create_dir("/", NULL);
+        if (root) root->mode = 0755;
+    }
+
+    if (!root || (persist && journal_open(root, image_path) < 0)) {
+        free_dir(root);
+        unload_image();
+        return 1;
+    }
+
+    /* サーバーはシャードを join してから戻るので、木はここで解放してよい */
+    if (sock_path) {
+        int rc = serve(root, sock_path);
+        if (stats_at_exit) stats_print(stderr);
+        cold_stop();
+        journal_close();
+        epoch_drain();
+        graveyard_free();
+        free_dir(root);
+        snapshots_free();
+        store_free();
+        trace_exit();
+        unload_image();
+        return rc;
+    }
+
+    struct Session s = { root, root, 0, NULL, NULL, NULL, { 0, 0, UMASK_DEFAULT } };
+    char line[LINE_LEN];
+    int interactive = isatty(STDIN_FILENO);
+
+    while (!s.done) {
+        /* 対話時は入力待ちの前に確定させる。スクリプト実行時はまとめて fsync */
+        if (interactive) journal_sync();
+
+        /* スクリプト入力ではプロンプトを出さない（tar などの出力を汚さないため） */
+        if (interactive) printf("pseudo-linux:%s> ", s.cwd == root ? "/" : s.cwd->name);
+
+        if (!fgets(line, sizeof(line), stdin)) break;
+        trim_newline(line);
+
+        history_add(&s, line);
+        run_line(&s, line);
     }
 
+    session_free(&s);
+    if (stats_at_exit) stats_print(stderr);
+    cold_stop();
+    journal_close();
+    epoch_drain();
+    graveyard_free();
     free_dir(root);
+    snapshots_free();
+    store_free();
+    trace_exit();
+    unload_image();
     return 0;
 }